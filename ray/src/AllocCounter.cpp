@@ -0,0 +1,75 @@
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+#include "AllocCounter.h"
+
+#ifdef COUNT_ALLOCS
+
+static std::atomic<long long> allocations(0);
+static thread_local bool counting = false;
+
+AllocCountScope::AllocCountScope() {
+	outer = !counting;
+	counting = true;
+}
+
+AllocCountScope::~AllocCountScope() {
+	if (outer)
+		counting = false;
+}
+
+long long tracedAllocations() {
+	return allocations;
+}
+
+void resetTracedAllocations() {
+	allocations = 0;
+}
+
+static void* countedAlloc(size_t size) {
+	if (counting)
+		allocations.fetch_add(1, std::memory_order_relaxed);
+	return malloc(size ? size : 1);
+}
+
+
+// the replacements; delete has to match since new now uses malloc
+
+void* operator new(size_t size) {
+	void* p = countedAlloc(size);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size) {
+	void* p = countedAlloc(size);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) throw() {
+	return countedAlloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) throw() {
+	return countedAlloc(size);
+}
+
+void operator delete(void* p) throw() {
+	free(p);
+}
+
+void operator delete[](void* p) throw() {
+	free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) throw() {
+	free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) throw() {
+	free(p);
+}
+
+#endif // COUNT_ALLOCS
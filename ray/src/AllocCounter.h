@@ -0,0 +1,50 @@
+#ifndef __ALLOCCOUNTER_H__
+#define __ALLOCCOUNTER_H__
+
+// Counts the heap allocations made while tracing, to check that the
+// render loop does not allocate.  operator new is replaced for the whole
+// program, but only allocations made on a thread that is inside an
+// AllocCountScope are counted, so the UI, the parser and the tree build
+// do not show up.
+//
+// Only built with -DCOUNT_ALLOCS, since the replacement puts a check in
+// front of every allocation; otherwise the scope does nothing and no
+// allocations are counted.
+//
+//		void RayTracer::tracePixel(int i, int j) {
+//			AllocCountScope scope;
+//			...
+//		}
+//		printf("%lld\n", tracedAllocations());
+
+#ifdef COUNT_ALLOCS
+
+class AllocCountScope
+{
+public:
+	AllocCountScope();
+	~AllocCountScope();
+
+private:
+	bool outer;
+};
+
+// allocations counted since the last reset
+long long tracedAllocations();
+void resetTracedAllocations();
+
+#else
+
+class AllocCountScope
+{
+public:
+	AllocCountScope() {}
+	~AllocCountScope() {}
+};
+
+inline long long tracedAllocations() { return 0; }
+inline void resetTracedAllocations() {}
+
+#endif // COUNT_ALLOCS
+
+#endif // __ALLOCCOUNTER_H__
@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "Benchmark.h"
+#include "RayTracer.h"
+#include "RenderScheduler.h"
+#include "WavefrontTracer.h"
+#include "PacketTracer.h"
+#include "scene/ray.h"
+#include "scene/bbox.h"
+#include "scene/scene.h"
+#include "SceneObjects/trimesh.h"
+#include "ui/TraceUI.h"
+
+using namespace std;
+
+extern TraceUI* traceUI;
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds(Clock::time_point start) {
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+
+// slab: BoundingBox::intersect against the division-based test it replaced
+//
+
+// the old test: two divisions per axis, skipping axes the ray is parallel to
+static bool slabDivide(const BoundingBox& box, const ray& r, double& tMin, double& tMax) {
+	Vec3d R0 = r.getPosition();
+	Vec3d Rd = r.getDirection();
+	tMin = -1.0e308;
+	tMax = 1.0e308;
+	for (int axis = 0; axis < 3; axis++) {
+		double vd = Rd[axis];
+		if (vd == 0.0) continue;
+		double t1 = (box.getMin()[axis] - R0[axis])/vd;
+		double t2 = (box.getMax()[axis] - R0[axis])/vd;
+		if (t1 > t2) std::swap(t1, t2);
+		if (t1 > tMin) tMin = t1;
+		if (t2 < tMax) tMax = t2;
+		if (tMin > tMax) return false;
+		if (tMax < RAY_EPSILON) return false;
+	}
+	return true;
+}
+
+static void benchSlab() {
+	const int boxNum = 4096;
+	const int rayNum = 4096;
+	const int testsPerRay = 256;
+	const int rounds = 8;
+
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+	std::vector<BoundingBox> boxes;
+	for (int k = 0; k < boxNum; ++k) {
+		Vec3d c(uniform(rng), uniform(rng), uniform(rng));
+		Vec3d h(fabs(uniform(rng)), fabs(uniform(rng)), fabs(uniform(rng)));
+		boxes.push_back(BoundingBox(c - h*0.25, c + h*0.25));
+	}
+	// one ray in eight is parallel to an axis, like camera rays through
+	// the middle of the image
+	std::vector<ray> rays;
+	for (int k = 0; k < rayNum; ++k) {
+		Vec3d d(uniform(rng), uniform(rng), uniform(rng));
+		if (k % 8 == 0) d[k/8 % 3] = 0.0;
+		d.normalize();
+		rays.push_back(ray(Vec3d(uniform(rng), uniform(rng), uniform(rng))*2.0, d));
+	}
+
+	long long tests = (long long)rayNum * testsPerRay * rounds;
+	long long hitsDivide = 0, hitsSlab = 0, differ = 0;
+	double tMin, tMax;
+
+	Clock::time_point start = Clock::now();
+	for (int n = 0; n < rounds; ++n)
+		for (int k = 0; k < rayNum; ++k)
+			for (int j = 0; j < testsPerRay; ++j)
+				hitsDivide += slabDivide(boxes[(k*7 + j) % boxNum], rays[k], tMin, tMax);
+	double tDivide = seconds(start);
+
+	start = Clock::now();
+	for (int n = 0; n < rounds; ++n)
+		for (int k = 0; k < rayNum; ++k)
+			for (int j = 0; j < testsPerRay; ++j)
+				hitsSlab += boxes[(k*7 + j) % boxNum].intersect(rays[k], tMin, tMax);
+	double tSlab = seconds(start);
+
+	// the old test ignored parallel axes, so it also "hits" boxes beside
+	// an axis-parallel ray
+	for (int k = 0; k < rayNum; ++k)
+		for (int j = 0; j < testsPerRay; ++j) {
+			const BoundingBox& box = boxes[(k*7 + j) % boxNum];
+			if (slabDivide(box, rays[k], tMin, tMax) != box.intersect(rays[k], tMin, tMax))
+				++differ;
+		}
+
+	printf("slab: %lld box tests, %lld/%lld hits\n", tests, hitsDivide, hitsSlab);
+	printf("  divide:     %.1f Mtests/s\n", tests / tDivide * 1e-6);
+	printf("  reciprocal: %.1f Mtests/s (%.2fx)\n", tests / tSlab * 1e-6, tDivide / tSlab);
+	printf("  %lld of %d ray/box pairs differ\n", differ, rayNum*testsPerRay);
+}
+
+
+// tri: TrimeshFace::intersect against the plane-and-edges test it replaced
+//
+
+// the old test: plane hit first, then three edge tests, and the normal
+// and smooth normal for every face hit
+static bool triPlane(const TrimeshMesh& mesh, const TrimeshFace& face, const ray& r, isect& i) {
+	const Vec3d& A = mesh.vertices[face[0]];
+	const Vec3d& B = mesh.vertices[face[1]];
+	const Vec3d& C = mesh.vertices[face[2]];
+	Vec3d n = (A-C)^(B-C);
+	if (!n.iszero())
+		n.normalize();
+	double d_ = -(n*A);
+	if (n*r.d == 0)
+		return false;
+	double t = -(n*r.p+d_)/(n*r.d);
+	if (t < RAY_EPSILON)
+		return false;
+	Vec3d Q = r.at(t);
+	double gamma = n*((B-A)^(Q-A));
+	if (gamma < 0) return false;
+	double alpha = n*((C-B)^(Q-B));
+	if (alpha < 0) return false;
+	double beta = n*((A-C)^(Q-C));
+	if (beta < 0) return false;
+	double deno = alpha+beta+gamma;
+	alpha /= deno;
+	beta /= deno;
+	gamma /= deno;
+	i.t = t;
+	i.N = n;
+	i.setBary(alpha, beta, gamma);
+	i.setUVCoordinates(Vec2d(alpha, beta));
+	if (!mesh.normals.empty()) {
+		i.N = alpha*mesh.normals[face[0]] + beta*mesh.normals[face[1]] + gamma*mesh.normals[face[2]];
+		i.N.normalize();
+	}
+	return true;
+}
+
+// every face of the largest mesh in the scene against random rays aimed
+// into its bounding box, without a tree
+static void benchTri(RayTracer* tracer) {
+	if (!tracer->sceneLoaded()) {
+		printf("tri: needs a scene with a trimesh, e.g. ray -m tri dragon.ray\n");
+		return;
+	}
+	const TrimeshMesh* mesh = NULL;
+	const Scene& scene = tracer->getScene();
+	for (std::vector<Geometry*>::const_iterator g = scene.beginObjects(); g != scene.endObjects(); ++g) {
+		const Trimesh* tmesh = dynamic_cast<const Trimesh*>(*g);
+		if (tmesh && (!mesh || tmesh->getMesh()->faces.size() > mesh->faces.size()))
+			mesh = tmesh->getMesh();
+	}
+	if (!mesh || mesh->faces.empty()) {
+		printf("tri: the scene has no trimesh\n");
+		return;
+	}
+
+	const TrimeshMesh::Faces& faces = mesh->faces;
+	const int faceNum = faces.size();
+	const int rayNum = std::max(64, 20000000 / faceNum);
+	Vec3d lo = mesh->vertices[0], hi = mesh->vertices[0];
+	for (size_t k = 1; k < mesh->vertices.size(); ++k) {
+		lo = minimum(lo, mesh->vertices[k]);
+		hi = maximum(hi, mesh->vertices[k]);
+	}
+	Vec3d center = (lo + hi) * 0.5;
+	double radius = (hi - lo).length();
+
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	std::vector<ray> rays;
+	for (int k = 0; k < rayNum; ++k) {
+		Vec3d from(uniform(rng) - 0.5, uniform(rng) - 0.5, uniform(rng) - 0.5);
+		from.normalize();
+		from = center + from * radius;
+		Vec3d to(lo[0] + uniform(rng)*(hi[0]-lo[0]), lo[1] + uniform(rng)*(hi[1]-lo[1]),
+			lo[2] + uniform(rng)*(hi[2]-lo[2]));
+		Vec3d d = to - from;
+		d.normalize();
+		rays.push_back(ray(from, d));
+	}
+
+	long long tests = (long long)rayNum * faceNum;
+	long long hitsPlane = 0, hitsMT = 0, differ = 0;
+
+	Clock::time_point start = Clock::now();
+	for (int k = 0; k < rayNum; ++k)
+		for (int j = 0; j < faceNum; ++j) {
+			isect i;
+			hitsPlane += triPlane(*mesh, faces[j], rays[k], i);
+		}
+	double tPlane = seconds(start);
+
+	start = Clock::now();
+	for (int k = 0; k < rayNum; ++k)
+		for (int j = 0; j < faceNum; ++j) {
+			isect i;
+			hitsMT += faces[j].intersect(rays[k], i);
+		}
+	double tMT = seconds(start);
+
+	// the two disagree only about rays through an edge or a vertex
+	for (int k = 0; k < rayNum; ++k)
+		for (int j = 0; j < faceNum; ++j) {
+			isect a, b;
+			if (triPlane(*mesh, faces[j], rays[k], a) != faces[j].intersect(rays[k], b))
+				++differ;
+		}
+
+	printf("tri: %d faces x %d rays = %lld triangle tests, %lld/%lld hits\n",
+		faceNum, rayNum, tests, hitsPlane, hitsMT);
+	printf("  plane + edges:    %.1f Mtris/s\n", tests / tPlane * 1e-6);
+	printf("  moller-trumbore:  %.1f Mtris/s (%.2fx)\n", tests / tMT * 1e-6, tPlane / tMT);
+	printf("  %lld ray/face pairs differ\n", differ);
+}
+
+
+// wavefront: the whole image on one thread, tile by tile, traced depth
+// first by tracePixel and as ray streams by WavefrontTracer, unsorted and
+// sorted.  Takes -w, -r and -s like a render.
+//
+
+static int countDiffering(const std::vector<unsigned char>& a, const unsigned char* b, int& maxDiff) {
+	int differ = 0;
+	maxDiff = 0;
+	for (size_t k = 0; k < a.size(); ++k) {
+		int d = abs((int)a[k] - (int)b[k]);
+		differ += d != 0;
+		maxDiff = std::max(maxDiff, d);
+	}
+	return differ;
+}
+
+static void benchWavefront(RayTracer* tracer) {
+	if (!tracer->sceneLoaded()) {
+		printf("wavefront: needs a scene, e.g. ray -m wavefront -r 5 reflection.ray\n");
+		return;
+	}
+	const Scene& scene = tracer->getScene();
+	int width = traceUI->getSize();
+	int height = (int)(width / tracer->aspectRatio() + 0.5);
+	int tilesX = (width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	int tilesY = (height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	printf("wavefront: %dx%d pixels, depth %d, %d samples per pixel, %d tiles\n",
+		width, height, tracer->getSettings().depth, tracer->getSettings().superSamplingNum, tilesX*tilesY);
+
+	tracer->traceSetup(width, height);
+	Clock::time_point start = Clock::now();
+	for (int ty = 0; ty < tilesY; ++ty)
+		for (int tx = 0; tx < tilesX; ++tx)
+			for (int y = ty*RENDER_TILE_SIZE; y < std::min(height, (ty+1)*RENDER_TILE_SIZE); ++y)
+				for (int x = tx*RENDER_TILE_SIZE; x < std::min(width, (tx+1)*RENDER_TILE_SIZE); ++x)
+					tracer->tracePixel(x, y);
+	double tDepth = seconds(start);
+	long long rays = scene.getRayNum();
+	std::vector<unsigned char> reference(tracer->buffer, tracer->buffer + tracer->bufferSize);
+	printf("  depth first:        %.3fs, %.2f Mrays/s\n", tDepth, rays / tDepth * 1e-6);
+
+	for (int sorted = 0; sorted < 2; ++sorted) {
+		tracer->traceSetup(width, height);
+		WavefrontTracer wavefront(tracer);
+		wavefront.setSorting(sorted != 0);
+		start = Clock::now();
+		for (int ty = 0; ty < tilesY; ++ty)
+			for (int tx = 0; tx < tilesX; ++tx)
+				wavefront.traceTile(tx*RENDER_TILE_SIZE, ty*RENDER_TILE_SIZE,
+					std::min(width, (tx+1)*RENDER_TILE_SIZE), std::min(height, (ty+1)*RENDER_TILE_SIZE));
+		double t = seconds(start);
+		int maxDiff;
+		int differ = countDiffering(reference, tracer->buffer, maxDiff);
+		printf("  wavefront%s  %.3fs, %.2f Mrays/s (%.2fx), %d bytes differ (max %d)\n",
+			sorted ? ", sorted:  " : ", unsorted:", t, scene.getRayNum() / t * 1e-6, tDepth / t, differ, maxDiff);
+		if (sorted)
+			printf("  streams: %lld primary, %lld secondary, %lld shadow rays\n",
+				wavefront.getPrimaryNum(), wavefront.getSecondaryNum(), wavefront.getShadowNum());
+	}
+}
+
+
+// packet: the camera rays through every pixel centre, intersected one by
+// one and in packets of 4 and 8, and then whole renders of the image, by
+// tracePixel and by PacketTracer.  Takes -w, -r and -s like a render.
+//
+
+struct PrimaryHit {
+	const SceneObject* obj;
+	int part;
+	double t;
+};
+
+static void benchPacket(RayTracer* tracer) {
+	if (!tracer->sceneLoaded()) {
+		printf("packet: needs a scene, e.g. ray -m packet -w 512 dragon.ray\n");
+		return;
+	}
+	const Scene& scene = tracer->getScene();
+	int width = traceUI->getSize();
+	int height = (int)(width / tracer->aspectRatio() + 0.5);
+	int tilesX = (width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	int tilesY = (height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	const int rounds = 4;
+	printf("packet: %dx%d pixels, %s kernels\n", width, height, packetKernelName());
+
+	std::vector<ray> rays;
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x) {
+			ray r(Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY);
+			tracer->scene->getCamera().rayThrough(double(x)/double(width), double(y)/double(height), r);
+			rays.push_back(r);
+		}
+
+	std::vector<PrimaryHit> reference(rays.size());
+	Clock::time_point start = Clock::now();
+	for (int round = 0; round < rounds; ++round)
+		for (size_t k = 0; k < rays.size(); ++k) {
+			ray r(rays[k]);
+			isect i;
+			scene.intersect(r, i);
+			reference[k].obj = i.obj;
+			reference[k].part = i.part;
+			reference[k].t = i.t;
+		}
+	double tScalar = seconds(start);
+	double n = double(rays.size()) * rounds;
+	printf("  primary, scalar:    %.3fs, %.2f Mrays/s\n", tScalar, n / tScalar * 1e-6);
+
+	for (int size = 4; size <= 8; size += 4) {
+		int blockWidth = size / 2;
+		long long differ = 0;
+		start = Clock::now();
+		for (int round = 0; round < rounds; ++round)
+			for (int by = 0; by < height; by += 2)
+				for (int bx = 0; bx < width; bx += blockWidth) {
+					RayPacket pk(size);
+					int index[PACKET_MAX];
+					int lanes = 0;
+					for (int y = by; y < std::min(by + 2, height); ++y)
+						for (int x = bx; x < std::min(bx + blockWidth, width); ++x)
+							index[lanes++] = x + y * width;
+					for (int k = 0; k < size; ++k)
+						pk.set(k, rays[index[k < lanes ? k : 0]]);
+					isect hits[PACKET_MAX];
+					scene.intersectPacket(pk, (1 << lanes) - 1, hits);
+					if (round > 0)
+						continue;
+					for (int k = 0; k < lanes; ++k) {
+						const PrimaryHit& h = reference[index[k]];
+						differ += hits[k].obj != h.obj || (h.obj && (hits[k].part != h.part || hits[k].t != h.t));
+					}
+				}
+		double t = seconds(start);
+		printf("  primary, packet %d:  %.3fs, %.2f Mrays/s (%.2fx), %lld hits differ\n",
+			size, t, n / t * 1e-6, tScalar / t, differ);
+	}
+
+	tracer->traceSetup(width, height);
+	start = Clock::now();
+	for (int ty = 0; ty < tilesY; ++ty)
+		for (int tx = 0; tx < tilesX; ++tx)
+			for (int y = ty*RENDER_TILE_SIZE; y < std::min(height, (ty+1)*RENDER_TILE_SIZE); ++y)
+				for (int x = tx*RENDER_TILE_SIZE; x < std::min(width, (tx+1)*RENDER_TILE_SIZE); ++x)
+					tracer->tracePixel(x, y);
+	double tRender = seconds(start);
+	std::vector<unsigned char> image(tracer->buffer, tracer->buffer + tracer->bufferSize);
+	printf("  render, scalar:     %.3fs, %.2f Mrays/s\n", tRender, scene.getRayNum() / tRender * 1e-6);
+
+	for (int size = 4; size <= 8; size += 4) {
+		tracer->traceSetup(width, height);
+		PacketTracer packets(tracer, size);
+		start = Clock::now();
+		for (int ty = 0; ty < tilesY; ++ty)
+			for (int tx = 0; tx < tilesX; ++tx)
+				packets.traceTile(tx*RENDER_TILE_SIZE, ty*RENDER_TILE_SIZE,
+					std::min(width, (tx+1)*RENDER_TILE_SIZE), std::min(height, (ty+1)*RENDER_TILE_SIZE));
+		double t = seconds(start);
+		int maxDiff;
+		int differ = countDiffering(image, tracer->buffer, maxDiff);
+		printf("  render, packet %d:   %.3fs, %.2f Mrays/s (%.2fx), %d bytes differ (max %d)\n",
+			size, t, scene.getRayNum() / t * 1e-6, tRender / t, differ, maxDiff);
+	}
+}
+
+
+bool runBenchmark(const std::string& name, RayTracer* tracer) {
+	if (name == "slab") {
+		benchSlab();
+		return true;
+	}
+	if (name == "tri") {
+		benchTri(tracer);
+		return true;
+	}
+	if (name == "wavefront") {
+		benchWavefront(tracer);
+		return true;
+	}
+	if (name == "packet") {
+		benchPacket(tracer);
+		return true;
+	}
+	return false;
+}
+
+const char* benchmarkNames() {
+	return "slab, tri, wavefront, packet";
+}
@@ -0,0 +1,22 @@
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__
+
+// Microbenchmarks for the inner loops of the tracer, run from the command
+// line instead of rendering:
+//
+//		ray -m <name> [input.ray]
+//
+// Each one times the current code and, where it replaced an older
+// version, the older version on the same data, and prints the rates.
+
+#include <string>
+
+class RayTracer;
+
+// false if there is no benchmark of that name
+bool runBenchmark(const std::string& name, RayTracer* tracer);
+
+// names of the available benchmarks, for the usage message
+const char* benchmarkNames();
+
+#endif // __BENCHMARK_H__
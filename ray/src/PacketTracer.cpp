@@ -0,0 +1,86 @@
+#include <algorithm>
+
+#include "PacketTracer.h"
+#include "RayTracer.h"
+#include "AllocCounter.h"
+#include "Sampler.h"
+#include "scene/scene.h"
+#include "scene/RayPacket.h"
+
+PacketTracer::PacketTracer(RayTracer* tracer, int size)
+	: tracer(tracer), rayNum(0), packetNum(0)
+{
+	this->size = size >= 8 ? 8 : 4;
+	blockWidth = this->size / 2;
+	blockHeight = 2;
+}
+
+void PacketTracer::traceTile(int x0, int y0, int x1, int y1)
+{
+	if (!tracer->sceneLoaded())
+		return;
+	AllocCountScope countAllocations;
+
+	Scene* scene = tracer->scene;
+	int width = tracer->buffer_width;
+	int height = tracer->buffer_height;
+	int sampNum = std::max(1, tracer->getSettings().superSamplingNum);
+	int depth = tracer->getSettings().depth;
+	double d_x = 0.5/double(width);
+	double d_y = 0.5/double(height);
+
+	for (int by = y0; by < y1; by += blockHeight)
+		for (int bx = x0; bx < x1; bx += blockWidth) {
+			// the pixels of the block, fewer at the right and bottom edges
+			int px[PACKET_MAX], py[PACKET_MAX];
+			int lanes = 0;
+			for (int j = by; j < std::min(by + blockHeight, y1); ++j)
+				for (int i = bx; i < std::min(bx + blockWidth, x1); ++i) {
+					px[lanes] = i;
+					py[lanes] = j;
+					++lanes;
+				}
+			int mask = (1 << lanes) - 1;
+
+			Vec3d col[PACKET_MAX];
+			for (int s = 0; s < sampNum; ++s) {
+				RayPacket pk(size);
+				for (int k = 0; k < size; ++k) {
+					// spare lanes repeat the first ray, so the kernels see numbers
+					int l = k < lanes ? k : 0;
+					double x = double(px[l])/double(width);
+					double y = double(py[l])/double(height);
+					ray r(Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY);
+					if (sampNum == 1) {
+						scene->getCamera().rayThrough(x, y, r);
+					} else {
+						PixelSampler sampler(px[l] + (uint64_t)py[l] * width, tracer->getFrame());
+						double u, v;
+						sampler.get(s, u, v);
+						scene->getCamera().rayThrough(x - d_x + 2.0*d_x*u, y - d_y + 2.0*d_y*v, r);
+					}
+					pk.set(k, r);
+				}
+
+				isect hits[PACKET_MAX];
+				scene->intersectPacket(pk, mask, hits);
+				for (int k = 0; k < lanes; ++k) {
+					Vec3d c = tracer->traceRay(pk.get(k), depth, &hits[k]);
+					c.clamp();
+					col[k] += c;
+				}
+				rayNum += lanes;
+				++packetNum;
+			}
+
+			for (int k = 0; k < lanes; ++k) {
+				if (sampNum > 1)
+					col[k] /= sampNum;
+				unsigned char *pixel = tracer->buffer + ( px[k] + py[k] * width ) * 3;
+				pixel[0] = (int)( 255.0 * col[k][0]);
+				pixel[1] = (int)( 255.0 * col[k][1]);
+				pixel[2] = (int)( 255.0 * col[k][2]);
+				tracer->sampleCounts[px[k] + py[k] * width] = sampNum;
+			}
+		}
+}
@@ -0,0 +1,41 @@
+#ifndef __PACKETTRACER_H__
+#define __PACKETTRACER_H__
+
+// Traces a tile with the camera rays in packets: the rays of a 2x2 block
+// of pixels (packets of 4) or a 4x2 block (packets of 8) go through the
+// kd trees together, with SIMD box and triangle tests, by
+// Scene::intersectPacket.  With supersampling every packet holds the same
+// sample of each pixel of its block.  Each ray's hit is then shaded and
+// followed one ray at a time by RayTracer::traceRay, so the image is
+// exactly the one tracePixel makes.
+//
+// Secondary and shadow rays are no longer coherent enough to be worth
+// packing, so they are left as they are.  Keep one PacketTracer per thread.
+//
+//		PacketTracer pt(tracer, 8);
+//		pt.traceTile(0, 0, 16, 16);
+
+class RayTracer;
+
+class PacketTracer
+{
+public:
+	PacketTracer(RayTracer* tracer, int size);
+
+	// trace pixels [x0, x1) x [y0, y1) into the tracer's buffer
+	void traceTile(int x0, int y0, int x1, int y1);
+
+	int getSize() const { return size; }
+
+	// camera rays traced so far, and the packets they went in
+	long long getRayNum() const { return rayNum; }
+	long long getPacketNum() const { return packetNum; }
+
+private:
+	RayTracer* tracer;
+	int size;
+	int blockWidth, blockHeight;
+	long long rayNum, packetNum;
+};
+
+#endif // __PACKETTRACER_H__
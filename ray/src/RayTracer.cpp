@@ -11,8 +11,15 @@
 #include "parser/Parser.h"
 
 #include "ui/TraceUI.h"
+#include "AllocCounter.h"
+#include "Sampler.h"
+#include "fileio/bitmap.h"
+#include "fileio/mappedfile.h"
+#include "fileio/scenefile.h"
 #include <cmath>
 #include <algorithm>
+#include <chrono>
+#include <memory>
 
 extern TraceUI* traceUI;
 
@@ -26,14 +33,6 @@ using namespace std;
 // in TraceGLWindow, for example.
 bool debugMode = false;
 
-// used for super sampling
-float RandomFloat(float a, float b) {
-    float random = ((float) rand()) / (float) RAND_MAX;
-    float diff = b - a;
-    float r = random * diff;
-    return a + r;
-}
-
 // Trace a top-level ray through pixel(i,j), i.e. normalized window coordinates (x,y),
 // through the projection plane, and out into the scene.  All we do is
 // enter the main ray-tracing method, getting things started by plugging
@@ -42,10 +41,10 @@ float RandomFloat(float a, float b) {
 Vec3d RayTracer::trace(double x, double y)
 {
   // Clear out the ray cache in the scene for debugging purposes,
-  if (TraceUI::m_debug) scene->intersectCache.clear();
+  if (settings.debug) scene->intersectCache.clear();
   ray r(Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY);
   scene->getCamera().rayThrough(x,y,r);
-  Vec3d ret = traceRay(r, traceUI->getDepth(), Vec3d(1,1,1));
+  Vec3d ret = traceRay(r, settings.depth);
   ret.clamp();
   return ret;
 }
@@ -56,6 +55,8 @@ Vec3d RayTracer::tracePixel(int i, int j)
 
 	if( ! sceneLoaded() ) return col;
 
+	AllocCountScope countAllocations;
+
 	double x = double(i)/double(buffer_width);
 	double y = double(j)/double(buffer_height);
 	double d_x = 0.5/double(buffer_width);
@@ -63,15 +64,19 @@ Vec3d RayTracer::tracePixel(int i, int j)
 
 	unsigned char *pixel = buffer + ( i + j * buffer_width ) * 3;
 
-	int sampNum = traceUI->getSuperSamplingNum();
-	if (sampNum == 1) {
+	int sampNum = settings.superSamplingNum;
+	int traced = sampNum;
+	if (settings.adaptive && sampNum > 1) {
+		col = traceAdaptive(i, j, sampNum, traced);
+	} else if (sampNum == 1) {
 		col = trace(x,y);
 	} else {
-		double new_x, new_y;
+		// the same samples for this pixel whatever thread traces it
+		PixelSampler sampler(i + (uint64_t)j * buffer_width, frame);
+		double u, v;
 		for (int s=0;s<sampNum; ++s) {
-			new_x = RandomFloat(x-d_x,x+d_x);
-			new_y = RandomFloat(y-d_y,y+d_y);
-			col += trace(new_x, new_y);
+			sampler.get(s, u, v);
+			col += trace(x - d_x + 2.0*d_x*u, y - d_y + 2.0*d_y*v);
 		}
 		col /= sampNum;
 	}
@@ -79,137 +84,305 @@ Vec3d RayTracer::tracePixel(int i, int j)
 	pixel[0] = (int)( 255.0 * col[0]);
 	pixel[1] = (int)( 255.0 * col[1]);
 	pixel[2] = (int)( 255.0 * col[2]);
+	sampleCounts[i + j * buffer_width] = traced;
 	return col;
 }
 
+// ADAPTIVE_MIN_SAMPLES, or fewer if the budget is smaller still, so that
+// the budget holds for the base samples too
+int RayTracer::adaptiveBaseSamples(int maxSamples) const
+{
+	int base = std::min(ADAPTIVE_MIN_SAMPLES, maxSamples);
+	if (settings.sampleBudget > 0)
+		base = std::min(base, std::max(1, settings.sampleBudget));
+	return base;
+}
+
+// Adaptive supersampling: adaptiveBaseSamples() first, then batches of
+// ADAPTIVE_BATCH while the standard error of the pixel's mean, in its
+// worst channel, is above the threshold.  Stops at maxSamples, or when
+// the shared budget of extra samples is spent.  Flat pixels (background,
+// cubemap, plain diffuse) stop after the first few.
+Vec3d RayTracer::traceAdaptive(int i, int j, int maxSamples, int& traced)
+{
+	double x = double(i)/double(buffer_width);
+	double y = double(j)/double(buffer_height);
+	double d_x = 0.5/double(buffer_width);
+	double d_y = 0.5/double(buffer_height);
+	double threshold = settings.adaptiveThres;
+	bool budgeted = settings.sampleBudget > 0;
+
+	PixelSampler sampler(i + (uint64_t)j * buffer_width, frame);
+	Vec3d sum(0,0,0), sumSq(0,0,0);
+	int n = 0;
+	int target = adaptiveBaseSamples(maxSamples);
+	for (;;) {
+		double u, v;
+		for (; n < target; ++n) {
+			sampler.get(n, u, v);
+			Vec3d c = trace(x - d_x + 2.0*d_x*u, y - d_y + 2.0*d_y*v);
+			sum += c;
+			sumSq += prod(c, c);
+		}
+		// one sample has no error to go by
+		if (n >= maxSamples || n < 2)
+			break;
+
+		double error = 0.0;
+		for (int k = 0; k < 3; ++k) {
+			double var = (sumSq[k] - sum[k]*sum[k]/n) / (n - 1);
+			error = std::max(error, var > 0.0 ? sqrt(var / n) : 0.0);
+		}
+		if (error <= threshold)
+			break;
+
+		int batch = std::min(ADAPTIVE_BATCH, maxSamples - n);
+		if (budgeted && samplesLeft.fetch_sub(batch) < batch) {
+			samplesLeft += batch;
+			break;
+		}
+		target = n + batch;
+	}
+	traced = n;
+	return sum / n;
+}
+
+// After n passes a pixel holds the same samples as a -s n render of it,
+// but they are added up in float over time instead of all at once.
+void RayTracer::tracePass(int i, int j, int pass)
+{
+	if( ! sceneLoaded() ) return;
+	AllocCountScope countAllocations;
+
+	double x = double(i)/double(buffer_width);
+	double y = double(j)/double(buffer_height);
+	double d_x = 0.5/double(buffer_width);
+	double d_y = 0.5/double(buffer_height);
+	int k = i + j * buffer_width;
+
+	PixelSampler sampler(k, frame);
+	double u, v;
+	sampler.get(pass, u, v);
+	Vec3d col = trace(x - d_x + 2.0*d_x*u, y - d_y + 2.0*d_y*v);
+
+	float* sum = accum + 3*k;
+	sum[0] += (float)col[0];
+	sum[1] += (float)col[1];
+	sum[2] += (float)col[2];
+	// after the sum, so resolveBuffer never divides a sum by more samples
+	// than it holds
+	sampleCounts[k].store(sampleCounts[k].load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
 
-// Do recursive ray tracing!  You'll want to insert a lot of code here
-// (or places called from here) to handle reflection, refraction, etc etc.
-// depth: Max depth of recursion
-Vec3d RayTracer::traceRay(ray& r, int depth, Vec3d last_factor)
+// Traces one eye ray and everything it spawns, without recursion.  The
+// rays still to do wait on a fixed stack as RayRecords, each with its
+// throughput: the product of the kr and kt it was reflected and refracted
+// by, i.e. how much of its colour reaches the pixel.  Popping a record
+// shades its hit, weighted by that, and pushes at most a reflected and a
+// refracted record one level deeper.  Every level then leaves at most one
+// record waiting, so depth+1 entries are enough and no pixel needs more
+// memory or C++ stack than any other.  Rays whose throughput falls below
+// the termination threshold are not traced at all.
+Vec3d RayTracer::traceRay(const ray& r, int depth, const isect* first)
 {
-	// check recursion depth
+	Vec3d I(0.0, 0.0, 0.0);
 	if (depth < 0)
-		return Vec3d(0.0,0.0,0.0);
-
-	isect i;
-	Vec3d I;
-
-	if(scene->intersect(r, i)) {
-		// YOUR CODE HERE
-
-		// An intersection occurred!  We've got work to do.  For now,
-		// this code gets the material for the surface that was intersected,
-		// and asks that material to provide a color for the ray.  
-
-		// This is a great place to insert code for recursive ray tracing.
-		// Instead of just returning the result of shade(), add some
-		// more steps: add in the contributions from reflected and refracted
-		// rays.
-
-		// shade model
-	  	const Material& m = i.getMaterial();
-	  	I = m.shade(scene, r, i);
-
-	  	// reflection model
-	  	Vec3d Q = r.at(i.t);
-	  	Vec3d N = i.N;
-	  	Vec3d V = -r.d;
-		Vec3d R = 2*N*(N*V)-V;
-	  	if (!m.kr(i).iszero()) {
-	  		Vec3d cur_factor = prod(m.kr(i), last_factor);
-	  		if (cur_factor.length() < traceUI->getTermThres()*0.001) {
-	  			
-	  		} else {
-		  		ray r_2nd(Q, R, ray::REFLECTION);
-		  		I += prod(m.kr(i), traceRay(r_2nd, depth-1, cur_factor));
-		  	}
-	  	}
-
-	  	// refraction model
-	  	if (!m.kt(i).iszero()) {
-	  		double index;
-	  		// inside or outside
-	  		if (V*N>0) 
-	  			index = 1.0/m.index(i);
-	  		else {
-	  			index = m.index(i);
-	  			N = -N;
-	  		}
-
-	  		Vec3d S_i = N*(N*V) - V;
-	  		Vec3d S_t = index*S_i;
-	  		// Check full reflection
-	  		if ((1.0-S_t*S_t) > 0) {
-	  			Vec3d cur_factor = prod(m.kr(i), last_factor);
-		  		if (cur_factor.length() < traceUI->getTermThres()*0.001) {
-
-		  		} else {
-
-		  			Vec3d T = S_t - N*sqrt(1.0-S_t*S_t);
-		  			ray r_2nd(Q,T,ray::REFRACTION);
-		  			I += prod(m.kt(i), traceRay(r_2nd, depth-1, cur_factor));		
-		  		}
-	  		}
-	  	}
+		return I;
+	if (depth > TRACE_MAX_DEPTH)
+		depth = TRACE_MAX_DEPTH;
+	double threshold = settings.termThres;
+
+	RayRecord stack[TRACE_MAX_DEPTH+1];
+	int top = 0;
+	stack[top].p = r.p;
+	stack[top].d = r.d;
+	stack[top].type = r.type();
+	stack[top].weight = Vec3d(1.0, 1.0, 1.0);
+	stack[top].depth = depth;
+	++top;
+
+	while (top > 0) {
+		const RayRecord rec = stack[--top];
+		ray cur(rec.p, rec.d, rec.type);
+		isect i;
+		bool hit;
+		if (first) {
+			i = *first;
+			hit = i.obj != NULL;
+			first = NULL;
+		} else
+			hit = scene->intersect(cur, i);
+
+		if (!hit) {
+			// No intersection.  This ray travels to infinity, so we color
+			// it according to the cube map, or black without one.
+			if (haveCubeMap() && settings.useCubeMap)
+				I += prod(rec.weight, getCubeMap()->getColor(cur, settings.filterWidth));
+			continue;
+		}
 
-	} else {
-		// No intersection.  This ray travels to infinity, so we color
-		// it according to the background color, which in this (simple) case
-		// is just black.
-		I = Vec3d(0.0, 0.0, 0.0);
-		if (haveCubeMap() && traceUI->isUsingCubeMap()) {
-			CubeMap* cubemap = getCubeMap();
-			I = cubemap->getColor(r);
+		// shade model; the hit is final, so per-vertex materials are
+		// blended only now, once, on the stack
+		Material scratch;
+		const Material& m = i.resolveMaterial(scratch);
+		I += prod(rec.weight, m.shade(scene, cur, i));
+		if (rec.depth == 0)
+			continue;
+
+		Vec3d Q = cur.at(i.t);
+		Vec3d N = i.N;
+		Vec3d V = -cur.d;
+
+		// refraction model, pushed first so the reflection is traced first
+		Vec3d kt = m.kt(i);
+		if (!kt.iszero()) {
+			double index;
+			// inside or outside
+			if (V*N>0)
+				index = 1.0/m.index(i);
+			else {
+				index = m.index(i);
+				N = -N;
+			}
+
+			Vec3d S_i = N*(N*V) - V;
+			Vec3d S_t = index*S_i;
+			// Check full reflection
+			Vec3d weight = prod(kt, rec.weight);
+			if ((1.0-S_t*S_t) > 0 && weight.length() >= threshold) {
+				RayRecord& next = stack[top++];
+				next.p = Q;
+				next.d = S_t - N*sqrt(1.0-S_t*S_t);
+				next.type = ray::REFRACTION;
+				next.weight = weight;
+				next.depth = rec.depth-1;
+			}
+			N = i.N;
+		}
+
+		// reflection model
+		Vec3d kr = m.kr(i);
+		if (!kr.iszero()) {
+			Vec3d weight = prod(kr, rec.weight);
+			if (weight.length() >= threshold) {
+				RayRecord& next = stack[top++];
+				next.p = Q;
+				next.d = 2*N*(N*V)-V;
+				next.type = ray::REFLECTION;
+				next.weight = weight;
+				next.depth = rec.depth-1;
+			}
 		}
 	}
 	return I;
 }
 
 RayTracer::RayTracer()
-	: scene(0), buffer(0), buffer_width(256), buffer_height(256), m_bBufferReady(false)
+	: scene(0), buffer(0), accum(0), sampleCounts(0), progressive(false), wavefront(false), packetSize(0),
+	  buffer_width(256), buffer_height(256), frame(0), m_bBufferReady(false)
 {}
 
 RayTracer::~RayTracer()
 {
 	delete scene;
 	delete [] buffer;
+	delete [] accum;
+	delete [] sampleCounts;
+}
+
+void RayTracer::setSettings(const RenderSettings& s)
+{
+	settings = s;
+	if (sceneLoaded())
+		scene->setSettings(s);
 }
 
 void RayTracer::getBuffer( unsigned char *&buf, int &w, int &h )
 {
+	if (progressive)
+		resolveBuffer();
 	buf = buffer;
 	w = buffer_width;
 	h = buffer_height;
 }
 
+// Every pixel is divided by its own sample count, so a pass that was
+// stopped halfway still gives a whole frame.  Pixels not traced at all
+// are left as they were.
+// This runs while the passes are still being traced: the count is read
+// before the sum, so the sum holds at least that many samples, but it may
+// already hold part of the next one, so the result is clamped.
+void RayTracer::resolveBuffer()
+{
+	if (!accum)
+		return;
+	int pixels = buffer_width * buffer_height;
+	for (int k = 0; k < pixels; ++k) {
+		int n = sampleCounts[k].load(std::memory_order_acquire);
+		if (n == 0)
+			continue;
+		const float* sum = accum + 3*k;
+		unsigned char* pixel = buffer + 3*k;
+		pixel[0] = (int)std::min(255.0, 255.0 * sum[0] / n);
+		pixel[1] = (int)std::min(255.0, 255.0 * sum[1] / n);
+		pixel[2] = (int)std::min(255.0, 255.0 * sum[2] / n);
+	}
+}
+
 double RayTracer::aspectRatio()
 {
 	return sceneLoaded() ? scene->getCamera().getAspectRatio() : 1;
 }
 
+// Strip off filename, leaving only the path:
+static string directoryOf( const char* fn )
+{
+	string path( fn );
+	if( path.find_last_of( "\\/" ) == string::npos ) return ".";
+	return path.substr(0, path.find_last_of( "\\/" ));
+}
+
+// Either a .ray scene to parse or a compiled one, told apart by its first
+// bytes; a compiled scene keeps the mapping, its trees are used from it.
 bool RayTracer::loadScene( char* fn ) {
-	ifstream ifs( fn );
-	if( !ifs ) {
+	MappedFile* file = new MappedFile;
+	if( !file->open( fn ) ) {
+		delete file;
 		string msg( "Error: couldn't read scene file " );
 		msg.append( fn );
 		traceUI->alert( msg );
 		return false;
 	}
-	
-	// Strip off filename, leaving only the path:
-	string path( fn );
-	if( path.find_last_of( "\\/" ) == string::npos ) path = ".";
-	else path = path.substr(0, path.find_last_of( "\\/" ));
 
-	// Call this with 'true' for debug output from the tokenizer
-	Tokenizer tokenizer( ifs, false );
-    Parser parser( tokenizer, path );
+	string path = directoryOf( fn );
 	try {
 		delete scene;
 		scene = 0;
-		scene = parser.parseScene();
+		typedef std::chrono::steady_clock Clock;
+		Clock::time_point t0 = Clock::now();
+		double mb = file->size() / (1024.0 * 1024.0);
+		if( SceneFile::isCompiled( file->begin(), file->end() ) ) {
+			file->advise( MappedFile::RANDOM );
+			scene = SceneFile::read( file, path );
+			double seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+			printf("load: %.2f MB in %.3fs (compiled scene)\n", mb, seconds);
+		} else {
+			std::unique_ptr<MappedFile> owner( file );
+			// Call this with 'true' for debug output from the tokenizer
+			Tokenizer tokenizer( file->begin(), file->end(), false );
+			Parser parser( tokenizer, path );
+			scene = parser.parseScene();
+			double seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+			printf("parse: %.2f MB in %.3fs, %.1f MB/s\n", mb, seconds, seconds > 0.0 ? mb / seconds : 0.0);
+		}
 	} 
+	catch( SceneFileException& e ) {
+		string msg( "Error: can't load compiled scene: " );
+		msg.append( e.message() );
+		traceUI->alert( msg );
+		return false;
+	}
 	catch( SyntaxErrorException& pe ) {
 		traceUI->alert( pe.formattedMessage() );
 		return false;
@@ -230,11 +403,28 @@ bool RayTracer::loadScene( char* fn ) {
 	if( !sceneLoaded() ) return false;
 
 	// build kdtree
+	scene->setSettings(settings);
 	scene->buildKdTree();
 
 	return true;
 }
 
+// Load in as usual, trees and all, and write it to out as a compiled scene.
+bool RayTracer::compileScene( char* in, char* out ) {
+	if( !loadScene( in ) )
+		return false;
+	try {
+		SceneFile::write( *scene, out, directoryOf( out ) );
+	}
+	catch( SceneFileException& e ) {
+		string msg( "Error: " );
+		msg.append( e.message() );
+		traceUI->alert( msg );
+		return false;
+	}
+	return true;
+}
+
 // void RayTracer::traceSetup(int w, int h)
 // {
 // 	if (buffer_width != w || buffer_height != h)
@@ -258,9 +448,82 @@ void RayTracer::traceSetup(int w, int h)
 		bufferSize = buffer_width * buffer_height * 3;
 		delete[] buffer;
 		buffer = new unsigned char[bufferSize];
+		delete[] sampleCounts;
+		sampleCounts = 0;
+		delete[] accum;
+		accum = 0;
+	}
+	if (!sampleCounts)
+		sampleCounts = new std::atomic<int>[w*h];
+	std::fill(sampleCounts, sampleCounts + w*h, 0);
+	progressive = settings.progressive;
+	wavefront = settings.wavefront && !progressive && !settings.debug
+		&& !(settings.adaptive && settings.superSamplingNum > 1);
+	packetSize = settings.packetSize;
+	if (wavefront || progressive || settings.debug
+		|| (settings.adaptive && settings.superSamplingNum > 1))
+		packetSize = 0;
+	if (progressive) {
+		if (!accum)
+			accum = new float[w*h*3];
+		memset(accum, 0, w*h*3*sizeof(float));
 	}
 	// memset(buffer, 0, w*h*3);
 	m_bBufferReady = true;
+	if (sceneLoaded())
+		scene->resetStats();
+	resetTracedAllocations();
+
+	// the base samples of every pixel are always taken, the budget is
+	// what is left for the extra ones
+	long long budget = (long long)settings.sampleBudget * w * h;
+	long long base = (long long)adaptiveBaseSamples(settings.superSamplingNum) * w * h;
+	samplesLeft = std::max(0LL, budget - base);
+}
+
+// the samples per pixel of the last render as a grey image, white for the
+// most samples any pixel got
+bool RayTracer::writeSampleCounts(const char* fn)
+{
+	if (!sampleCounts)
+		return false;
+	int pixels = buffer_width * buffer_height;
+	int most = 1;
+	for (int k = 0; k < pixels; ++k)
+		most = std::max(most, sampleCounts[k].load());
+	unsigned char* img = new unsigned char[pixels * 3];
+	for (int k = 0; k < pixels; ++k)
+		img[3*k] = img[3*k+1] = img[3*k+2] = (unsigned char)(255.0 * sampleCounts[k] / most);
+	writeBMP(fn, buffer_width, buffer_height, img);
+	delete [] img;
+	return true;
+}
+
+void RayTracer::printStats()
+{
+	if (!sceneLoaded())
+		return;
+	scene->printStats();
+	if (sampleCounts && (progressive || settings.superSamplingNum > 1)) {
+		int pixels = buffer_width * buffer_height;
+		long long samples = 0;
+		int capped = 0;
+		for (int k = 0; k < pixels; ++k) {
+			samples += sampleCounts[k];
+			capped += sampleCounts[k] >= settings.superSamplingNum;
+		}
+		printf("samples: %lld, %.2f per pixel (at most %d%s), %d pixels at the maximum\n",
+			samples, double(samples)/pixels, settings.superSamplingNum,
+			progressive ? ", progressive" : settings.adaptive ? ", adaptive" : "", capped);
+	}
+#ifdef COUNT_ALLOCS
+	long long rays = scene->getRayNum();
+	long long allocs = tracedAllocations();
+	if (rays > 0)
+		printf("heap allocations while tracing: %lld (%.4f per ray)\n", allocs, double(allocs)/rays);
+	else
+		printf("heap allocations while tracing: %lld\n", allocs);
+#endif
 }
 
 
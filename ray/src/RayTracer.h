@@ -5,11 +5,31 @@
 
 #include "scene/ray.h"
 #include "scene/cubeMap.h"
+#include "RenderSettings.h"
 #include <time.h>
 #include <queue>
+#include <atomic>
 
 class Scene;
 
+// deepest reflection/refraction level traceRay follows; it keeps one
+// RayRecord per level on its stack
+const int TRACE_MAX_DEPTH = 63;
+
+// a ray waiting to be traced by traceRay
+struct RayRecord
+{
+	Vec3d p, d;
+	ray::RayType type;
+	Vec3d weight;	// throughput, the share of its colour that reaches the pixel
+	int depth;		// reflection/refraction levels left below it
+};
+
+// adaptive supersampling: samples every pixel gets, and how many more
+// it takes at a time while its error is too large
+const int ADAPTIVE_MIN_SAMPLES = 4;
+const int ADAPTIVE_BATCH = 4;
+
 class RayTracer
 {
 public:
@@ -17,17 +37,47 @@ public:
         ~RayTracer();
 
 	Vec3d tracePixel(int i, int j);
+	Vec3d traceAdaptive(int i, int j, int maxSamples, int& traced);
+	// samples every pixel gets before its error is looked at
+	int adaptiveBaseSamples(int maxSamples) const;
+	// progressive rendering: add sample 'pass' of the pixel to accum
+	void tracePass(int i, int j, int pass);
 	Vec3d trace(double x, double y);
-	Vec3d traceRay(ray& r, int depth, Vec3d last_factor);
+	// first, if given, is r's hit, already found e.g. by a packet
+	Vec3d traceRay(const ray& r, int depth, const isect* first = NULL);
 
+	// in progressive mode the 8-bit buffer is resolved from accum first,
+	// so it always holds the whole image as far as it has been traced
 	void getBuffer(unsigned char *&buf, int &w, int &h);
+	void resolveBuffer();
+
+	// whether whole pixels are traced by WavefrontTracer, as asked for
+	// and where it can: not adaptive, progressive or debugging
+	bool useWavefront() const { return wavefront; }
+	// camera rays per packet traced by PacketTracer, 0 if they go one at
+	// a time: only for plain rendering, like the wavefront
+	int getPacketSize() const { return packetSize; }
 	double aspectRatio();
 
+	// the options of the next load or render, copied to the scene too.
+	// Set them before loadScene() and traceSetup(), not while tracing.
+	void setSettings(const RenderSettings& s);
+	const RenderSettings& getSettings() const { return settings; }
+
 	void traceSetup( int w, int h );
+	void printStats();
+	// write how many samples each pixel took as a grey image
+	bool writeSampleCounts( const char* fn );
 
 	bool loadScene(char* fn);
+	// load the scene in and write it, with its trees, as a .rayb to out
+	bool compileScene(char* in, char* out);
 	bool sceneLoaded() { return scene != 0; }
 
+	// seeds the supersampling pattern, so successive frames differ
+	void setFrame(int f) { frame = f; }
+	int getFrame() const { return frame; }
+
 	void setReady(bool ready) { m_bBufferReady = ready; }
 	bool isReady() const { return m_bBufferReady; }
 
@@ -42,8 +92,16 @@ public:
 
 public:
         unsigned char *buffer;
+        float *accum;                   // progressive mode: sum of the samples, RGB per pixel
+        std::atomic<int> *sampleCounts; // samples traced per pixel
+        bool progressive;
+        bool wavefront;
+        int packetSize;
+        RenderSettings settings;
+        std::atomic<long long> samplesLeft;     // budget for adaptive samples
         int buffer_width, buffer_height;
         int bufferSize;
+        int frame;
         Scene* scene;
         CubeMap* cubemap;
 
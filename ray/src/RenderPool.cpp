@@ -0,0 +1,109 @@
+#include "RenderPool.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+RenderPool& RenderPool::instance()
+{
+	static RenderPool pool;
+	return pool;
+}
+
+RenderPool::RenderPool()
+	: jobThreads(0), pending(0), generation(0), pinned(false), quitting(false)
+{
+}
+
+RenderPool::~RenderPool()
+{
+	wait();
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		quitting = true;
+	}
+	wakeUp.notify_all();
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+}
+
+int RenderPool::getThreadNum() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return threads.size();
+}
+
+void RenderPool::setPinned(bool pinned)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	this->pinned = pinned;
+	if (pinned)
+		for (size_t i = 0; i < threads.size(); ++i)
+			pin(i);
+}
+
+// Only Linux is handled; elsewhere the threads stay where the OS puts them.
+void RenderPool::pin(int index)
+{
+#ifdef __linux__
+	int cores = std::thread::hardware_concurrency();
+	if (cores < 1)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(index % cores, &set);
+	pthread_setaffinity_np(threads[index].native_handle(), sizeof(set), &set);
+#endif
+}
+
+void RenderPool::start(int n, const Job& fn)
+{
+	if (n < 1)
+		n = 1;
+	wait();
+	std::lock_guard<std::mutex> guard(lock);
+	while ((int)threads.size() < n) {
+		threads.push_back(std::thread(&RenderPool::workerLoop, this, (int)threads.size()));
+		if (pinned)
+			pin(threads.size() - 1);
+	}
+	job = fn;
+	jobThreads = n;
+	pending = n;
+	generation++;
+	wakeUp.notify_all();
+}
+
+bool RenderPool::done() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return pending == 0;
+}
+
+void RenderPool::wait()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while (pending > 0)
+		finished.wait(guard);
+}
+
+void RenderPool::workerLoop(int index)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	// threads are only started by start(), for the job it is starting
+	int seen = generation - 1;
+	for (;;) {
+		while (!quitting && !(generation != seen && index < jobThreads))
+			wakeUp.wait(guard);
+		if (quitting)
+			return;
+		seen = generation;
+		Job fn = job;
+		guard.unlock();
+		fn(index);
+		guard.lock();
+		if (--pending == 0)
+			finished.notify_all();
+	}
+}
@@ -0,0 +1,64 @@
+#ifndef __RENDERPOOL_H__
+#define __RENDERPOOL_H__
+
+// The process-wide pool of render threads.
+//
+// Threads are started the first time a job needs them and then sleep
+// between jobs, so rendering a sequence or re-rendering from the GUI does
+// not pay for creating and joining threads every time, and the threads
+// keep their caches warm.  A job runs fn(i) on threads 0..n-1; the pool
+// grows if n is larger than any job before.  Jobs run one at a time.
+//
+//		RenderPool& pool = RenderPool::instance();
+//		pool.start(n, [&](int i) { ... });
+//		while (!pool.done()) { ... }
+//		pool.wait();
+//
+// With pinning on, thread i is bound to core i (modulo the core count),
+// where the platform allows it.
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class RenderPool
+{
+public:
+	typedef std::function<void(int)> Job;
+
+	static RenderPool& instance();
+
+	int getThreadNum() const;
+
+	// bind the threads to cores, now and when more are started
+	void setPinned(bool pinned);
+	bool isPinned() const { return pinned; }
+
+	// run fn(i) for i in [0, n) on n pool threads and return at once.
+	// Waits for the previous job first.
+	void start(int n, const Job& fn);
+	bool done() const;
+	void wait();
+
+private:
+	RenderPool();
+	~RenderPool();
+
+	std::vector<std::thread> threads;
+	mutable std::mutex lock;
+	std::condition_variable wakeUp;		// a new job, or quitting
+	std::condition_variable finished;	// the job's last thread is done
+	Job job;
+	int jobThreads;		// threads taking part in the current job
+	int pending;		// of those, the ones still running it
+	int generation;		// counts the jobs started
+	bool pinned;
+	bool quitting;
+
+	void pin(int index);
+	void workerLoop(int index);
+};
+
+#endif // __RENDERPOOL_H__
@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+
+#include "RenderScheduler.h"
+#include "RenderPool.h"
+#include "RayTracer.h"
+#include "WavefrontTracer.h"
+#include "PacketTracer.h"
+
+typedef std::chrono::steady_clock Clock;
+
+RenderScheduler::RenderScheduler(RayTracer* tracer, int width, int height, int numThreads)
+	: tracer(tracer), width(width), height(height), pass(-1), passNum(0),
+	  started(false), running(0), stopping(false)
+{
+	if (numThreads < 1)
+		numThreads = 1;
+	this->numThreads = numThreads;
+	tilesX = (width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	tilesY = (height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+
+	for (int i = 0; i < numThreads; ++i) {
+		Worker* w = new Worker;
+		w->traced = 0;
+		w->stolen = 0;
+		w->busy = 0.0;
+		w->total = 0.0;
+		w->wavefront = tracer->useWavefront() ? new WavefrontTracer(tracer) : NULL;
+		w->packets = tracer->getPacketSize() ? new PacketTracer(tracer, tracer->getPacketSize()) : NULL;
+		workers.push_back(w);
+	}
+}
+
+RenderScheduler::~RenderScheduler()
+{
+	stop();
+	wait();
+	for (size_t i = 0; i < workers.size(); ++i) {
+		delete workers[i]->wavefront;
+		delete workers[i]->packets;
+		delete workers[i];
+	}
+}
+
+void RenderScheduler::start(int pass)
+{
+	wait();
+	// thread i starts with the i-th contiguous run of tiles
+	int tileNum = tilesX*tilesY;
+	for (int i = 0; i < numThreads; ++i) {
+		Worker* w = workers[i];
+		w->tiles.clear();
+		for (int tile = tileNum*i/numThreads; tile < tileNum*(i+1)/numThreads; ++tile)
+			w->tiles.push_back(tile);
+	}
+	this->pass = pass;
+	passNum++;
+	stopping = false;
+	running = numThreads;
+	started = true;
+	RenderPool::instance().start(numThreads, [this](int i) { workerLoop(i); });
+}
+
+void RenderScheduler::wait()
+{
+	if (started)
+		RenderPool::instance().wait();
+	started = false;
+}
+
+// the next tile of our own deque, in image order
+bool RenderScheduler::next(int index, int& tile)
+{
+	Worker* w = workers[index];
+	std::lock_guard<std::mutex> guard(w->lock);
+	if (w->tiles.empty())
+		return false;
+	tile = w->tiles.front();
+	w->tiles.pop_front();
+	return true;
+}
+
+// move the back half of the first non-empty deque after ours into ours.
+// Only one lock is held at a time.
+bool RenderScheduler::steal(int index)
+{
+	Worker* self = workers[index];
+	for (int k = 1; k < numThreads; ++k) {
+		Worker* victim = workers[(index + k) % numThreads];
+		std::deque<int> loot;
+		{
+			std::lock_guard<std::mutex> guard(victim->lock);
+			int n = victim->tiles.size();
+			if (n == 0)
+				continue;
+			int take = (n + 1) / 2;
+			loot.assign(victim->tiles.end() - take, victim->tiles.end());
+			victim->tiles.erase(victim->tiles.end() - take, victim->tiles.end());
+		}
+		std::lock_guard<std::mutex> guard(self->lock);
+		self->tiles.insert(self->tiles.end(), loot.begin(), loot.end());
+		self->stolen += loot.size();
+		return true;
+	}
+	return false;
+}
+
+void RenderScheduler::trace(Worker* w, int tile)
+{
+	int x0 = (tile % tilesX) * RENDER_TILE_SIZE;
+	int y0 = (tile / tilesX) * RENDER_TILE_SIZE;
+	int x1 = std::min(width, x0 + RENDER_TILE_SIZE);
+	int y1 = std::min(height, y0 + RENDER_TILE_SIZE);
+	if (w->wavefront && pass < 0) {
+		w->wavefront->traceTile(x0, y0, x1, y1);
+		return;
+	}
+	if (w->packets && pass < 0) {
+		w->packets->traceTile(x0, y0, x1, y1);
+		return;
+	}
+	for (int y = y0; y < y1; ++y)
+		for (int x = x0; x < x1; ++x) {
+			if (pass < 0)
+				tracer->tracePixel(x, y);
+			else
+				tracer->tracePass(x, y, pass);
+		}
+}
+
+void RenderScheduler::workerLoop(int index)
+{
+	Worker* w = workers[index];
+	Clock::time_point start = Clock::now();
+	while (!stopping) {
+		int tile;
+		if (!next(index, tile)) {
+			// nothing of our own left; all work is handed out up front, so
+			// once nobody has any to steal we are done
+			if (!steal(index))
+				break;
+			continue;
+		}
+		Clock::time_point t0 = Clock::now();
+		trace(w, tile);
+		w->busy += std::chrono::duration<double>(Clock::now() - t0).count();
+		w->traced++;
+	}
+	w->total += std::chrono::duration<double>(Clock::now() - start).count();
+	running--;
+}
+
+// idle time is measured against the slowest thread, so waiting for the
+// last tile counts as idle
+void RenderScheduler::printStats() const
+{
+	double wall = 0.0, busy = 0.0;
+	for (int i = 0; i < numThreads; ++i)
+		wall = std::max(wall, workers[i]->total);
+	printf("render: %d threads, %d tiles of %dx%d pixels",
+		numThreads, tilesX*tilesY, RENDER_TILE_SIZE, RENDER_TILE_SIZE);
+	if (passNum > 1)
+		printf(", %d passes", passNum);
+	printf("\n");
+	for (int i = 0; i < numThreads; ++i) {
+		const Worker* w = workers[i];
+		busy += w->busy;
+		printf("  thread %d: %d tiles (%d stolen), busy %.3fs, idle %.3fs\n",
+			i, w->traced, w->stolen, w->busy, wall - w->busy);
+	}
+	if (wall > 0.0)
+		printf("  busy %.1f%% of %d x %.3fs\n", 100.0*busy/(numThreads*wall), numThreads, wall);
+}
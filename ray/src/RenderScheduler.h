@@ -0,0 +1,87 @@
+#ifndef __RENDERSCHEDULER_H__
+#define __RENDERSCHEDULER_H__
+
+// Renders an image on the threads of the RenderPool, one tile at a time.
+//
+// The image is cut into RENDER_TILE_SIZE square tiles, and every thread
+// starts with its own contiguous run of them in a deque.  A thread takes
+// its tiles from the front, in image order, and when it runs dry it
+// steals the back half of another thread's deque, so expensive regions
+// (a band of mirrors, say) get shared out instead of holding up the
+// thread that happened to get them.  Threads only touch a shared lock
+// once per tile.
+//
+//		RenderScheduler sched(tracer, width, height, threads);
+//		sched.start();
+//		while (!sched.done()) { ... refresh the window ... }
+//		sched.wait();
+//		sched.printStats();
+//
+// For progressive rendering the same scheduler is started once per pass,
+// and each pass adds one sample to every pixel; the statistics add up
+// over the passes.
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+class RayTracer;
+class WavefrontTracer;
+class PacketTracer;
+
+const int RENDER_TILE_SIZE = 16;
+
+class RenderScheduler
+{
+public:
+	RenderScheduler(RayTracer* tracer, int width, int height, int numThreads);
+	~RenderScheduler();
+
+	// hand the work to the render pool and return at once.  With pass >= 0
+	// trace that progressive pass, one sample per pixel, instead of whole
+	// pixels.  Waits for the previous pass first.
+	void start(int pass = -1);
+	// true once every tile is traced, or every thread has stopped
+	bool done() const { return running == 0; }
+	// ask the threads to stop after their current tile
+	void stop() { stopping = true; }
+	// block until the threads have finished
+	void wait();
+
+	int getThreadNum() const { return numThreads; }
+	int getTileNum() const { return tilesX*tilesY; }
+
+	// per-thread tiles, steals and busy/idle time of the last render
+	void printStats() const;
+
+private:
+	struct Worker {
+		std::mutex lock;
+		std::deque<int> tiles;
+		int traced;
+		int stolen;
+		double busy;		// seconds spent tracing tiles
+		double total;		// seconds from start to the thread's exit, summed over passes
+		WavefrontTracer* wavefront;	// the thread's ray streams, if tracing wavefront
+		PacketTracer* packets;		// if tracing camera rays in packets
+	};
+
+	RayTracer* tracer;
+	int width, height;
+	int tilesX, tilesY;
+	int numThreads;
+	int pass;			// progressive pass being traced, -1 for whole pixels
+	int passNum;		// times started
+	std::vector<Worker*> workers;
+	bool started;
+	std::atomic<int> running;
+	std::atomic<bool> stopping;
+
+	bool next(int index, int& tile);
+	bool steal(int index);
+	void trace(Worker* w, int tile);
+	void workerLoop(int index);
+};
+
+#endif // __RENDERSCHEDULER_H__
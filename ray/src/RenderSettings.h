@@ -0,0 +1,49 @@
+#ifndef __RENDERSETTINGS_H__
+#define __RENDERSETTINGS_H__
+
+// What a render is asked to do, copied out of the UI when it starts.
+//
+// The tracer, the scene and everything they call while tracing read their
+// options from this snapshot instead of the TraceUI, so moving a slider
+// cannot change a render half way through, the inner loops do not call
+// through the UI per ray, and a scene can be loaded and rendered with no
+// UI at all.  The defaults are those of TraceUI.
+//
+//		RenderSettings s = traceUI->getSettings();
+//		tracer->setSettings(s);
+//		tracer->traceSetup(w, h);
+
+#include <string>
+
+struct RenderSettings
+{
+	int depth;				// reflection/refraction levels
+	int superSamplingNum;	// samples per pixel, the most when adaptive
+	double termThres;		// throughput below which rays are not traced
+	bool adaptive;
+	double adaptiveThres;	// standard error at which a pixel stops
+	int sampleBudget;		// average samples per pixel, 0 for no limit
+	bool progressive;
+	bool wavefront;
+	int packetSize;			// camera rays per packet, 0 for none
+	bool useKdTree;
+	bool useCubeMap;
+	int filterWidth;		// of the cube map lookup
+	int kdBuilder;			// 0: sorted SAH, 1: binned SAH
+	int kdWidth;			// children per kd tree node
+	int threadNum;
+	bool debug;				// keep every intersection for the debugging view
+	std::string treeCache;	// directory of built kd trees, empty for none
+	int treeCacheMB;		// the most it may hold
+
+	RenderSettings()
+		: depth(0), superSamplingNum(1), termThres(0.0),
+		  adaptive(false), adaptiveThres(0.01), sampleBudget(0),
+		  progressive(false), wavefront(false), packetSize(0),
+		  useKdTree(true), useCubeMap(false), filterWidth(1),
+		  kdBuilder(1), kdWidth(2), threadNum(1), debug(false),
+		  treeCacheMB(1024)
+	{}
+};
+
+#endif // __RENDERSETTINGS_H__
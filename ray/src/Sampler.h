@@ -0,0 +1,100 @@
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+// Random numbers and sample patterns for supersampling.
+//
+// Every pixel seeds its own PCG32 generator from its index and the frame
+// number, so its samples do not depend on which thread traces it or in
+// what order, and no thread ever waits on a shared generator.  The
+// samples of a pixel are the first n points of the Halton sequence in
+// bases 2 and 3, shifted by a random offset per pixel (a Cranley-Patterson
+// rotation): they stay evenly spread for any n, while neighbouring pixels
+// do not share a pattern.
+//
+//		PixelSampler s(pixelIndex, frame);
+//		for (int k = 0; k < n; ++k) {
+//			double u, v;
+//			s.get(k, u, v);		// in [0, 1)
+//			...
+//		}
+
+#include <stdint.h>
+
+// PCG32 (XSH RR variant) by M. O'Neill, pcg-random.org
+class Pcg32
+{
+public:
+	Pcg32(uint64_t seed, uint64_t stream = 0) {
+		state = 0;
+		inc = (stream << 1) | 1;
+		next();
+		state += seed;
+		next();
+	}
+
+	uint32_t next() {
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+		uint32_t rot = (uint32_t)(old >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+	}
+
+	// uniform in [0, 1)
+	double nextDouble() { return next() * (1.0 / 4294967296.0); }
+
+private:
+	uint64_t state;
+	uint64_t inc;
+};
+
+// mixes the parts of a seed into one well spread 64-bit value
+inline uint64_t hashSeed(uint64_t a, uint64_t b) {
+	uint64_t h = a * 0x9e3779b97f4a7c15ULL ^ (b + 0x632be59bd9b4e019ULL);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// the digits of k in the given base, mirrored around the point
+inline double radicalInverse(uint32_t k, uint32_t base) {
+	double inv = 1.0 / base;
+	double f = inv;
+	double r = 0.0;
+	while (k > 0) {
+		r += f * (k % base);
+		k /= base;
+		f *= inv;
+	}
+	return r;
+}
+
+class PixelSampler
+{
+public:
+	PixelSampler(uint64_t pixel, uint32_t frame)
+		: rng(hashSeed(pixel, frame), frame) {
+		du = rng.nextDouble();
+		dv = rng.nextDouble();
+	}
+
+	// sample k of the pixel, in [0, 1) x [0, 1)
+	void get(uint32_t k, double& u, double& v) const {
+		u = radicalInverse(k, 2) + du;
+		v = radicalInverse(k, 3) + dv;
+		if (u >= 1.0) u -= 1.0;
+		if (v >= 1.0) v -= 1.0;
+	}
+
+	// more random numbers for the same pixel, e.g. for lens or light samples
+	double next() { return rng.nextDouble(); }
+
+private:
+	Pcg32 rng;
+	double du, dv;
+};
+
+#endif // __SAMPLER_H__
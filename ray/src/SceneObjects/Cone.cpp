@@ -99,7 +99,6 @@ bool Cone::intersectLocal(ray& r, isect& i) const
 	normal.normalize();
 	i.setN(normal);
 	i.obj = this;
-	i.setMaterial(this->getMaterial());
 	return true;
 	
 	return ret;
@@ -56,6 +56,8 @@ protected:
 	bool isGoodRoot(Vec3d root) const;
 	double radiusAt(double h) const;
     
+	friend class SceneFile;
+
 	bool capped;
 	double height;
 	double b_radius;
@@ -8,7 +8,6 @@ using namespace std;
 bool Cylinder::intersectLocal(ray& r, isect& i) const
 {
 	i.obj = this;
-	i.setMaterial(this->getMaterial());
 
 	if( intersectCaps( r, i ) ) {
 		isect ii;
@@ -16,7 +15,6 @@ bool Cylinder::intersectLocal(ray& r, isect& i) const
 			if( ii.t < i.t ) {
 				i = ii;
 				i.obj = this;
-				i.setMaterial(this->getMaterial());
 			}
 		}
 		return true;
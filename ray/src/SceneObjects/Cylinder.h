@@ -27,6 +27,8 @@ public:
 	bool intersectCaps( const ray& r, isect& i ) const;
 
 protected:
+	friend class SceneFile;
+
 	bool capped;
 
 protected:
@@ -23,7 +23,6 @@ bool Sphere::intersectLocal(ray& r, isect& i) const
 	}
 
 	i.obj = this;
-	i.setMaterial(this->getMaterial());
 
 	double t1 = b - discriminant;
 
@@ -32,7 +32,6 @@ bool Square::intersectLocal(ray& r, isect& i) const
 	}
 
 	i.obj = this;
-	i.setMaterial(this->getMaterial());
 	i.t = t;
 	if( d[2] > 0.0 ) {
 		i.N = Vec3d( 0.0, 0.0, -1.0 );
@@ -3,43 +3,187 @@
 #include <algorithm>
 #include <assert.h>
 #include "trimesh.h"
-#include "../ui/TraceUI.h"
-extern TraceUI* traceUI;
 
 using namespace std;
 
+TrimeshMesh::~TrimeshMesh()
+{
+    delete tree;
+}
+
+// FNV-1a over the raw vertex, normal and face data
+static void hashBytes( size_t& h, const void* data, size_t n )
+{
+    const unsigned char* p = (const unsigned char*)data;
+    for( size_t k = 0; k < n; ++k ) {
+        h ^= p[k];
+        h *= (size_t)1099511628211ULL;
+    }
+}
+
+size_t TrimeshMesh::hash() const
+{
+    size_t h = (size_t)14695981039346656037ULL;
+    size_t counts[3] = { vertices.size(), normals.size(), faces.size() };
+    hashBytes( h, counts, sizeof(counts) );
+    if( !vertices.empty() )
+        hashBytes( h, &vertices[0], vertices.size()*sizeof(Vec3d) );
+    if( !normals.empty() )
+        hashBytes( h, &normals[0], normals.size()*sizeof(Vec3d) );
+    for( Faces::const_iterator i = faces.begin(); i != faces.end(); ++i ) {
+        int ids[3] = { (*i)[0], (*i)[1], (*i)[2] };
+        hashBytes( h, ids, sizeof(ids) );
+    }
+    return h;
+}
+
+bool TrimeshMesh::sameAs( const TrimeshMesh& other ) const
+{
+    if( vertices != other.vertices || normals != other.normals
+        || faces.size() != other.faces.size() )
+        return false;
+    for( size_t k = 0; k < faces.size(); ++k )
+        for( int j = 0; j < 3; ++j )
+            if( faces[k][j] != other.faces[k][j] )
+                return false;
+    return true;
+}
+
+void TrimeshMesh::buildTree( int buildMethod, int width, TaskPool* pool )
+{
+    delete tree;
+    std::vector<TrimeshFace*> refs( faces.size() );
+    for( size_t k = 0; k < faces.size(); ++k )
+        refs[k] = &faces[k];
+    KdTree<TrimeshFace> kdtree( refs, 5, buildMethod, pool );
+    tree = new KdAccel<TrimeshFace>( kdtree, width );
+}
+
+int TrimeshMesh::getBytes() const
+{
+    return (vertices.size() + normals.size())*sizeof(Vec3d)
+        + faces.size()*sizeof(TrimeshFace)
+        + (tree ? tree->getBytes() : 0);
+}
+
+bool TrimeshMesh::intersect(ray& r, isect& i, bool useTree) const
+{
+    bool have_one = false;
+    if( tree && useTree ) {
+        have_one = tree->intersect( r, i );
+    } else {
+        typedef Faces::const_iterator iter;
+        for( iter j = faces.begin(); j != faces.end(); ++j ) {
+            isect cur;
+            if( j->intersect( r, cur ) ) {
+                if( !have_one || (cur.t < i.t) ) {
+                    i = cur;
+                    have_one = true;
+                }
+           }
+        }
+        if( !have_one ) i.setT(1000.0);
+    }
+    if( have_one )
+        setNormal( i );
+    return have_one;
+}
+
+// the interpolated vertex normal if there are normals, else the face's
+void TrimeshMesh::setNormal(isect& i) const
+{
+    const TrimeshFace& face = faces[i.part];
+    if( normals.empty() ) {
+        i.N = face.getNormal();
+        return;
+    }
+    i.N = i.bary[0]*normals[face[0]] + i.bary[1]*normals[face[1]] + i.bary[2]*normals[face[2]];
+    i.N.normalize();
+}
+
+int TrimeshMesh::intersectPacket(RayPacket& pk, int mask, isect* hits, bool useTree) const
+{
+    int found = 0;
+    if( tree && useTree ) {
+        found = tree->intersectPacket( pk, mask, hits );
+        for( int k = 0; k < pk.size; ++k )
+            if( found & (1 << k) )
+                setNormal( hits[k] );
+        return found;
+    }
+    for( int k = 0; k < pk.size; ++k ) {
+        if( !(mask & (1 << k)) ) continue;
+        ray r = pk.get(k);
+        if( intersect( r, hits[k], useTree ) )
+            found |= 1 << k;
+    }
+    return found;
+}
+
+bool TrimeshMesh::occluded(ray& r, double tMax, bool useTree) const
+{
+    if( tree && useTree )
+        return tree->occluded( r, tMax );
+
+    for( Faces::const_iterator j = faces.begin(); j != faces.end(); ++j )
+        if( j->occluded( r, tMax ) )
+            return true;
+    return false;
+}
+
 Trimesh::~Trimesh()
 {
     for( Materials::iterator i = materials.begin(); i != materials.end(); ++i )
         delete *i;
+    // a mesh whose parse failed never got to the scene
+    if( !meshShared )
+        delete mesh;
+}
+
+void Trimesh::shareMesh()
+{
+    mesh = scene->shareMesh( mesh );
+    meshShared = true;
 }
 
 // must add vertices, normals, and materials IN ORDER
 void Trimesh::addVertex( const Vec3d &v )
 {
-    vertices.push_back( v );
+    mesh->vertices.push_back( v );
 }
 
+// equal materials are stored once and indexed
 void Trimesh::addMaterial( Material *m )
 {
+    std::map<const Material*, int, MaterialLess>::iterator found = materialIds.find( m );
+    if( found != materialIds.end() ) {
+        delete m;
+        vertexMaterials.push_back( found->second );
+        return;
+    }
+    int id = materials.size();
     materials.push_back( m );
+    materialIds.insert( std::make_pair( m, id ) );
+    vertexMaterials.push_back( id );
 }
 
 void Trimesh::addNormal( const Vec3d &n )
 {
-    normals.push_back( n );
+    mesh->normals.push_back( n );
 }
 
 // Returns false if the vertices a,b,c don't all exist
 bool Trimesh::addFace( int a, int b, int c )
 {
-    int vcnt = vertices.size();
+    int vcnt = mesh->vertices.size();
 
     if( a >= vcnt || b >= vcnt || c >= vcnt ) return false;
 
-    TrimeshFace *newFace = new TrimeshFace( scene, new Material(*this->material), this, a, b, c );
-    newFace->setTransform(this->transform);
-    if (!newFace->degen) faces.push_back( newFace );
+    // faces with two coinciding corners can never be hit
+    const Vertices& vertices = mesh->vertices;
+    if( vertices[a] == vertices[b] || vertices[a] == vertices[c] || vertices[b] == vertices[c] )
+        return true;
+    mesh->faces.push_back( TrimeshFace( mesh, a, b, c ) );
 
 
     // Don't add faces to the scene's object list so we can cull by bounding box
@@ -47,13 +191,43 @@ bool Trimesh::addFace( int a, int b, int c )
     return true;
 }
 
+void Trimesh::swapVertices( std::vector<Vec3d>& v )
+{
+    mesh->vertices.swap( v );
+}
+
+void Trimesh::swapNormals( std::vector<Vec3d>& n )
+{
+    mesh->normals.swap( n );
+}
+
+void Trimesh::reserveVertices( int n )
+{
+    mesh->vertices.reserve( mesh->vertices.size() + n );
+}
+
+void Trimesh::reserveMaterials( int n )
+{
+    vertexMaterials.reserve( vertexMaterials.size() + n );
+}
+
+void Trimesh::reserveNormals( int n )
+{
+    mesh->normals.reserve( mesh->normals.size() + n );
+}
+
+void Trimesh::reserveFaces( int n )
+{
+    mesh->faces.reserve( mesh->faces.size() + n );
+}
+
 char* Trimesh::doubleCheck()
 // Check to make sure that if we have per-vertex materials or normals
 // they are the right number.
 {
-    if( !materials.empty() && materials.size() != vertices.size() )
+    if( !vertexMaterials.empty() && vertexMaterials.size() != mesh->vertices.size() )
         return "Bad Trimesh: Wrong number of materials.";
-    if( !normals.empty() && normals.size() != vertices.size() )
+    if( !mesh->normals.empty() && mesh->normals.size() != mesh->vertices.size() )
         return "Bad Trimesh: Wrong number of normals.";
 
     return 0;
@@ -61,25 +235,99 @@ char* Trimesh::doubleCheck()
 
 bool Trimesh::intersectLocal(ray& r, isect& i) const
 {
-    double tmin = 0.0;
-    double tmax = 0.0;
-    typedef Faces::const_iterator iter;
-    bool have_one = false;
-    for( iter j = faces.begin(); j != faces.end(); ++j ) {
-        isect cur;
-        if( (*j)->intersectLocal( r, cur ) ) {
-            if( !have_one || (cur.t < i.t) ) {
-                i = cur;
-                have_one = true;
-            }
-       }
+    if( !mesh->intersect( r, i, scene->getSettings().useKdTree ) )
+        return false;
+    // faces are shared between instances, the material is ours
+    i.setObject(this);
+    return true;
+}
+
+// Geometry::intersect() lane by lane around a single packet traversal of
+// the mesh: the same box test and transform on the way in, and the same
+// normal and t transform on the way out.
+int Trimesh::intersectPacket(RayPacket& pk, int mask, isect* hits, int found) const
+{
+    RayPacket local(pk.size);
+    double length[PACKET_MAX];
+    int inside = 0;
+    for( int k = 0; k < pk.size; ++k ) {
+        if( !(mask & (1 << k)) ) continue;
+        ray r = pk.get(k);
+        double tmin, tmax;
+        if( !bounds.intersect(r, tmin, tmax) ) continue;
+        Vec3d pos = transform->globalToLocalCoords(r.p);
+        Vec3d dir = transform->globalToLocalCoords(r.p + r.d) - pos;
+        length[k] = dir.length();
+        dir /= length[k];
+        local.set(k, ray(pos, dir));
+        inside |= 1 << k;
     }
-    if( !have_one ) i.setT(1000.0);
-    return have_one;
+    if( !inside )
+        return 0;
+    // lanes outside the mask still go through the SIMD kernels
+    for( int k = 0; k < pk.size; ++k )
+        if( !(inside & (1 << k)) )
+            local.set(k, local.get(__builtin_ctz(inside)));
+
+    isect cur[PACKET_MAX];
+    int hit = mesh->intersectPacket( local, inside, cur, scene->getSettings().useKdTree );
+    int closer = 0;
+    for( int k = 0; k < pk.size; ++k ) {
+        if( !(hit & (1 << k)) ) continue;
+        cur[k].setObject(this);
+        cur[k].N = transform->localToGlobalCoordsNormal(cur[k].N);
+        cur[k].t /= length[k];
+        if( !(found & (1 << k)) || cur[k].t < hits[k].t ) {
+            hits[k] = cur[k];
+            pk.setBest(k, cur[k].t);
+            closer |= 1 << k;
+        }
+    }
+    return closer;
 }
 
-bool TrimeshFace::intersect(ray& r, isect& i) const {
-  return intersectLocal(r, i);
+const Material& Trimesh::getMaterialAt(const isect& i, Material& scratch) const
+{
+    if( materials.empty() )
+        return getMaterial();
+    const TrimeshFace& face = mesh->faces[i.part];
+    scratch = i.bary[0] * getVertexMaterial(face[0]);
+    scratch += i.bary[1] * getVertexMaterial(face[1]);
+    scratch += i.bary[2] * getVertexMaterial(face[2]);
+    return scratch;
+}
+
+bool Trimesh::occludedLocal(ray& r, double tMax) const
+{
+    return mesh->occluded( r, tMax, scene->getSettings().useKdTree );
+}
+
+TrimeshFace::TrimeshFace( const TrimeshMesh *parent, int a, int b, int c )
+{
+    this->parent = parent;
+    ids[0] = a;
+    ids[1] = b;
+    ids[2] = c;
+    edge1 = parent->vertices[b] - parent->vertices[a];
+    edge2 = parent->vertices[c] - parent->vertices[a];
+}
+
+Vec3d TrimeshFace::getNormal() const
+{
+    Vec3d normal = edge1 ^ edge2;
+    normal.normalize();
+    return normal;
+}
+
+BoundingBox TrimeshFace::getBoundingBox() const
+{
+    const TrimeshMesh::Vertices& vertices = parent->vertices;
+    BoundingBox localbounds;
+    localbounds.setMax(maximum( vertices[ids[0]], vertices[ids[1]]));
+    localbounds.setMin(minimum( vertices[ids[0]], vertices[ids[1]]));
+    localbounds.setMax(maximum( vertices[ids[2]], localbounds.getMax()));
+    localbounds.setMin(minimum( vertices[ids[2]], localbounds.getMin()));
+    return localbounds;
 }
 
 // Intersect ray r with the triangle abc.  If it hits returns true,
@@ -157,62 +405,82 @@ bool TrimeshFace::intersect(ray& r, isect& i) const {
 // }
 
 
-bool TrimeshFace::intersectLocal(ray& r, isect& i) const
+// Moller-Trumbore against the precomputed edges, counting hits from both
+// sides.  The tests on u, v and t are done on the values still scaled by
+// the determinant, so a miss costs no division; only a hit pays for one
+// and gets its t and barycentrics.
+bool TrimeshFace::hit(const ray& r, double& t, double& beta, double& gamma) const
 {
     const Vec3d& A = parent->vertices[ids[0]];
-    const Vec3d& B = parent->vertices[ids[1]];
-    const Vec3d& C = parent->vertices[ids[2]];
-
-    // YOUR CODE HERE
-    Vec3d P = r.p;
-    Vec3d d = r.d;
-    Vec3d n = (A-C)^(B-C);
-    if (!n.iszero())
-        n.normalize();
-    double d_ = -(n*A);
-
-    // get intersection point Q
-    if (n*d == 0)
+
+    Vec3d pvec = r.d ^ edge2;
+    double det = edge1 * pvec;
+    if (det == 0.0)                     // parallel to the plane
         return false;
+    double sign = det > 0.0 ? 1.0 : -1.0;
+    det *= sign;
 
-    double t = -(n*P+d_)/(n*d);
-    if (t<RAY_EPSILON)                  // important
+    Vec3d tvec = r.p - A;
+    double u = sign * (tvec * pvec);
+    if (u < 0.0 || u > det)
         return false;
 
-    Vec3d Q = r.at(t);
+    Vec3d qvec = tvec ^ edge1;
+    double v = sign * (r.d * qvec);
+    if (v < 0.0 || u + v > det)
+        return false;
 
-    // alpha, beta, gamma need to be switched here
-    // check whether Q is in abc
-    double gamma = n*((B-A)^(Q-A));
-    if (gamma<0) return false;
-    double alpha =  n*((C-B)^(Q-B));
-    if (alpha<0) return false;
-    double beta = n*((A-C)^(Q-C)); 
-    if (beta<0) return false;
+    double tt = sign * (edge2 * qvec);
+    if (tt < RAY_EPSILON * det)         // important
+        return false;
 
-    double deno = alpha+beta+gamma;
-    alpha /= deno;
-    beta /= deno;
-    gamma /= deno;
+    double invDet = 1.0 / det;
+    t = tt * invDet;
+    beta = u * invDet;
+    gamma = v * invDet;
+    return true;
+}
+
+// The normal is left to TrimeshMesh::intersect, which sets it once for
+// the closest face only.
+bool TrimeshFace::intersect(ray& r, isect& i) const
+{
+    double t, beta, gamma;
+    if (!hit(r, t, beta, gamma))
+        return false;
 
-    // specify isect i
+    double alpha = 1.0 - beta - gamma;
     i.t = t;
-    i.N = n;
-    i.setObject(this);
-    i.setMaterial(*material);
+    i.setPart(this - &parent->faces[0]);
     i.setBary(alpha, beta, gamma);
     i.setUVCoordinates(Vec2d(alpha, beta));
+    return true;
+}
 
-    // smooth shader
-    if (parent->normals.size()>0) {
-        const Vec3d& NA = parent->normals[ids[0]];
-        const Vec3d& NB = parent->normals[ids[1]];
-        const Vec3d& NC = parent->normals[ids[2]];
-        i.N = alpha*NA + beta*NB + gamma*NC;
-        i.N.normalize();
+int TrimeshFace::intersectPacket(RayPacket& pk, int mask, isect* hits, int found) const
+{
+    double t[PACKET_MAX], beta[PACKET_MAX], gamma[PACKET_MAX];
+    int hit = packetHitTriangle(parent->vertices[ids[0]], edge1, edge2, pk, mask, t, beta, gamma);
+    int closer = 0;
+    for( int k = 0; k < pk.size; ++k ) {
+        if( !(hit & (1 << k)) ) continue;
+        if( (found & (1 << k)) && !(t[k] < hits[k].t) ) continue;
+        double alpha = 1.0 - beta[k] - gamma[k];
+        hits[k] = isect();
+        hits[k].t = t[k];
+        hits[k].setPart(this - &parent->faces[0]);
+        hits[k].setBary(alpha, beta[k], gamma[k]);
+        hits[k].setUVCoordinates(Vec2d(alpha, beta[k]));
+        pk.setBest(k, t[k]);
+        closer |= 1 << k;
     }
+    return closer;
+}
 
-    return true;
+bool TrimeshFace::occluded(ray& r, double tMax) const
+{
+    double t, beta, gamma;
+    return hit(r, t, beta, gamma) && t < tMax;
 }
 
 
@@ -229,19 +497,21 @@ void Trimesh::generateNormals()
 // Once you've loaded all the verts and faces, we can generate per
 // vertex normals by averaging the normals of the neighboring faces.
 {
-    int cnt = vertices.size();
+    Faces& faces = mesh->faces;
+    Normals& normals = mesh->normals;
+    int cnt = mesh->vertices.size();
     normals.resize( cnt );
     int *numFaces = new int[ cnt ]; // the number of faces assoc. with each vertex
     memset( numFaces, 0, sizeof(int)*cnt );
     
     for( Faces::iterator fi = faces.begin(); fi != faces.end(); ++fi )
     {
-        Vec3d faceNormal = (**fi).getNormal();
+        Vec3d faceNormal = fi->getNormal();
         
         for( int i = 0; i < 3; ++i )
         {
-            normals[(**fi)[i]] += faceNormal;
-            ++numFaces[(**fi)[i]];
+            normals[(*fi)[i]] += faceNormal;
+            ++numFaces[(*fi)[i]];
         }
     }
 
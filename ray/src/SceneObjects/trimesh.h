@@ -2,31 +2,128 @@
 #define TRIMESH_H__
 
 #include <list>
+#include <map>
 #include <vector>
 
 #include "../scene/ray.h"
 #include "../scene/material.h"
 #include "../scene/scene.h"
 
-class TrimeshFace;
+class TrimeshMesh;
 
-class Trimesh : public MaterialSceneObject
+// One triangle, stored by value in the face array of its mesh: the indices
+// of its corners and the two edges leaving the first one.  It has no
+// vtable, bounds or material of its own; the bounds are recomputed from
+// the vertices while the tree is built, and the Trimesh instance that was
+// hit supplies the material.
+class TrimeshFace
 {
-    friend class TrimeshFace;
+    const TrimeshMesh *parent;
+    int ids[3];
+    Vec3d edge1;    // B-A
+    Vec3d edge2;    // C-A
+
+public:
+    TrimeshFace( const TrimeshMesh *parent, int a, int b, int c );
+
+    int operator[]( int i ) const
+    {
+        return ids[i];
+    }
+
+    // unit normal of the plane through the corners
+    Vec3d getNormal() const;
+
+    // sets t, the barycentrics and the face index, but not the normal
+    bool intersect(ray& r, isect& i ) const;
+    bool occluded(ray& r, double tMax) const;
+    // intersect() for a packet, as Geometry::intersectPacket
+    int intersectPacket(RayPacket& pk, int mask, isect* hits, int found) const;
+
+    // the bare ray/triangle test: t, and the weights of corners B and C
+    bool hit(const ray& r, double& t, double& beta, double& gamma) const;
+
+    double getDeterminant(double ax, double ay, double az,
+                        double bx, double by, double bz,
+                        double cx, double cy, double cz) const;    // added by lihang liu
+
+    BoundingBox getBoundingBox() const;
+
+    // what KdTree expects of its objects; the box is never cached
+    void ComputeBoundingBox() {}
+};
+
+// The shape of a mesh in its local space: vertices, normals, faces and the
+// bottom-level kd tree over the faces.  Trimeshes with identical shapes
+// share one TrimeshMesh through Scene::shareMesh(), so a mesh placed
+// several times is stored and built only once; each Trimesh is then an
+// instance, a transform and a material pointing at the shared shape.
+class TrimeshMesh
+{
+public:
     typedef std::vector<Vec3d> Normals;
     typedef std::vector<Vec3d> Vertices;
-    typedef std::vector<TrimeshFace*> Faces;
-    typedef std::vector<Material*> Materials;
+    typedef std::vector<TrimeshFace> Faces;
 
     Vertices vertices;
     Faces faces;
     Normals normals;
-    Materials materials;
-	BoundingBox localBounds;
+    BoundingBox localBounds;
+
+    TrimeshMesh() : tree(NULL) {}
+    ~TrimeshMesh();
+
+    // content hash and comparison used to find identical meshes
+    size_t hash() const;
+    bool sameAs(const TrimeshMesh& other) const;
+
+    void buildTree(int buildMethod, int width, TaskPool* pool);
+    const KdAccel<TrimeshFace>* getTree() const { return tree; }
+
+    // closest face hit by a ray in local space, without material; through
+    // the tree if useTree, else by testing every face
+    bool intersect(ray& r, isect& i, bool useTree) const;
+    // whether any face is hit before tMax
+    bool occluded(ray& r, double tMax, bool useTree) const;
+    // intersect() for the lanes of mask; returns the lanes that hit
+    int intersectPacket(RayPacket& pk, int mask, isect* hits, bool useTree) const;
+
+    // memory held by the vertices, normals, faces and tree
+    int getBytes() const;
+
+    // shading normal of the face hit by i, in local space
+    void setNormal(isect& i) const;
+
+private:
+    friend class SceneFile;
+
+    KdAccel<TrimeshFace>* tree;
+};
+
+class Trimesh : public MaterialSceneObject
+{
+    typedef TrimeshMesh::Normals Normals;
+    typedef TrimeshMesh::Vertices Vertices;
+    typedef TrimeshMesh::Faces Faces;
+    typedef std::vector<Material*> Materials;
+
+    struct MaterialLess {
+        bool operator()( const Material* a, const Material* b ) const { return *a < *b; }
+    };
+
+    friend class SceneFile;
+
+    TrimeshMesh* mesh;      // owned by the scene once shared
+    bool meshShared;        // else still this one's to delete
+    Materials materials;    // the distinct per-vertex materials
+    std::vector<int> vertexMaterials;   // index into materials, per vertex
+    std::map<const Material*, int, MaterialLess> materialIds;
 
 public:
     Trimesh( Scene *scene, Material *mat, TransformNode *transform )
-        : MaterialSceneObject(scene, mat), 
+        : MaterialSceneObject(scene, mat),
+			mesh(new TrimeshMesh),
+			meshShared(false),
 			displayListWithMaterials(0),
 			displayListWithoutMaterials(0)
     {
@@ -37,30 +134,46 @@ public:
     bool vertNorms;
 
     bool intersectLocal(ray& r, isect& i) const;
+    bool occludedLocal(ray& r, double tMax) const;
+    // the lanes go down the mesh's tree together, in local space
+    int intersectPacket(RayPacket& pk, int mask, isect* hits, int found) const;
+
+    // blends the per-vertex materials of the face hit, if there are any
+    const Material& getMaterialAt(const isect& i, Material& scratch) const;
 
     ~Trimesh();
 
-    bool ifTrimesh() { return true; }  // used by KdTree, added by lihang liu
-    std::vector<Geometry*> getFaces() { 
-        std::vector<Geometry*> res;
-        res.insert(res.begin(), faces.begin(),faces.end());
-        return res; 
-    }
-    
+    // swap the mesh for an identical one already in the scene, if any.
+    // Call once all vertices, normals and faces have been added.
+    void shareMesh();
+    const TrimeshMesh* getMesh() const { return mesh; }
+
     // must add vertices, normals, and materials IN ORDER
     void addVertex( const Vec3d & );
     void addMaterial( Material *m );
     void addNormal( const Vec3d & );
     bool addFace( int a, int b, int c );
+    // all the vertices or normals at once, in place of those there were
+    void swapVertices( std::vector<Vec3d>& v );
+    void swapNormals( std::vector<Vec3d>& n );
+
+    // room for n of each, when the counts are known before they are added
+    void reserveVertices( int n );
+    void reserveMaterials( int n );
+    void reserveNormals( int n );
+    void reserveFaces( int n );
+
+    const Material& getVertexMaterial( int v ) const { return *materials[vertexMaterials[v]]; }
 
     char *doubleCheck();
-    
+
     void generateNormals();
 
     bool hasBoundingBoxCapability() const { return true; }
-      
+
     BoundingBox ComputeLocalBoundingBox()
     {
+        const Vertices& vertices = mesh->vertices;
         BoundingBox localbounds;
 		if (vertices.size() == 0) return localbounds;
 		localbounds.setMax(vertices[0]);
@@ -71,7 +184,7 @@ public:
 	    localbounds.setMax(maximum( localbounds.getMax(), *viter));
 	    localbounds.setMin(minimum( localbounds.getMin(), *viter));
 	  }
-		localBounds = localbounds;
+		mesh->localBounds = localbounds;
         return localbounds;
     }
 
@@ -81,78 +194,4 @@ protected:
 	mutable int displayListWithoutMaterials;
 };
 
-class TrimeshFace : public MaterialSceneObject
-{
-    Trimesh *parent;
-    int ids[3];
-    Vec3d normal;
-    double dist;
-
-public:
-    TrimeshFace( Scene *scene, Material *mat, Trimesh *parent, int a, int b, int c)
-        : MaterialSceneObject( scene, mat )
-    {
-        this->parent = parent;
-        ids[0] = a;
-        ids[1] = b;
-        ids[2] = c;
-
-		// Compute the face normal here, not on the fly
-		Vec3d a_coords = parent->vertices[a];
-		Vec3d b_coords = parent->vertices[b];
-		Vec3d c_coords = parent->vertices[c];
-
-		Vec3d vab = (b_coords - a_coords);
-		Vec3d vac = (c_coords - a_coords);
-		Vec3d vcb = (b_coords - c_coords);
-        
-		if (vab.iszero() || vac.iszero() || vcb.iszero()) degen = true;
-		else {
-			degen = false;
-			normal = ((b_coords - a_coords) ^ (c_coords - a_coords));
-			normal.normalize();
-			dist = normal * a_coords;
-		}
-		localbounds = ComputeLocalBoundingBox();
-		bounds = localbounds;
-    }
-
-	BoundingBox localbounds;
-	bool degen;
-
-    int operator[]( int i ) const
-    {
-        return ids[i];
-    }
-
-	Vec3d getNormal()
-	{
-		return normal;
-	}
-
-    bool intersect(ray& r, isect& i ) const;
-    bool intersectLocal(ray& r, isect& i ) const;
-
-    double getDeterminant(double ax, double ay, double az,
-                        double bx, double by, double bz,
-                        double cx, double cy, double cz) const;    // added by lihang liu
-
-    bool hasBoundingBoxCapability() const { return true; }
-      
-    BoundingBox ComputeLocalBoundingBox()
-    {
-        BoundingBox localbounds;
-        localbounds.setMax(maximum( parent->vertices[ids[0]], parent->vertices[ids[1]]));
-		localbounds.setMin(minimum( parent->vertices[ids[0]], parent->vertices[ids[1]]));
-        
-        localbounds.setMax(maximum( parent->vertices[ids[2]], localbounds.getMax()));
-		localbounds.setMin(minimum( parent->vertices[ids[2]], localbounds.getMin()));
-        return localbounds;
-    }
-
-    const BoundingBox& getBoundingBox() const { return localbounds; }
-
- };
-
 #endif // TRIMESH_H__
-
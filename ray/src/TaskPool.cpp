@@ -0,0 +1,129 @@
+#include "TaskPool.h"
+
+// the pool and deque the current thread belongs to; threads that are not
+// part of any pool push onto deque 0
+static thread_local TaskPool* currentPool = 0;
+static thread_local int currentIndex = 0;
+
+TaskPool::TaskPool(int numThreads)
+	: queued(0), stopping(false)
+{
+	if (numThreads < 1)
+		numThreads = 1;
+	this->numThreads = numThreads;
+	for (int i = 0; i < numThreads; ++i)
+		queues.push_back(new Queue);
+	for (int i = 1; i < numThreads; ++i)
+		workers.push_back(std::thread(&TaskPool::workerLoop, this, i));
+}
+
+TaskPool::~TaskPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(sleepLock);
+		stopping = true;
+	}
+	wakeUp.notify_all();
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+	for (size_t i = 0; i < queues.size(); ++i)
+		delete queues[i];
+}
+
+int TaskPool::threadIndex() const
+{
+	return currentPool == this ? currentIndex : 0;
+}
+
+void TaskPool::spawn(TaskGroup& group, const Task& task)
+{
+	Entry e;
+	e.task = task;
+	e.group = &group;
+	group.pending++;
+
+	Queue* q = queues[threadIndex()];
+	{
+		std::lock_guard<std::mutex> guard(q->lock);
+		q->tasks.push_back(e);
+	}
+	queued++;
+	// take the lock so a worker between its check and its wait can't miss this
+	{
+		std::lock_guard<std::mutex> guard(sleepLock);
+	}
+	wakeUp.notify_one();
+}
+
+// newest task of our own deque
+bool TaskPool::pop(int index, Entry& e)
+{
+	Queue* q = queues[index];
+	std::lock_guard<std::mutex> guard(q->lock);
+	if (q->tasks.empty())
+		return false;
+	e = q->tasks.back();
+	q->tasks.pop_back();
+	queued--;
+	return true;
+}
+
+// oldest task of somebody else's deque
+bool TaskPool::steal(int index, Entry& e)
+{
+	for (int k = 1; k < numThreads; ++k) {
+		Queue* q = queues[(index + k) % numThreads];
+		std::lock_guard<std::mutex> guard(q->lock);
+		if (q->tasks.empty())
+			continue;
+		e = q->tasks.front();
+		q->tasks.pop_front();
+		queued--;
+		return true;
+	}
+	return false;
+}
+
+bool TaskPool::runOne(int index)
+{
+	Entry e;
+	if (!pop(index, e) && !steal(index, e))
+		return false;
+	e.task();
+	e.group->pending--;
+	return true;
+}
+
+void TaskPool::wait(TaskGroup& group)
+{
+	int index = threadIndex();
+	while (!group.done()) {
+		if (!runOne(index))
+			std::this_thread::yield();
+	}
+}
+
+void TaskPool::parallelFor(int n, const std::function<void(int)>& fn)
+{
+	TaskGroup group;
+	for (int i = 1; i < n; ++i)
+		spawn(group, std::bind(fn, i));
+	if (n > 0)
+		fn(0);
+	wait(group);
+}
+
+void TaskPool::workerLoop(int index)
+{
+	currentPool = this;
+	currentIndex = index;
+	while (true) {
+		if (runOne(index))
+			continue;
+		std::unique_lock<std::mutex> guard(sleepLock);
+		if (stopping)
+			return;
+		if (queued == 0)
+			wakeUp.wait(guard);
+	}
+}
@@ -0,0 +1,85 @@
+#ifndef __TASKPOOL_H__
+#define __TASKPOOL_H__
+
+// A small work-stealing thread pool.
+//
+// Every thread owns a deque of tasks.  A thread pushes and pops its own
+// tasks at the back (newest first, which keeps recursive work cache-warm)
+// and, when it runs dry, steals the oldest task from the front of another
+// thread's deque.  The thread that creates the pool counts as thread 0,
+// so a pool of n threads starts n-1 workers.
+//
+// Tasks are grouped in a TaskGroup; wait() keeps running tasks on the
+// calling thread until every task of the group has finished, so a task
+// may spawn and wait for subtasks without blocking a worker.
+//
+//		TaskPool pool(4);
+//		TaskGroup group;
+//		pool.spawn(group, [&]() { ... });
+//		... other work ...
+//		pool.wait(group);
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskGroup
+{
+public:
+	TaskGroup() : pending(0) {}
+
+	bool done() const { return pending == 0; }
+
+private:
+	friend class TaskPool;
+	std::atomic<int> pending;
+};
+
+class TaskPool
+{
+public:
+	typedef std::function<void()> Task;
+
+	TaskPool(int numThreads);
+	~TaskPool();
+
+	int getThreadNum() const { return numThreads; }
+
+	void spawn(TaskGroup& group, const Task& task);
+	void wait(TaskGroup& group);
+
+	// run fn(i) for i in [0, n) as separate tasks and wait for all of them
+	void parallelFor(int n, const std::function<void(int)>& fn);
+
+private:
+	struct Entry {
+		Task task;
+		TaskGroup* group;
+	};
+
+	struct Queue {
+		std::mutex lock;
+		std::deque<Entry> tasks;
+	};
+
+	int numThreads;
+	std::vector<Queue*> queues;
+	std::vector<std::thread> workers;
+
+	std::atomic<int> queued;		// tasks sitting in any deque
+	std::mutex sleepLock;
+	std::condition_variable wakeUp;
+	bool stopping;
+
+	int threadIndex() const;
+	bool pop(int index, Entry& e);
+	bool steal(int index, Entry& e);
+	bool runOne(int index);
+	void workerLoop(int index);
+};
+
+#endif // __TASKPOOL_H__
@@ -0,0 +1,281 @@
+#include <algorithm>
+
+#include "WavefrontTracer.h"
+#include "RayTracer.h"
+#include "AllocCounter.h"
+#include "Sampler.h"
+#include "scene/scene.h"
+#include "scene/light.h"
+#include "scene/material.h"
+
+// bits of the origin per axis in the sort key
+const int MORTON_BITS = 10;
+
+// x's low 10 bits moved to every third bit
+static uint32_t spreadBits(uint32_t x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+WavefrontTracer::WavefrontTracer(RayTracer* tracer)
+	: tracer(tracer), sorting(true), primaryNum(0), secondaryNum(0), shadowNum(0)
+{
+}
+
+void WavefrontTracer::traceTile(int x0, int y0, int x1, int y1)
+{
+	if (!tracer->sceneLoaded())
+		return;
+	AllocCountScope countAllocations;
+
+	Scene* scene = tracer->scene;
+	int width = tracer->buffer_width;
+	int height = tracer->buffer_height;
+	const RenderSettings& settings = tracer->getSettings();
+	int sampNum = std::max(1, settings.superSamplingNum);
+	int depth = std::min(settings.depth, TRACE_MAX_DEPTH);
+	double d_x = 0.5/double(width);
+	double d_y = 0.5/double(height);
+
+	// the camera rays, sample by sample as tracePixel makes them
+	paths.clear();
+	colors.clear();
+	for (int j = y0; j < y1; ++j)
+		for (int i = x0; i < x1; ++i) {
+			double x = double(i)/double(width);
+			double y = double(j)/double(height);
+			PixelSampler sampler(i + (uint64_t)j * width, tracer->getFrame());
+			for (int s = 0; s < sampNum; ++s) {
+				ray r(Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY);
+				if (sampNum == 1) {
+					scene->getCamera().rayThrough(x, y, r);
+				} else {
+					double u, v;
+					sampler.get(s, u, v);
+					scene->getCamera().rayThrough(x - d_x + 2.0*d_x*u, y - d_y + 2.0*d_y*v, r);
+				}
+
+				PathRay path;
+				path.p = r.p;
+				path.d = r.d;
+				path.type = ray::VISIBILITY;
+				path.weight = Vec3d(1.0, 1.0, 1.0);
+				path.sample = colors.size();
+				path.depth = depth;
+				paths.push_back(path);
+				colors.push_back(Vec3d(0.0, 0.0, 0.0));
+			}
+		}
+	if (depth < 0)
+		paths.clear();
+	primaryNum += paths.size();
+
+	// one bounce per round: the hits of this stream make the next one
+	bool primary = true;
+	while (!paths.empty()) {
+		if (!primary)
+			secondaryNum += paths.size();
+		// camera rays are coherent in scanline order already
+		if (sorting && !primary)
+			sortPaths();
+		primary = false;
+		intersectPaths();
+		nextPaths.clear();
+		shadePaths();
+		traceShadows();
+		for (size_t k = 0; k < paths.size(); ++k)
+			colors[paths[k].sample] += prod(paths[k].weight, shades[k]);
+		paths.swap(nextPaths);
+	}
+
+	int s = 0;
+	for (int j = y0; j < y1; ++j)
+		for (int i = x0; i < x1; ++i) {
+			Vec3d col(0,0,0);
+			for (int k = 0; k < sampNum; ++k) {
+				Vec3d c = colors[s++];
+				c.clamp();
+				col += c;
+			}
+			if (sampNum > 1)
+				col /= sampNum;
+
+			unsigned char *pixel = tracer->buffer + ( i + j * width ) * 3;
+			pixel[0] = (int)( 255.0 * col[0]);
+			pixel[1] = (int)( 255.0 * col[1]);
+			pixel[2] = (int)( 255.0 * col[2]);
+			tracer->sampleCounts[i + j * width] = sampNum;
+		}
+}
+
+// direction octant in the top bits, then the origin on a Morton curve
+// through the scene bounds; origins outside them go to the nearest face
+uint64_t WavefrontTracer::sortKey(const Vec3d& p, const Vec3d& d) const
+{
+	const BoundingBox& bounds = tracer->scene->bounds();
+	uint32_t morton = 0;
+	for (int axis = 0; axis < 3; ++axis) {
+		double lo = bounds.getMin()[axis];
+		double extent = bounds.getMax()[axis] - lo;
+		double f = extent > 0.0 ? (p[axis] - lo) / extent : 0.0;
+		f = std::min(1.0, std::max(0.0, f));
+		morton |= spreadBits((uint32_t)(f * ((1 << MORTON_BITS) - 1))) << axis;
+	}
+	uint64_t octant = (d[0] < 0.0) | ((d[1] < 0.0) << 1) | ((d[2] < 0.0) << 2);
+	return (octant << (3*MORTON_BITS)) | morton;
+}
+
+// the path rays themselves are moved, so they are read in order
+void WavefrontTracer::sortPaths()
+{
+	order.resize(paths.size());
+	for (size_t k = 0; k < paths.size(); ++k) {
+		order[k].key = sortKey(paths[k].p, paths[k].d);
+		order[k].index = k;
+	}
+	std::sort(order.begin(), order.end());
+	nextPaths.resize(paths.size());
+	for (size_t k = 0; k < order.size(); ++k)
+		nextPaths[k] = paths[order[k].index];
+	paths.swap(nextPaths);
+}
+
+// shadow rays are grouped by light first, and only their order is sorted:
+// what they let through is added to their hits in the order shade() would
+void WavefrontTracer::sortShadows()
+{
+	order.resize(shadows.size());
+	for (size_t k = 0; k < shadows.size(); ++k) {
+		const ShadowRay& s = shadows[k];
+		order[k].key = ((uint64_t)s.lightIndex << (3*MORTON_BITS + 3))
+			| sortKey(s.hit, s.light->getDirection(s.hit));
+		order[k].index = k;
+	}
+	std::sort(order.begin(), order.end());
+}
+
+void WavefrontTracer::intersectPaths()
+{
+	Scene* scene = tracer->scene;
+	hits.resize(paths.size());
+	for (size_t k = 0; k < paths.size(); ++k) {
+		ray r(paths[k].p, paths[k].d, paths[k].type);
+		if (!scene->intersect(r, hits[k]))
+			hits[k] = isect();
+	}
+}
+
+// The colour of each hit without its shadows, and the rays it spawns:
+// shadow rays for the lights that would light it, and the reflected and
+// refracted rays, as in RayTracer::traceRay.
+void WavefrontTracer::shadePaths()
+{
+	Scene* scene = tracer->scene;
+	const RenderSettings& settings = tracer->getSettings();
+	double threshold = settings.termThres;
+	bool cubemap = tracer->haveCubeMap() && settings.useCubeMap;
+
+	shades.resize(paths.size());
+	shadows.clear();
+	for (size_t k = 0; k < paths.size(); ++k) {
+		const PathRay& path = paths[k];
+		isect& i = hits[k];
+		ray cur(path.p, path.d, path.type);
+
+		if (!i.obj) {
+			shades[k] = cubemap ? tracer->getCubeMap()->getColor(cur, settings.filterWidth) : Vec3d(0.0, 0.0, 0.0);
+			continue;
+		}
+
+		Material scratch;
+		const Material& m = i.resolveMaterial(scratch);
+		shades[k] = m.shadeAmbient(scene, i);
+		Vec3d Q = cur.at(i.t);
+
+		int lightIndex = 0;
+		for (std::vector<Light*>::const_iterator l = scene->beginLights(); l != scene->endLights(); ++l, ++lightIndex) {
+			// unlit from this light whatever is in the way: no ray needed
+			Vec3d color = m.shadeLight(*l, cur, i, Vec3d(1.0, 1.0, 1.0));
+			if (color.iszero())
+				continue;
+			ShadowRay s;
+			s.p = path.p;
+			s.d = path.d;
+			s.hit = Q;
+			s.light = *l;
+			s.lightIndex = lightIndex;
+			s.color = color;
+			s.path = k;
+			shadows.push_back(s);
+		}
+
+		if (path.depth == 0)
+			continue;
+
+		Vec3d N = i.N;
+		Vec3d V = -cur.d;
+
+		// reflection model
+		Vec3d kr = m.kr(i);
+		if (!kr.iszero()) {
+			Vec3d weight = prod(kr, path.weight);
+			if (weight.length() >= threshold) {
+				PathRay next;
+				next.p = Q;
+				next.d = 2*N*(N*V)-V;
+				next.type = ray::REFLECTION;
+				next.weight = weight;
+				next.sample = path.sample;
+				next.depth = path.depth-1;
+				nextPaths.push_back(next);
+			}
+		}
+
+		// refraction model
+		Vec3d kt = m.kt(i);
+		if (!kt.iszero()) {
+			double index;
+			// inside or outside
+			if (V*N>0)
+				index = 1.0/m.index(i);
+			else {
+				index = m.index(i);
+				N = -N;
+			}
+
+			Vec3d S_i = N*(N*V) - V;
+			Vec3d S_t = index*S_i;
+			// Check full reflection
+			Vec3d weight = prod(kt, path.weight);
+			if ((1.0-S_t*S_t) > 0 && weight.length() >= threshold) {
+				PathRay next;
+				next.p = Q;
+				next.d = S_t - N*sqrt(1.0-S_t*S_t);
+				next.type = ray::REFRACTION;
+				next.weight = weight;
+				next.sample = path.sample;
+				next.depth = path.depth-1;
+				nextPaths.push_back(next);
+			}
+		}
+	}
+}
+
+void WavefrontTracer::traceShadows()
+{
+	if (sorting)
+		sortShadows();
+	shadowNum += shadows.size();
+	for (size_t k = 0; k < shadows.size(); ++k) {
+		ShadowRay& s = shadows[sorting ? order[k].index : k];
+		ray r(s.p, s.d);
+		s.color = prod(s.light->shadowAttenuation(r, s.hit), s.color);
+	}
+	for (size_t k = 0; k < shadows.size(); ++k)
+		shades[shadows[k].path] += shadows[k].color;
+}
@@ -0,0 +1,91 @@
+#ifndef __WAVEFRONTTRACER_H__
+#define __WAVEFRONTTRACER_H__
+
+// Traces a tile breadth first, as streams of rays, instead of one sample
+// and one ray at a time like RayTracer::tracePixel.
+//
+// The camera rays of every sample in the tile are made first and
+// intersected as one stream.  Shading the hits makes the next streams: a
+// shadow ray per hit and light, traced straight away, and the reflected
+// and refracted rays, which form the stream of the next bounce.  That
+// repeats until the depth runs out or no rays are left.  Before a stream
+// is traced it is sorted by direction octant and then by origin along a
+// Morton curve over the scene bounds, so that consecutive rays walk the
+// same part of the kd tree.
+//
+// The image is the one tracePixel makes, up to the order in which the
+// contributions to a sample are added.  The streams are kept and reused
+// from tile to tile, so keep one WavefrontTracer per thread.
+//
+//		WavefrontTracer wf(tracer);
+//		wf.traceTile(0, 0, 16, 16);
+
+#include <vector>
+#include <stdint.h>
+
+#include "scene/ray.h"
+
+class RayTracer;
+class Light;
+
+class WavefrontTracer
+{
+public:
+	WavefrontTracer(RayTracer* tracer);
+
+	// trace pixels [x0, x1) x [y0, y1) into the tracer's buffer
+	void traceTile(int x0, int y0, int x1, int y1);
+
+	// sort the streams before tracing them (the default)
+	void setSorting(bool sort) { sorting = sort; }
+
+	// rays traced so far, by stream
+	long long getPrimaryNum() const { return primaryNum; }
+	long long getSecondaryNum() const { return secondaryNum; }
+	long long getShadowNum() const { return shadowNum; }
+
+private:
+	// a camera, reflected or refracted ray
+	struct PathRay {
+		Vec3d p, d;
+		ray::RayType type;
+		Vec3d weight;		// throughput, the share of its colour that reaches the pixel
+		int sample;			// where its colour goes, in colors
+		int depth;			// reflection/refraction levels left below it
+	};
+
+	// a shadow ray, from a hit towards a light
+	struct ShadowRay {
+		Vec3d p, d;			// the path ray that hit
+		Vec3d hit;
+		const Light* light;
+		int lightIndex;
+		Vec3d color;		// what the light adds if nothing is in the way
+		int path;			// the hit it belongs to, in shades
+	};
+
+	struct SortKey {
+		uint64_t key;
+		int index;
+		bool operator<(const SortKey& other) const { return key < other.key; }
+	};
+
+	RayTracer* tracer;
+	bool sorting;
+	std::vector<PathRay> paths, nextPaths;
+	std::vector<ShadowRay> shadows;
+	std::vector<isect> hits;
+	std::vector<Vec3d> shades;		// colour of each hit, before its throughput
+	std::vector<Vec3d> colors;		// colour of each sample
+	std::vector<SortKey> order;
+	long long primaryNum, secondaryNum, shadowNum;
+
+	uint64_t sortKey(const Vec3d& p, const Vec3d& d) const;
+	void sortPaths();
+	void sortShadows();
+	void intersectPaths();
+	void shadePaths();
+	void traceShadows();
+};
+
+#endif // __WAVEFRONTTRACER_H__
@@ -0,0 +1,72 @@
+#include <fstream>
+#include <iterator>
+
+#include "mappedfile.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+bool MappedFile::open( const char* path, Access access )
+{
+  close();
+
+#ifndef _WIN32
+  int fd = ::open( path, O_RDONLY );
+  if( fd < 0 )
+    return false;
+  struct stat st;
+  if( fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0 ) {
+    void* p = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if( p != MAP_FAILED ) {
+      data = (const char*)p;
+      length = st.st_size;
+      mapped = true;
+      ::close( fd );
+      advise( access );
+      return true;
+    }
+  }
+  ::close( fd );
+#endif
+
+  // empty files, pipes, or no mmap: read it all instead
+  std::ifstream in( path, std::ios::in | std::ios::binary );
+  if( !in )
+    return false;
+  copy.assign( std::istreambuf_iterator<char>( in ), std::istreambuf_iterator<char>() );
+  data = copy.empty() ? "" : &copy[0];
+  length = copy.size();
+  return true;
+}
+
+void MappedFile::advise( Access access )
+{
+#ifndef _WIN32
+  if( !mapped )
+    return;
+  if( access == SEQUENTIAL ) {
+    madvise( (void*)data, length, MADV_SEQUENTIAL );
+  } else {
+    // no readahead around each fault, but all of it read in up front,
+    // since all of it is used
+    madvise( (void*)data, length, MADV_RANDOM );
+    madvise( (void*)data, length, MADV_WILLNEED );
+  }
+#endif
+}
+
+void MappedFile::close()
+{
+#ifndef _WIN32
+  if( mapped )
+    munmap( (void*)data, length );
+#endif
+  std::vector<char>().swap( copy );
+  data = NULL;
+  length = 0;
+  mapped = false;
+}
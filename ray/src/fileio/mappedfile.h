@@ -0,0 +1,45 @@
+#ifndef _MAPPEDFILE_H_
+#define _MAPPEDFILE_H_
+
+// A whole file in memory, read only: mapped where the system can map it,
+// read into a heap copy where it can't.  The bytes stay valid for the
+// lifetime of the MappedFile and are not NUL terminated.  How they will
+// be read is passed on to the system's paging of the mapping.
+//
+//		MappedFile f;
+//		if( f.open( "scene.ray" ) )
+//			scan( f.begin(), f.end() );
+
+#include <stddef.h>
+#include <vector>
+
+class MappedFile {
+ public:
+  MappedFile() : data( NULL ), length( 0 ), mapped( false ) {}
+  ~MappedFile() { close(); }
+
+  enum Access {
+    SEQUENTIAL,			// scanned once front to back, like scene text
+    RANDOM			// kept and read all over, like kd nodes used in place
+  };
+
+  bool open( const char* path, Access access = SEQUENTIAL );	// false if it can't be read
+  // for when the contents tell how they will be read only once open
+  void advise( Access access );
+  void close();
+
+  const char* begin() const { return data; }
+  const char* end() const { return data + length; }
+  size_t size() const { return length; }
+
+ private:
+  MappedFile( const MappedFile& );
+  MappedFile& operator=( const MappedFile& );
+
+  const char* data;
+  size_t length;
+  bool mapped;			// data is a mapping, else it points into copy
+  std::vector<char> copy;
+};
+
+#endif
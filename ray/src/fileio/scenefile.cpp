@@ -0,0 +1,765 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <memory>
+#include <vector>
+
+#include "scenefile.h"
+#include "mappedfile.h"
+
+#include "../scene/scene.h"
+#include "../scene/light.h"
+#include "../SceneObjects/Box.h"
+#include "../SceneObjects/Cone.h"
+#include "../SceneObjects/Cylinder.h"
+#include "../SceneObjects/Sphere.h"
+#include "../SceneObjects/Square.h"
+#include "../SceneObjects/trimesh.h"
+
+using namespace std;
+
+static const char MAGIC[4] = { 'R', 'A', 'Y', 'B' };
+static const char TREES_MAGIC[4] = { 'R', 'A', 'Y', 'K' };
+static const uint32_t VERSION = 1;
+static const uint32_t ORDER_MARK = 0x01020304;
+
+// arrays start on this boundary, counted from the start of the file
+static const size_t ALIGN = 64;
+
+enum { LIGHT_POINT, LIGHT_DIRECTIONAL };
+enum { OBJECT_BOX, OBJECT_SPHERE, OBJECT_SQUARE, OBJECT_CYLINDER, OBJECT_CONE, OBJECT_TRIMESH };
+
+// the sizes the layout depends on, checked when a file is read
+static void layoutSizes( uint32_t sizes[6] )
+{
+  sizes[0] = sizeof(Vec3d);
+  sizes[1] = sizeof(Mat3d);
+  sizes[2] = sizeof(Mat4d);
+  sizes[3] = sizeof(FlatKdNode);
+  sizes[4] = sizeof(WideKdNode<4>);
+  sizes[5] = sizeof(WideKdNode<8>);
+}
+
+// FNV-1a, 64 bits, continuing from h
+static uint64_t checksum( uint64_t h, const void* data, size_t n )
+{
+  const unsigned char* p = (const unsigned char*)data;
+  for( size_t k = 0; k < n; ++k ) {
+    h ^= p[k];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+static const uint64_t CHECKSUM_START = 14695981039346656037ULL;
+
+// Appends to the file, counting the bytes for the padding and summing
+// them for the checksum.
+struct SceneFile::Writer {
+  FILE* fp;
+  size_t offset;
+  uint64_t sum;
+
+  Writer( FILE* fp ) : fp( fp ), offset( 0 ), sum( CHECKSUM_START ) {}
+
+  void bytes( const void* p, size_t n ) {
+    if( n && fwrite( p, 1, n, fp ) != n )
+      throw SceneFileException( "couldn't write the compiled scene" );
+    offset += n;
+    sum = checksum( sum, p, n );
+  }
+  template<class T> void put( const T& v ) { bytes( &v, sizeof(T) ); }
+
+  void align() {
+    static const char zeros[ALIGN] = { 0 };
+    bytes( zeros, (ALIGN - offset % ALIGN) % ALIGN );
+  }
+  // the number of elements, then the elements from the next boundary
+  void block( const void* p, size_t n, size_t size ) {
+    put( (uint64_t)n );
+    align();
+    bytes( p, n * size );
+  }
+  template<class T> void array( const std::vector<T>& v ) {
+    block( v.empty() ? NULL : &v[0], v.size(), sizeof(T) );
+  }
+
+  void str( const string& s ) {
+    put( (uint32_t)s.size() );
+    bytes( s.data(), s.size() );
+  }
+  void box( BoundingBox b ) {
+    put( (uint8_t)b.isEmpty() );
+    put( b.getMin() );
+    put( b.getMax() );
+  }
+};
+
+// Reads the mapped file in place, never past its end.
+struct SceneFile::Reader {
+  const char* begin;
+  const char* pos;
+  const char* end;
+
+  Reader( const char* begin, const char* end ) : begin( begin ), pos( begin ), end( end ) {}
+
+  void need( size_t n ) const {
+    if( (size_t)(end - pos) < n )
+      throw SceneFileException( "compiled scene is truncated" );
+  }
+  template<class T> T get() {
+    need( sizeof(T) );
+    T v;
+    memcpy( (void*)&v, pos, sizeof(T) );
+    pos += sizeof(T);
+    return v;
+  }
+
+  void align() {
+    size_t pad = (ALIGN - (pos - begin) % ALIGN) % ALIGN;
+    need( pad );
+    pos += pad;
+  }
+  // the elements written by Writer::block(), where they lie
+  const char* block( size_t& n, size_t size ) {
+    uint64_t count = get<uint64_t>();
+    align();
+    if( count > (uint64_t)(end - pos) / size )
+      throw SceneFileException( "compiled scene is truncated" );
+    n = count;
+    const char* p = pos;
+    pos += n * size;
+    return p;
+  }
+  template<class T> const T* array( size_t& n ) {
+    return (const T*)block( n, sizeof(T) );
+  }
+
+  string str() {
+    uint32_t n = get<uint32_t>();
+    need( n );
+    string s( pos, n );
+    pos += n;
+    return s;
+  }
+  BoundingBox box() {
+    bool empty = get<uint8_t>() != 0;
+    Vec3d bmin = get<Vec3d>();
+    Vec3d bmax = get<Vec3d>();
+    BoundingBox b;
+    if( !empty ) {
+      b.setMin( bmin );
+      b.setMax( bmax );
+    }
+    return b;
+  }
+};
+
+bool SceneFile::isCompiled( const char* begin, const char* end )
+{
+  return end - begin >= (ptrdiff_t)sizeof(MAGIC) && memcmp( begin, MAGIC, sizeof(MAGIC) ) == 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Writing
+//
+
+#ifndef _WIN32
+// the components of an absolute path
+static vector<string> splitPath( const string& path )
+{
+  vector<string> parts;
+  size_t begin = 0;
+  while( begin < path.size() ) {
+    size_t end = path.find( '/', begin );
+    if( end == string::npos )
+      end = path.size();
+    if( end > begin )
+      parts.push_back( path.substr( begin, end - begin ) );
+    begin = end + 1;
+  }
+  return parts;
+}
+#endif
+
+// The file name as the directory dir would reach it, or empty if either
+// can't be resolved.
+static string relativeTo( const string& dir, const string& name )
+{
+#ifndef _WIN32
+  char dirPath[PATH_MAX], namePath[PATH_MAX];
+  if( !realpath( dir.c_str(), dirPath ) || !realpath( name.c_str(), namePath ) )
+    return string();
+  vector<string> from = splitPath( dirPath );
+  vector<string> to = splitPath( namePath );
+  size_t common = 0;
+  while( common < from.size() && common < to.size() - 1 && from[common] == to[common] )
+    common++;
+  string relative;
+  for( size_t k = common; k < from.size(); ++k )
+    relative += "../";
+  for( size_t k = common; k < to.size(); ++k )
+    relative += to[k] + ( k + 1 < to.size() ? "/" : "" );
+  return relative;
+#else
+  return string();
+#endif
+}
+
+void SceneFile::writeHeader( Writer& w, const char* magic )
+{
+  uint32_t sizes[6];
+  layoutSizes( sizes );
+  w.bytes( magic, sizeof(MAGIC) );
+  w.put( VERSION );
+  w.put( ORDER_MARK );
+  w.bytes( sizes, sizeof(sizes) );
+}
+
+void SceneFile::write( const Scene& scene, const char* path, const string& basePath )
+{
+  FILE* fp = fopen( path, "wb" );
+  if( !fp )
+    throw SceneFileException( string( "couldn't open " ) + path + " for writing" );
+  Writer w( fp );
+
+  try {
+    writeHeader( w, MAGIC );
+    // how the trees were built, so that a render asking for others builds them
+    w.put( (int32_t)(scene.kdtree ? scene.treeMethod : -1) );
+    w.put( (int32_t)(scene.kdtree ? scene.treeWidth : -1) );
+
+    const Camera& camera = scene.camera;
+    w.put( camera.m );
+    w.put( camera.normalizedHeight );
+    w.put( camera.aspectRatio );
+    w.put( camera.eye );
+    w.put( scene.ambientIntensity );
+
+    // textures by file name, relative to where the compiled scene goes so
+    // that it finds them from there, as the .ray did from its directory
+    TextureIds textures;
+    w.put( (uint32_t)scene.textureCache.size() );
+    for( Scene::tmap::const_iterator t = scene.textureCache.begin(); t != scene.textureCache.end(); ++t ) {
+      string name = relativeTo( basePath, t->first );
+      bool relative = !name.empty();
+      w.put( (uint8_t)relative );
+      w.str( relative ? name : t->first );
+      int id = textures.size();
+      textures[t->second] = id;
+    }
+
+    w.put( (uint32_t)scene.lights.size() );
+    for( Scene::cliter l = scene.lights.begin(); l != scene.lights.end(); ++l ) {
+      if( const PointLight* point = dynamic_cast<const PointLight*>( *l ) ) {
+        w.put( (uint8_t)LIGHT_POINT );
+        w.put( point->color );
+        w.put( point->position );
+        w.put( point->constantTerm );
+        w.put( point->linearTerm );
+        w.put( point->quadraticTerm );
+      } else if( const DirectionalLight* directional = dynamic_cast<const DirectionalLight*>( *l ) ) {
+        w.put( (uint8_t)LIGHT_DIRECTIONAL );
+        w.put( directional->color );
+        w.put( directional->orientation );
+      } else
+        throw SceneFileException( "can't compile a light of unknown type" );
+    }
+
+    MeshIds meshes;
+    w.put( (uint32_t)scene.meshCache.size() );
+    for( Scene::mmap::const_iterator m = scene.meshCache.begin(); m != scene.meshCache.end(); ++m ) {
+      int id = meshes.size();
+      meshes[m->second] = id;
+      writeMesh( w, *m->second, m->first );
+    }
+
+    std::map<const Geometry*, uint32_t> objects;
+    w.put( (uint32_t)scene.objects.size() );
+    for( Scene::cgiter g = scene.objects.begin(); g != scene.objects.end(); ++g ) {
+      int id = objects.size();
+      objects[*g] = id;
+      writeObject( w, *g, textures, meshes );
+    }
+
+    std::vector<uint32_t> prims;
+    if( scene.kdtree ) {
+      const std::vector<Geometry*>& refs = scene.kdtree->getPrims();
+      for( size_t k = 0; k < refs.size(); ++k )
+        prims.push_back( objects[refs[k]] );
+    }
+    writeTree( w, scene.kdtree, prims );
+    w.box( scene.sceneBounds );
+  }
+  catch( ... ) {
+    fclose( fp );
+    throw;
+  }
+  if( fclose( fp ) != 0 )
+    throw SceneFileException( "couldn't write the compiled scene" );
+}
+
+void SceneFile::writeMaterial( Writer& w, const Material& m, const TextureIds& textures )
+{
+  const MaterialParameter* params[8] = { &m._ke, &m._ka, &m._ks, &m._kd, &m._kr, &m._kt, &m._shininess, &m._index };
+  for( int k = 0; k < 8; ++k ) {
+    int32_t texture = -1;
+    if( params[k]->_textureMap )
+      texture = textures.find( params[k]->_textureMap )->second;
+    w.put( params[k]->_value );
+    w.put( texture );
+  }
+}
+
+void SceneFile::writeMesh( Writer& w, const TrimeshMesh& mesh, size_t key )
+{
+  w.put( (uint64_t)key );
+  w.array( mesh.vertices );
+  w.array( mesh.normals );
+
+  std::vector<int32_t> corners( mesh.faces.size() * 3 );
+  for( size_t k = 0; k < mesh.faces.size(); ++k )
+    for( int j = 0; j < 3; ++j )
+      corners[3*k + j] = mesh.faces[k][j];
+  w.array( corners );
+  w.box( mesh.localBounds );
+
+  writeMeshTree( w, mesh );
+}
+
+void SceneFile::writeMeshTree( Writer& w, const TrimeshMesh& mesh )
+{
+  std::vector<uint32_t> prims;
+  if( mesh.getTree() ) {
+    const std::vector<TrimeshFace*>& refs = mesh.getTree()->getPrims();
+    prims.resize( refs.size() );
+    for( size_t k = 0; k < refs.size(); ++k )
+      prims[k] = refs[k] - &mesh.faces[0];
+  }
+  writeTree( w, mesh.getTree(), prims );
+}
+
+void SceneFile::writeObject( Writer& w, const Geometry* obj, const TextureIds& textures, const MeshIds& meshes )
+{
+  const SceneObject* object = dynamic_cast<const SceneObject*>( obj );
+  uint8_t type;
+  if( dynamic_cast<const Trimesh*>( obj ) )
+    type = OBJECT_TRIMESH;
+  else if( dynamic_cast<const Box*>( obj ) )
+    type = OBJECT_BOX;
+  else if( dynamic_cast<const Sphere*>( obj ) )
+    type = OBJECT_SPHERE;
+  else if( dynamic_cast<const Square*>( obj ) )
+    type = OBJECT_SQUARE;
+  else if( dynamic_cast<const Cylinder*>( obj ) )
+    type = OBJECT_CYLINDER;
+  else if( dynamic_cast<const Cone*>( obj ) )
+    type = OBJECT_CONE;
+  else
+    throw SceneFileException( "can't compile an object of unknown type" );
+
+  w.put( type );
+  w.put( obj->transform->transform() );
+  w.box( obj->bounds );
+  writeMaterial( w, object->getMaterial(), textures );
+
+  if( type == OBJECT_CYLINDER ) {
+    w.put( (uint8_t)static_cast<const Cylinder*>( obj )->capped );
+  } else if( type == OBJECT_CONE ) {
+    const Cone* cone = static_cast<const Cone*>( obj );
+    w.put( cone->height );
+    w.put( cone->b_radius );
+    w.put( cone->t_radius );
+    w.put( (uint8_t)cone->capped );
+  } else if( type == OBJECT_TRIMESH ) {
+    const Trimesh* trimesh = static_cast<const Trimesh*>( obj );
+    w.put( (uint32_t)meshes.find( trimesh->mesh )->second );
+    w.put( (uint8_t)trimesh->vertNorms );
+    w.put( (uint32_t)trimesh->materials.size() );
+    for( size_t k = 0; k < trimesh->materials.size(); ++k )
+      writeMaterial( w, *trimesh->materials[k], textures );
+    std::vector<int32_t> vertexMaterials( trimesh->vertexMaterials.begin(), trimesh->vertexMaterials.end() );
+    w.array( vertexMaterials );
+  }
+}
+
+template<class T>
+void SceneFile::writeTree( Writer& w, const KdAccel<T>* tree, const std::vector<uint32_t>& prims )
+{
+  if( !tree ) {
+    w.put( (int32_t)0 );
+    return;
+  }
+  int width = tree->getWidth();
+  w.put( (int32_t)width );
+  w.block( tree->getNodes(), tree->getNodeNum(), KdAccel<T>::getNodeSize( width ) );
+  w.array( prims );
+}
+
+// the trees in the order of the scene's meshes, then the top-level tree,
+// then the checksum of all that comes before it
+void SceneFile::writeTrees( const Scene& scene, const char* path, uint64_t key )
+{
+  FILE* fp = fopen( path, "wb" );
+  if( !fp )
+    throw SceneFileException( string( "couldn't open " ) + path + " for writing" );
+  Writer w( fp );
+
+  try {
+    writeHeader( w, TREES_MAGIC );
+    w.put( key );
+    w.put( (int32_t)scene.treeMethod );
+    w.put( (int32_t)scene.treeWidth );
+    w.put( (uint32_t)scene.meshCache.size() );
+    for( Scene::mmap::const_iterator m = scene.meshCache.begin(); m != scene.meshCache.end(); ++m )
+      writeMeshTree( w, *m->second );
+
+    std::map<const Geometry*, uint32_t> objects;
+    for( size_t k = 0; k < scene.objects.size(); ++k )
+      objects[scene.objects[k]] = k;
+    std::vector<uint32_t> prims;
+    const std::vector<Geometry*>& refs = scene.kdtree->getPrims();
+    for( size_t k = 0; k < refs.size(); ++k )
+      prims.push_back( objects[refs[k]] );
+    writeTree( w, scene.kdtree, prims );
+    uint64_t sum = w.sum;
+    w.put( sum );
+  }
+  catch( ... ) {
+    fclose( fp );
+    throw;
+  }
+  if( fclose( fp ) != 0 )
+    throw SceneFileException( "couldn't write the kd trees" );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Reading
+//
+
+void SceneFile::readHeader( Reader& r, const char* magic )
+{
+  uint32_t sizes[6], expected[6];
+  layoutSizes( expected );
+  r.need( sizeof(MAGIC) );
+  if( memcmp( r.pos, magic, sizeof(MAGIC) ) != 0 )
+    throw SceneFileException( "not a compiled scene" );
+  r.pos += sizeof(MAGIC);
+  uint32_t version = r.get<uint32_t>();
+  if( version != VERSION ) {
+    char msg[80];
+    sprintf( msg, "compiled scene is version %u, this program reads version %u", version, VERSION );
+    throw SceneFileException( msg );
+  }
+  bool sameOrder = r.get<uint32_t>() == ORDER_MARK;
+  for( int k = 0; k < 6; ++k )
+    sizes[k] = r.get<uint32_t>();
+  if( !sameOrder || memcmp( sizes, expected, sizeof(sizes) ) != 0 )
+    throw SceneFileException( "compiled scene was written on an incompatible machine, compile it again here" );
+}
+
+Scene* SceneFile::read( MappedFile* file, const string& basePath )
+{
+  // the scene owns the file from here, and frees what was read if it throws
+  std::unique_ptr<Scene> scene( new Scene );
+  scene->source = file;
+  Reader r( file->begin(), file->end() );
+
+  readHeader( r, MAGIC );
+  int treeMethod = r.get<int32_t>();
+  int treeWidth = r.get<int32_t>();
+
+  Camera& camera = scene->camera;
+  camera.m = r.get<Mat3d>();
+  camera.normalizedHeight = r.get<double>();
+  camera.aspectRatio = r.get<double>();
+  camera.eye = r.get<Vec3d>();
+  camera.update();
+  scene->ambientIntensity = r.get<Vec3d>();
+
+  std::vector<TextureMap*> textures( r.get<uint32_t>() );
+  for( size_t k = 0; k < textures.size(); ++k ) {
+    bool relative = r.get<uint8_t>() != 0;
+    string name = r.str();
+    textures[k] = scene->getTexture( relative ? basePath + "/" + name : name );
+  }
+
+  uint32_t lightNum = r.get<uint32_t>();
+  for( uint32_t k = 0; k < lightNum; ++k ) {
+    uint8_t type = r.get<uint8_t>();
+    Vec3d color = r.get<Vec3d>();
+    if( type == LIGHT_POINT ) {
+      Vec3d position = r.get<Vec3d>();
+      float constantTerm = r.get<float>();
+      float linearTerm = r.get<float>();
+      float quadraticTerm = r.get<float>();
+      scene->add( new PointLight( scene.get(), position, color, constantTerm, linearTerm, quadraticTerm ) );
+    } else if( type == LIGHT_DIRECTIONAL ) {
+      Vec3d orientation = r.get<Vec3d>();
+      DirectionalLight* light = new DirectionalLight( scene.get(), orientation, color );
+      // already normalized once; again could change its last bits
+      light->orientation = orientation;
+      scene->add( light );
+    } else
+      throw SceneFileException( "compiled scene has a light of unknown type" );
+  }
+
+  std::vector<TrimeshMesh*> meshes( r.get<uint32_t>() );
+  for( size_t k = 0; k < meshes.size(); ++k ) {
+    size_t key;
+    meshes[k] = readMesh( r, key );
+    scene->meshCache.insert( std::make_pair( key, meshes[k] ) );
+  }
+
+  uint32_t objectNum = r.get<uint32_t>();
+  for( uint32_t k = 0; k < objectNum; ++k )
+    scene->objects.push_back( readObject( r, scene.get(), textures, meshes ) );
+
+  scene->kdtree = readTree<Geometry>( r, scene->objects.empty() ? NULL : &scene->objects[0], scene->objects.size() );
+  if( scene->kdtree ) {
+    scene->treeMethod = treeMethod;
+    scene->treeWidth = treeWidth;
+  }
+  scene->sceneBounds = r.box();
+  return scene.release();
+}
+
+// Every tree is read before any is swapped in, so a damaged file leaves
+// the scene as it was.
+void SceneFile::readTrees( Scene* scene, MappedFile* file, uint64_t key )
+{
+  std::unique_ptr<MappedFile> owner( file );
+  const size_t sumSize = sizeof(uint64_t);
+  if( file->size() < sumSize )
+    throw SceneFileException( "compiled scene is truncated" );
+  uint64_t sum;
+  memcpy( &sum, file->end() - sumSize, sumSize );
+  if( checksum( CHECKSUM_START, file->begin(), file->size() - sumSize ) != sum )
+    throw SceneFileException( "kd trees are damaged, their checksum doesn't match" );
+  Reader r( file->begin(), file->end() - sumSize );
+
+  readHeader( r, TREES_MAGIC );
+  uint64_t treeKey = r.get<uint64_t>();
+  int method = r.get<int32_t>();
+  int width = r.get<int32_t>();
+  uint32_t meshNum = r.get<uint32_t>();
+  if( treeKey != key || method != scene->treeMethod || width != scene->treeWidth
+    || meshNum != scene->meshCache.size() )
+    throw SceneFileException( "kd trees of another scene" );
+
+  std::vector< std::unique_ptr< KdAccel<TrimeshFace> > > meshTrees;
+  for( Scene::mmap::iterator m = scene->meshCache.begin(); m != scene->meshCache.end(); ++m ) {
+    meshTrees.push_back( std::unique_ptr< KdAccel<TrimeshFace> >( readMeshTree( r, *m->second ) ) );
+    if( !meshTrees.back() )
+      throw SceneFileException( "kd trees of another scene" );
+  }
+  KdAccel<Geometry>* tree = readTree<Geometry>( r, scene->objects.empty() ? NULL : &scene->objects[0], scene->objects.size() );
+  if( !tree )
+    throw SceneFileException( "kd trees of another scene" );
+
+  int k = 0;
+  for( Scene::mmap::iterator m = scene->meshCache.begin(); m != scene->meshCache.end(); ++m, ++k ) {
+    delete m->second->tree;
+    m->second->tree = meshTrees[k].release();
+  }
+  delete scene->kdtree;
+  scene->kdtree = tree;
+  delete scene->treeSource;
+  scene->treeSource = owner.release();
+}
+
+Material* SceneFile::readMaterial( Reader& r, const std::vector<TextureMap*>& textures )
+{
+  std::unique_ptr<Material> m( new Material );
+  MaterialParameter* params[8] = { &m->_ke, &m->_ka, &m->_ks, &m->_kd, &m->_kr, &m->_kt, &m->_shininess, &m->_index };
+  for( int k = 0; k < 8; ++k ) {
+    params[k]->_value = r.get<Vec3d>();
+    int32_t texture = r.get<int32_t>();
+    if( texture >= (int32_t)textures.size() )
+      throw SceneFileException( "compiled scene has a bad texture index" );
+    params[k]->_textureMap = texture < 0 ? NULL : textures[texture];
+  }
+  m->setBools();
+  return m.release();
+}
+
+TrimeshMesh* SceneFile::readMesh( Reader& r, size_t& key )
+{
+  std::unique_ptr<TrimeshMesh> mesh( new TrimeshMesh );
+  key = r.get<uint64_t>();
+
+  size_t n;
+  const Vec3d* vertices = r.array<Vec3d>( n );
+  mesh->vertices.assign( vertices, vertices + n );
+  const Vec3d* normals = r.array<Vec3d>( n );
+  mesh->normals.assign( normals, normals + n );
+
+  const int32_t* corners = r.array<int32_t>( n );
+  if( n % 3 != 0 )
+    throw SceneFileException( "compiled scene has a bad mesh" );
+  int vertexNum = mesh->vertices.size();
+  mesh->faces.reserve( n / 3 );
+  for( size_t k = 0; k < n; k += 3 ) {
+    for( int j = 0; j < 3; ++j )
+      if( corners[k+j] < 0 || corners[k+j] >= vertexNum )
+        throw SceneFileException( "compiled scene has a bad mesh" );
+    mesh->faces.push_back( TrimeshFace( mesh.get(), corners[k], corners[k+1], corners[k+2] ) );
+  }
+  mesh->localBounds = r.box();
+
+  mesh->tree = readMeshTree( r, *mesh );
+  return mesh.release();
+}
+
+KdAccel<TrimeshFace>* SceneFile::readMeshTree( Reader& r, TrimeshMesh& mesh )
+{
+  std::vector<TrimeshFace*> refs( mesh.faces.size() );
+  for( size_t k = 0; k < refs.size(); ++k )
+    refs[k] = &mesh.faces[k];
+  return readTree<TrimeshFace>( r, refs.empty() ? NULL : &refs[0], refs.size() );
+}
+
+Geometry* SceneFile::readObject( Reader& r, Scene* scene, const std::vector<TextureMap*>& textures,
+  const std::vector<TrimeshMesh*>& meshes )
+{
+  uint8_t type = r.get<uint8_t>();
+  Mat4d xform = r.get<Mat4d>();
+  BoundingBox bounds = r.box();
+  Material* mat = readMaterial( r, textures );
+  // the whole transform, under the root whose own is the identity
+  TransformNode* transform = scene->transformRoot.createChild( xform );
+
+  Geometry* obj = NULL;
+  switch( type ) {
+    case OBJECT_BOX:
+      obj = new Box( scene, mat );
+      break;
+    case OBJECT_SPHERE:
+      obj = new Sphere( scene, mat );
+      break;
+    case OBJECT_SQUARE:
+      obj = new Square( scene, mat );
+      break;
+    case OBJECT_CYLINDER:
+    {
+      Cylinder* cylinder = new Cylinder( scene, mat );
+      obj = cylinder;
+      cylinder->capped = r.get<uint8_t>() != 0;
+      break;
+    }
+    case OBJECT_CONE:
+    {
+      double height = r.get<double>();
+      double bottomRadius = r.get<double>();
+      double topRadius = r.get<double>();
+      bool capped = r.get<uint8_t>() != 0;
+      obj = new Cone( scene, mat, height, bottomRadius, topRadius, capped );
+      break;
+    }
+    case OBJECT_TRIMESH:
+    {
+      Trimesh* trimesh = new Trimesh( scene, mat, transform );
+      std::unique_ptr<Geometry> owner( trimesh );
+      uint32_t id = r.get<uint32_t>();
+      if( id >= meshes.size() )
+        throw SceneFileException( "compiled scene has a bad mesh index" );
+      delete trimesh->mesh;
+      trimesh->mesh = meshes[id];
+      trimesh->meshShared = true;
+      scene->meshInstanceNum++;
+      trimesh->vertNorms = r.get<uint8_t>() != 0;
+      uint32_t materialNum = r.get<uint32_t>();
+      for( uint32_t k = 0; k < materialNum; ++k )
+        trimesh->materials.push_back( readMaterial( r, textures ) );
+      size_t n;
+      const int32_t* vertexMaterials = r.array<int32_t>( n );
+      for( size_t k = 0; k < n; ++k )
+        if( vertexMaterials[k] < 0 || vertexMaterials[k] >= (int32_t)materialNum )
+          throw SceneFileException( "compiled scene has a bad material index" );
+      trimesh->vertexMaterials.assign( vertexMaterials, vertexMaterials + n );
+      obj = owner.release();
+      break;
+    }
+    default:
+      delete mat;
+      throw SceneFileException( "compiled scene has an object of unknown type" );
+  }
+  obj->setTransform( transform );
+  obj->bounds = bounds;
+  return obj;
+}
+
+// Every node is checked before the tree is used: children come after
+// their parents and inside the array, and leaves inside the primitives.
+// The depth is found on the way, for the traversal stacks.
+template<class T>
+KdAccel<T>* SceneFile::readTree( Reader& r, T* const* objects, size_t objectNum )
+{
+  int width = r.get<int32_t>();
+  if( width == 0 )
+    return NULL;
+  if( width != 2 && width != 4 && width != 8 )
+    throw SceneFileException( "compiled scene has a bad kd tree" );
+
+  size_t nodeNum, primNum;
+  const char* nodes = r.block( nodeNum, KdAccel<T>::getNodeSize( width ) );
+  const uint32_t* ids = r.array<uint32_t>( primNum );
+  if( nodeNum == 0 )
+    throw SceneFileException( "compiled scene has a bad kd tree" );
+
+  std::vector<T*> prims( primNum );
+  for( size_t k = 0; k < primNum; ++k ) {
+    if( ids[k] >= objectNum )
+      throw SceneFileException( "compiled scene has a bad kd tree" );
+    prims[k] = objects[ids[k]];
+  }
+
+  std::vector<int> depth( nodeNum, 0 );
+  depth[0] = 1;
+  int maxDepth = 1;
+  bool bad = false;
+  for( size_t k = 0; k < nodeNum && !bad; ++k ) {
+    if( depth[k] == 0 ) {
+      // not a child of any node before it
+      bad = true;
+    } else if( width == 2 ) {
+      FlatKdNode node;
+      memcpy( &node, nodes + k*sizeof(FlatKdNode), sizeof(FlatKdNode) );
+      if( node.isLeaf() )
+        bad = (size_t)node.offset + node.count > primNum;
+      else if( node.offset <= k + 1 || node.offset >= nodeNum )
+        bad = true;
+      else
+        depth[k+1] = depth[node.offset] = depth[k] + 1;
+    } else {
+      const uint32_t* child;
+      const uint32_t* count;
+      if( width == 4 ) {
+        const WideKdNode<4>* node = (const WideKdNode<4>*)(nodes + k*sizeof(WideKdNode<4>));
+        child = node->child;
+        count = node->count;
+      } else {
+        const WideKdNode<8>* node = (const WideKdNode<8>*)(nodes + k*sizeof(WideKdNode<8>));
+        child = node->child;
+        count = node->count;
+      }
+      for( int c = 0; c < width && !bad; ++c ) {
+        if( child[c] == WIDE_EMPTY )
+          continue;
+        if( count[c] > 0 )
+          bad = (size_t)child[c] + count[c] > primNum;
+        else if( child[c] <= k || child[c] >= nodeNum )
+          bad = true;
+        else
+          depth[child[c]] = depth[k] + 1;
+      }
+    }
+    maxDepth = std::max( maxDepth, depth[k] );
+  }
+  if( bad )
+    throw SceneFileException( "compiled scene has a bad kd tree" );
+
+  return new KdAccel<T>( width, nodes, nodeNum, maxDepth, prims );
+}
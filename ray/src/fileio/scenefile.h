@@ -0,0 +1,99 @@
+#ifndef _SCENEFILE_H_
+#define _SCENEFILE_H_
+
+// Compiled scenes (.rayb): a scene as the parser left it, together with
+// its kd trees, written in binary so it loads without tokenizing, parsing
+// or building anything.
+//
+//		ray --compile scene.ray scene.rayb
+//		ray scene.rayb out.bmp
+//
+// The file is the scene's own data one part after another: a header with
+// the format version, the camera, the textures by name, the lights, every
+// unique mesh with its vertices, normals, faces and tree, the objects with
+// their transforms and materials, and the top-level tree.  Arrays start on
+// 64 byte boundaries, so the tree nodes of a mapped file are used where
+// they lie; vertices and faces are copied into the meshes that own them.
+// Numbers are stored as the machine that wrote them holds them, and files
+// from another byte order or format version are refused.
+//
+// The same layout holds the trees alone for TreeCache, with a checksum at
+// the end since those files are read back without a scene file to check
+// them against.
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+class Scene;
+class Geometry;
+class Material;
+class TextureMap;
+class TrimeshMesh;
+class TrimeshFace;
+class MappedFile;
+template <typename Obj>
+class KdAccel;
+
+class SceneFileException {
+  public:
+    SceneFileException( const std::string& errorMsg ) : _errorMsg( errorMsg ) {}
+    std::string message() const { return _errorMsg; }
+
+  private:
+    std::string _errorMsg;
+};
+
+class SceneFile {
+ public:
+  // whether the bytes start like a compiled scene
+  static bool isCompiled( const char* begin, const char* end );
+
+  // Write scene and its trees, as they were built, to path.  Textures are
+  // named relative to basePath, the directory path is in, where they can
+  // be; read() looks for them from the directory it is given.
+  static void write( const Scene& scene, const char* path, const std::string& basePath );
+
+  // The scene compiled into file, which it takes over.  Relative texture
+  // names are looked for in basePath.
+  static Scene* read( MappedFile* file, const std::string& basePath );
+
+  // The kd trees of scene alone, as TreeCache keeps them: key names the
+  // geometry they were built over, and a checksum of the whole follows.
+  static void writeTrees( const Scene& scene, const char* path, uint64_t key );
+  // Swap in the trees of file, which must be those of key built the way
+  // the scene's treeMethod and treeWidth say; the scene keeps file.
+  // Throws, leaving the scene as it was, if they aren't or are damaged.
+  static void readTrees( Scene* scene, MappedFile* file, uint64_t key );
+
+ private:
+  struct Writer;
+  struct Reader;
+  typedef std::map<const TextureMap*, int> TextureIds;
+  typedef std::map<const TrimeshMesh*, int> MeshIds;
+
+  // magic, version, byte order and the sizes of the types written raw
+  static void writeHeader( Writer& w, const char* magic );
+  static void readHeader( Reader& r, const char* magic );
+
+  static void writeMaterial( Writer& w, const Material& m, const TextureIds& textures );
+  static Material* readMaterial( Reader& r, const std::vector<TextureMap*>& textures );
+
+  static void writeMesh( Writer& w, const TrimeshMesh& mesh, size_t key );
+  static TrimeshMesh* readMesh( Reader& r, size_t& key );
+  static void writeMeshTree( Writer& w, const TrimeshMesh& mesh );
+  static KdAccel<TrimeshFace>* readMeshTree( Reader& r, TrimeshMesh& mesh );
+
+  static void writeObject( Writer& w, const Geometry* obj, const TextureIds& textures, const MeshIds& meshes );
+  static Geometry* readObject( Reader& r, Scene* scene, const std::vector<TextureMap*>& textures,
+    const std::vector<TrimeshMesh*>& meshes );
+
+  // a tree with its primitives as indices into the objects it was built over
+  template<class T>
+  static void writeTree( Writer& w, const KdAccel<T>* tree, const std::vector<uint32_t>& prims );
+  template<class T>
+  static KdAccel<T>* readTree( Reader& r, T* const* objects, size_t objectNum );
+};
+
+#endif
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "treecache.h"
+#include "mappedfile.h"
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#endif
+
+static const char SUFFIX[] = ".kdt";
+
+TreeCache::TreeCache( const std::string& dir, size_t maxBytes )
+  : dir( dir ), maxBytes( maxBytes ), entryNum( 0 ), bytes( 0 ), evictedNum( 0 )
+{
+#ifndef _WIN32
+  // the directory itself, not its parents
+  mkdir( dir.c_str(), 0777 );
+#endif
+}
+
+std::string TreeCache::path( uint64_t key ) const
+{
+  char name[32];
+  sprintf( name, "/%016llx", (unsigned long long)key );
+  return dir + name + SUFFIX;
+}
+
+MappedFile* TreeCache::open( uint64_t key )
+{
+#ifndef _WIN32
+  std::string name = path( key );
+  MappedFile* file = new MappedFile;
+  if( !file->open( name.c_str(), MappedFile::RANDOM ) ) {
+    delete file;
+    return NULL;
+  }
+  // used now, for the eviction
+  utimes( name.c_str(), NULL );
+  return file;
+#else
+  return NULL;
+#endif
+}
+
+bool TreeCache::store( uint64_t key, const std::function<void( const char* )>& write )
+{
+#ifndef _WIN32
+  std::string name = path( key );
+  char suffix[32];
+  sprintf( suffix, ".%d.tmp", (int)getpid() );
+  std::string temp = name + suffix;
+  try {
+    write( temp.c_str() );
+  }
+  catch( ... ) {
+    unlink( temp.c_str() );
+    throw;
+  }
+
+  struct stat st;
+  if( stat( temp.c_str(), &st ) != 0 || (size_t)st.st_size > maxBytes
+    || rename( temp.c_str(), name.c_str() ) != 0 ) {
+    unlink( temp.c_str() );
+    evict( std::string() );
+    return false;
+  }
+  evict( name );
+  return true;
+#else
+  return false;
+#endif
+}
+
+void TreeCache::remove( uint64_t key )
+{
+#ifndef _WIN32
+  unlink( path( key ).c_str() );
+#endif
+}
+
+namespace {
+  struct Entry {
+    time_t used;
+    size_t size;
+    std::string name;
+    bool operator<( const Entry& e ) const { return used < e.used; }
+  };
+}
+
+void TreeCache::evict( const std::string& keep )
+{
+#ifndef _WIN32
+  DIR* d = opendir( dir.c_str() );
+  if( !d )
+    return;
+  std::vector<Entry> entries;
+  bytes = 0;
+  size_t suffixLen = strlen( SUFFIX );
+  while( struct dirent* e = readdir( d ) ) {
+    size_t len = strlen( e->d_name );
+    if( len <= suffixLen || strcmp( e->d_name + len - suffixLen, SUFFIX ) != 0 )
+      continue;
+    Entry entry;
+    entry.name = dir + "/" + e->d_name;
+    struct stat st;
+    if( stat( entry.name.c_str(), &st ) != 0 || !S_ISREG( st.st_mode ) )
+      continue;
+    entry.used = st.st_mtime;
+    entry.size = st.st_size;
+    bytes += entry.size;
+    entries.push_back( entry );
+  }
+  closedir( d );
+
+  std::sort( entries.begin(), entries.end() );
+  entryNum = entries.size();
+  for( size_t k = 0; k < entries.size() && bytes > maxBytes; ++k ) {
+    if( entries[k].name == keep || unlink( entries[k].name.c_str() ) != 0 )
+      continue;
+    bytes -= entries[k].size;
+    entryNum--;
+    evictedNum++;
+  }
+#endif
+}
@@ -0,0 +1,61 @@
+#ifndef _TREECACHE_H_
+#define _TREECACHE_H_
+
+// A directory of built kd trees, so that a scene rendered again does not
+// build them again.  Each entry is one file holding all the trees of a
+// scene (SceneFile::writeTrees), named by a hash of the geometry they were
+// built over and how they were built:
+//
+//		<dir>/<key as 16 hex digits>.kdt
+//
+// Using an entry sets its modification time, and storing one removes the
+// entries used longest ago until the directory is under its size limit.
+// Entries are written under a temporary name and renamed into place, so
+// several renders may share a directory; the checksum in each entry
+// catches the rest, and a damaged entry is removed and built again.
+//
+//		TreeCache cache( "/tmp/kd", 1 << 30 );
+//		MappedFile* file = cache.open( key );
+//		if( !file ) {
+//			build();
+//			cache.store( key, [&]( const char* path ) { write( path ); } );
+//		}
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <functional>
+
+class MappedFile;
+
+class TreeCache {
+ public:
+  TreeCache( const std::string& dir, size_t maxBytes );
+
+  // the entry of key, marked as just used, or NULL if there is none
+  MappedFile* open( uint64_t key );
+  // Store the entry write makes at the path it is given, then evict.
+  // False, with nothing stored, if write throws or the directory can't
+  // be written; what write throws is passed on.
+  bool store( uint64_t key, const std::function<void( const char* )>& write );
+  // drop an entry found damaged
+  void remove( uint64_t key );
+
+  // the directory as last seen by store(), and what it evicted
+  int getEntryNum() const { return entryNum; }
+  size_t getBytes() const { return bytes; }
+  int getEvictedNum() const { return evictedNum; }
+
+ private:
+  std::string path( uint64_t key ) const;
+  // remove the least recently used entries until the rest fit, keeping keep
+  void evict( const std::string& keep );
+
+  std::string dir;
+  size_t maxBytes;
+  int entryNum;
+  size_t bytes;
+  int evictedNum;
+};
+
+#endif
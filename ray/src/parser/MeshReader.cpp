@@ -0,0 +1,496 @@
+#pragma warning (disable: 4786)
+
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+
+#include "MeshReader.h"
+#include "Tokenizer.h"
+#include "ParserException.h"
+#include "../fileio/mappedfile.h"
+#include "../SceneObjects/trimesh.h"
+#include "../TaskPool.h"
+
+using namespace std;
+
+// OBJ files smaller than this per thread are parsed in one piece
+static const size_t MIN_CHUNK = 1 << 18;
+
+void MeshReader::read( const string& path, Trimesh* mesh, bool generateNormals )
+{
+  MappedFile file;
+  if( !file.open( path.c_str() ) )
+    throw ParserException( "couldn't read mesh file " + path );
+
+  Mesh out;
+  out.generateNormals = false;
+  string extension = path.substr( min( path.size(), path.find_last_of( '.' ) ) );
+  transform( extension.begin(), extension.end(), extension.begin(), ::tolower );
+  if( file.size() >= 4 && memcmp( file.begin(), "ply", 3 ) == 0 && isspace( (unsigned char)file.begin()[3] ) )
+    readPly( path, file.begin(), file.end(), out );
+  else if( extension == ".obj" )
+    readObj( path, file.begin(), file.end(), out );
+  else
+    throw ParserException( path + ": not an OBJ or PLY mesh" );
+
+  // generateNormals() adds to the normals there are
+  if( generateNormals )
+    vector<Vec3d>().swap( out.normals );
+  mesh->swapVertices( out.vertices );
+  mesh->swapNormals( out.normals );
+  mesh->reserveFaces( out.faces.size() / 3 );
+  // the corners were checked as they were read
+  for( size_t k = 0; k < out.faces.size(); k += 3 )
+    mesh->addFace( out.faces[k], out.faces[k+1], out.faces[k+2] );
+  if( generateNormals || out.generateNormals )
+    mesh->generateNormals();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// OBJ
+//
+
+// the normal of a corner that has none
+static const int NO_NORMAL = INT_MIN;
+
+namespace {
+  // A run of whole lines of an OBJ file, parsed on its own.  Corners that
+  // count back from the last vertex are only known here relative to the
+  // start of the chunk; they are flagged and moved once the vertices of
+  // the chunks before are counted.
+  struct ObjChunk {
+    const char* begin;
+    const char* end;
+    vector<Vec3d> vertices;
+    vector<Vec3d> normals;
+    vector<int> corners;          // vertex of each triangle corner
+    vector<int> normalCorners;    // and its normal, NO_NORMAL for none
+    vector<char> cornerRelative;
+    vector<char> normalRelative;
+    int lines;
+    string error;                 // at line lines of the chunk, if any
+  };
+}
+
+static const char* skipBlanks( const char* p, const char* end )
+{
+  while( p < end && (' ' == *p || '\t' == *p || '\r' == *p) )
+    ++p;
+  return p;
+}
+
+static const char* wordEnd( const char* p, const char* end )
+{
+  while( p < end && !isspace( (unsigned char)*p ) )
+    ++p;
+  return p;
+}
+
+// three numbers; a fourth, as in "v x y z w", is ignored
+static bool readObjVec3d( const char* p, const char* end, Vec3d& v )
+{
+  for( int i = 0; i < 3; ++i ) {
+    p = skipBlanks( p, end );
+    const char* e = wordEnd( p, end );
+    if( p == e || !(isdigit( (unsigned char)*p ) || '-' == *p || '+' == *p || '.' == *p) )
+      return false;
+    v[i] = Tokenizer::ScanNumber( p, e );
+    p = e;
+  }
+  return true;
+}
+
+// an index of a face corner, 0 if there is none
+static int readObjIndex( const char*& p, const char* end )
+{
+  bool negative = p < end && '-' == *p;
+  if( negative )
+    ++p;
+  int i = 0;
+  for( ; p < end && isdigit( (unsigned char)*p ); ++p )
+    i = i * 10 + (*p - '0');
+  return negative ? -i : i;
+}
+
+static void parseObjChunk( ObjChunk& c )
+{
+  struct Corner { int v, n; bool vRelative, nRelative; };
+  vector<Corner> face;
+  c.lines = 0;
+  for( const char* p = c.begin; p < c.end; ++c.lines ) {
+    const char* eol = (const char*)memchr( p, '\n', c.end - p );
+    if( !eol )
+      eol = c.end;
+    const char* line = skipBlanks( p, eol );
+    const char* key = wordEnd( line, eol );
+    p = eol + 1;
+
+    if( key - line == 1 && 'v' == line[0] ) {
+      Vec3d v;
+      if( !readObjVec3d( key, eol, v ) ) {
+        c.error = "expected three vertex coordinates";
+        return;
+      }
+      c.vertices.push_back( v );
+    } else if( key - line == 2 && 'v' == line[0] && 'n' == line[1] ) {
+      Vec3d n;
+      if( !readObjVec3d( key, eol, n ) ) {
+        c.error = "expected three normal coordinates";
+        return;
+      }
+      c.normals.push_back( n );
+    } else if( key - line == 1 && 'f' == line[0] ) {
+      // v, v/t, v/t/n or v//n, counted from 1 or back from the last one
+      face.clear();
+      for( const char* q = skipBlanks( key, eol ); q < eol; q = skipBlanks( q, eol ) ) {
+        const char* e = wordEnd( q, eol );
+        Corner corner;
+        corner.v = readObjIndex( q, e );
+        corner.n = 0;
+        if( q < e && '/' == *q ) {
+          ++q;
+          readObjIndex( q, e );
+          if( q < e && '/' == *q ) {
+            ++q;
+            corner.n = readObjIndex( q, e );
+          }
+        }
+        if( 0 == corner.v || q != e ) {
+          c.error = "bad face corner";
+          return;
+        }
+        corner.vRelative = corner.v < 0;
+        corner.v += corner.vRelative ? (int)c.vertices.size() : -1;
+        corner.nRelative = corner.n < 0;
+        if( corner.n == 0 )
+          corner.n = NO_NORMAL;
+        else
+          corner.n += corner.nRelative ? (int)c.normals.size() : -1;
+        face.push_back( corner );
+      }
+      if( face.size() < 3 ) {
+        c.error = "faces must have at least 3 vertices";
+        return;
+      }
+      // a fan, as the faces of a trimesh are
+      for( size_t k = 2; k < face.size(); ++k ) {
+        const Corner* triangle[3] = { &face[0], &face[k-1], &face[k] };
+        for( int j = 0; j < 3; ++j ) {
+          c.corners.push_back( triangle[j]->v );
+          c.cornerRelative.push_back( triangle[j]->vRelative );
+          c.normalCorners.push_back( triangle[j]->n );
+          c.normalRelative.push_back( triangle[j]->nRelative );
+        }
+      }
+    }
+    // vt, g, o, s, usemtl, mtllib and comments are skipped
+  }
+}
+
+void MeshReader::readObj( const string& path, const char* begin, const char* end, Mesh& out )
+{
+  // chunks of whole lines, a few per thread to even out their lengths
+  int threads = max( 1, (int)thread::hardware_concurrency() );
+  size_t size = end - begin;
+  size_t chunkNum = min( (size_t)threads * 4, size / MIN_CHUNK + 1 );
+  vector<ObjChunk> chunks( chunkNum );
+  const char* p = begin;
+  for( size_t k = 0; k < chunkNum; ++k ) {
+    const char* e = max( p, begin + size * (k + 1) / chunkNum );
+    if( e < end ) {
+      const char* eol = (const char*)memchr( e, '\n', end - e );
+      e = eol ? eol + 1 : end;
+    }
+    chunks[k].begin = p;
+    chunks[k].end = e;
+    p = e;
+  }
+  if( chunkNum == 1 ) {
+    parseObjChunk( chunks[0] );
+  } else {
+    TaskPool pool( threads );
+    pool.parallelFor( chunkNum, [&chunks]( int k ) { parseObjChunk( chunks[k] ); } );
+  }
+
+  size_t vertexNum = 0, normalNum = 0, cornerNum = 0;
+  int line = 1;
+  for( size_t k = 0; k < chunkNum; ++k ) {
+    const ObjChunk& c = chunks[k];
+    if( !c.error.empty() ) {
+      ostringstream oss;
+      oss << path << ", line " << line + c.lines << ": " << c.error;
+      throw ParserException( oss.str() );
+    }
+    line += c.lines;
+    vertexNum += c.vertices.size();
+    normalNum += c.normals.size();
+    cornerNum += c.corners.size();
+  }
+
+  // the chunks joined, with their relative corners moved to where they are
+  // in the whole file; the normals are the vertices' if every corner says so
+  out.vertices.reserve( vertexNum );
+  out.faces.reserve( cornerNum );
+  bool normalsPerVertex = normalNum > 0 && normalNum == vertexNum;
+  if( normalsPerVertex )
+    out.normals.reserve( normalNum );
+  int vertexBase = 0, normalBase = 0;
+  for( size_t k = 0; k < chunkNum; ++k ) {
+    ObjChunk& c = chunks[k];
+    out.vertices.insert( out.vertices.end(), c.vertices.begin(), c.vertices.end() );
+    if( normalsPerVertex )
+      out.normals.insert( out.normals.end(), c.normals.begin(), c.normals.end() );
+    for( size_t j = 0; j < c.corners.size(); ++j ) {
+      int v = c.corners[j] + (c.cornerRelative[j] ? vertexBase : 0);
+      if( v < 0 || v >= (int)vertexNum ) {
+        ostringstream oss;
+        oss << path << ": a face uses vertex " << v + 1 << " of " << vertexNum;
+        throw ParserException( oss.str() );
+      }
+      int n = c.normalCorners[j];
+      if( n == NO_NORMAL || n + (c.normalRelative[j] ? normalBase : 0) != v )
+        normalsPerVertex = false;
+      out.faces.push_back( v );
+    }
+    vertexBase += c.vertices.size();
+    normalBase += c.normals.size();
+    // freed as soon as it is copied
+    c = ObjChunk();
+  }
+  if( !normalsPerVertex ) {
+    vector<Vec3d>().swap( out.normals );
+    // the file meant it to be smooth, just not the way a trimesh is
+    out.generateNormals = normalNum > 0;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// PLY
+//
+
+namespace {
+  enum PlyType {
+    PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16,
+    PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64
+  };
+
+  struct PlyProperty {
+    string name;
+    bool list;
+    PlyType countType;            // of a list
+    PlyType type;                 // of the value, or of a list's items
+  };
+
+  struct PlyElement {
+    string name;
+    size_t count;
+    vector<PlyProperty> properties;
+  };
+}
+
+static bool plyType( const string& name, PlyType& type )
+{
+  static const char* names[][2] = {
+    { "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+    { "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" }
+  };
+  for( int k = 0; k < 8; ++k )
+    if( name == names[k][0] || name == names[k][1] ) {
+      type = (PlyType)k;
+      return true;
+    }
+  return false;
+}
+
+static size_t plySize( PlyType type )
+{
+  static const size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+  return sizes[type];
+}
+
+// one value as the file holds it, in either byte order
+static double plyValue( const char* p, PlyType type, bool swap )
+{
+  unsigned char b[8];
+  size_t n = plySize( type );
+  memcpy( b, p, n );
+  if( swap )
+    reverse( b, b + n );
+  switch( type ) {
+    case PLY_INT8:    { int8_t v;   memcpy( &v, b, n ); return v; }
+    case PLY_UINT8:   { uint8_t v;  memcpy( &v, b, n ); return v; }
+    case PLY_INT16:   { int16_t v;  memcpy( &v, b, n ); return v; }
+    case PLY_UINT16:  { uint16_t v; memcpy( &v, b, n ); return v; }
+    case PLY_INT32:   { int32_t v;  memcpy( &v, b, n ); return v; }
+    case PLY_UINT32:  { uint32_t v; memcpy( &v, b, n ); return v; }
+    case PLY_FLOAT32: { float v;    memcpy( &v, b, n ); return v; }
+    default:          { double v;   memcpy( &v, b, n ); return v; }
+  }
+}
+
+void MeshReader::readPly( const string& path, const char* begin, const char* end, Mesh& out )
+{
+  // the header, a line at a time
+  vector<PlyElement> elements;
+  bool little = true, haveFormat = false;
+  const char* p = begin;
+  for( bool first = true; ; first = false ) {
+    if( p == end )
+      throw ParserException( path + ": PLY header has no end_header" );
+    const char* eol = (const char*)memchr( p, '\n', end - p );
+    if( !eol )
+      eol = end;
+    istringstream line( string( p, eol ) );
+    p = eol < end ? eol + 1 : end;
+
+    string word;
+    line >> word;
+    if( first ) {
+      if( word != "ply" )
+        throw ParserException( path + ": not a PLY file" );
+    } else if( word == "format" ) {
+      string format;
+      line >> format;
+      if( format == "ascii" )
+        throw ParserException( path + ": ASCII PLY isn't supported, only binary" );
+      if( format != "binary_little_endian" && format != "binary_big_endian" )
+        throw ParserException( path + ": unknown PLY format " + format );
+      little = format == "binary_little_endian";
+      haveFormat = true;
+    } else if( word == "element" ) {
+      PlyElement e;
+      unsigned long long count = 0;
+      if( !(line >> e.name >> count) )
+        throw ParserException( path + ": bad PLY element" );
+      e.count = count;
+      elements.push_back( e );
+    } else if( word == "property" ) {
+      PlyProperty prop;
+      string type;
+      line >> type;
+      prop.list = type == "list";
+      bool known;
+      if( prop.list ) {
+        string countType;
+        line >> countType >> type;
+        known = plyType( countType, prop.countType ) && plyType( type, prop.type );
+      } else {
+        prop.countType = PLY_UINT8;
+        known = plyType( type, prop.type );
+      }
+      line >> prop.name;
+      if( !known || elements.empty() || prop.name.empty() )
+        throw ParserException( path + ": bad PLY property" );
+      elements.back().properties.push_back( prop );
+    } else if( word == "end_header" ) {
+      break;
+    } else if( word != "comment" && word != "obj_info" && !word.empty() ) {
+      throw ParserException( path + ": unexpected PLY header line " + word );
+    }
+  }
+  if( !haveFormat )
+    throw ParserException( path + ": PLY header has no format" );
+  uint16_t one = 1;
+  bool swap = little != (1 == *(unsigned char*)&one);
+
+  // the records, copied out field by field; only vertices and faces kept
+  for( size_t k = 0; k < elements.size(); ++k ) {
+    const PlyElement& e = elements[k];
+    const vector<PlyProperty>& props = e.properties;
+    bool isVertex = e.name == "vertex", isFace = e.name == "face";
+    int fields[6] = { -1, -1, -1, -1, -1, -1 };  // x, y, z, nx, ny, nz
+    int indices = -1;
+    static const char* fieldNames[6] = { "x", "y", "z", "nx", "ny", "nz" };
+    for( size_t j = 0; j < props.size(); ++j ) {
+      for( int f = 0; f < 6; ++f )
+        if( isVertex && !props[j].list && props[j].name == fieldNames[f] )
+          fields[f] = j;
+      if( isFace && props[j].list && (props[j].name == "vertex_indices" || props[j].name == "vertex_index") )
+        indices = j;
+    }
+    if( isVertex && (fields[0] < 0 || fields[1] < 0 || fields[2] < 0) )
+      throw ParserException( path + ": PLY vertices have no x, y and z" );
+    bool normals = isVertex && fields[3] >= 0 && fields[4] >= 0 && fields[5] >= 0;
+
+    // not even the sizes of the records are known ahead if one has a list
+    size_t recordSize = 0;
+    bool fixed = true;
+    for( size_t j = 0; j < props.size(); ++j ) {
+      fixed = fixed && !props[j].list;
+      recordSize += plySize( props[j].type );
+    }
+    if( !isVertex && !isFace && fixed ) {
+      if( recordSize && e.count > (size_t)(end - p) / recordSize )
+        throw ParserException( path + ": PLY file is truncated" );
+      p += e.count * recordSize;
+      continue;
+    }
+
+    size_t room = min( e.count, (size_t)(end - p) );
+    if( isVertex ) {
+      out.vertices.reserve( out.vertices.size() + room );
+      if( normals )
+        out.normals.reserve( out.normals.size() + room );
+    }
+    if( isFace )
+      out.faces.reserve( out.faces.size() + 3 * room );
+    for( size_t r = 0; r < e.count; ++r ) {
+      double values[6];
+      for( size_t j = 0; j < props.size(); ++j ) {
+        const PlyProperty& prop = props[j];
+        size_t itemSize = plySize( prop.type );
+        if( !prop.list ) {
+          if( (size_t)(end - p) < itemSize )
+            throw ParserException( path + ": PLY file is truncated" );
+          for( int f = 0; f < 6; ++f )
+            if( fields[f] == (int)j )
+              values[f] = plyValue( p, prop.type, swap );
+          p += itemSize;
+          continue;
+        }
+        size_t countSize = plySize( prop.countType );
+        if( (size_t)(end - p) < countSize )
+          throw ParserException( path + ": PLY file is truncated" );
+        double count = plyValue( p, prop.countType, swap );
+        p += countSize;
+        if( count < 0 || count > (double)(size_t)(end - p) / itemSize )
+          throw ParserException( path + ": PLY file is truncated" );
+        size_t n = (size_t)count;
+        if( (int)j == indices ) {
+          if( n < 3 )
+            throw ParserException( path + ": faces must have at least 3 vertices" );
+          // a fan, as the faces of a trimesh are
+          int a = (int)plyValue( p, prop.type, swap );
+          int b = (int)plyValue( p + itemSize, prop.type, swap );
+          for( size_t i = 2; i < n; ++i ) {
+            int c = (int)plyValue( p + i * itemSize, prop.type, swap );
+            out.faces.push_back( a );
+            out.faces.push_back( b );
+            out.faces.push_back( c );
+            b = c;
+          }
+        }
+        p += n * itemSize;
+      }
+      if( isVertex ) {
+        out.vertices.push_back( Vec3d( values[0], values[1], values[2] ) );
+        if( normals )
+          out.normals.push_back( Vec3d( values[3], values[4], values[5] ) );
+      }
+    }
+  }
+
+  int vertexNum = out.vertices.size();
+  for( size_t k = 0; k < out.faces.size(); ++k )
+    if( out.faces[k] < 0 || out.faces[k] >= vertexNum ) {
+      ostringstream oss;
+      oss << path << ": a face uses vertex " << out.faces[k] << " of " << vertexNum;
+      throw ParserException( oss.str() );
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef __MESHREADER_H__
+
+#define __MESHREADER_H__
+
+#include <string>
+#include <vector>
+
+#include "../vecmath/vec.h"
+
+class Trimesh;
+
+/*
+   Reads the triangle meshes modelling programs write, for the
+
+      mesh { file = "dragon.ply"; }
+
+   primitive, straight into a Trimesh's arrays instead of through the
+   tokenizer.  Two formats are understood:
+
+   OBJ, told by its .obj extension: the v, vn and f lines, with indices
+   counted from 1 or, when negative, back from the last vertex.  Texture
+   coordinates, groups and materials are skipped.  The file is mapped and
+   split at line ends into chunks that are parsed in parallel, then joined.
+   OBJ normals are indexed apart from the vertices, while a Trimesh has one
+   per vertex, so they are kept only when every corner uses the normal of
+   its own vertex; otherwise they are generated from the faces.
+
+   PLY, told by its "ply" header, in either binary byte order: the x, y, z
+   and, if all three are there, nx, ny, nz properties of the vertex
+   element and the vertex_indices list of the face element.  The records
+   are copied out of the mapped file field by field, since their layout is
+   whatever the header declared.  ASCII PLY is refused.
+
+   Faces with more than three corners are fanned into triangles, as the
+   faces of a trimesh are.
+*/
+
+class MeshReader {
+  public:
+    // Add the vertices, normals and faces of the file at path to mesh,
+    // generating the normals instead of using the file's if asked to.
+    // Throws a ParserException if it can't be read or isn't a mesh.
+    static void read( const std::string& path, Trimesh* mesh, bool generateNormals );
+
+  private:
+    // what a file held, faces as corners three by three
+    struct Mesh {
+      std::vector<Vec3d> vertices;
+      std::vector<Vec3d> normals;
+      std::vector<int> faces;
+      bool generateNormals;       // the normals it had couldn't be used
+    };
+
+    static void readObj( const std::string& path, const char* begin, const char* end, Mesh& out );
+    static void readPly( const std::string& path, const char* begin, const char* end, Mesh& out );
+};
+
+#endif
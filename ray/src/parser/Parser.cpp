@@ -7,6 +7,7 @@
 
 #include "Parser.h"
 #include "Tokenizer.h"
+#include "MeshReader.h"
 #include "../scene/scene.h"
 #include "../scene/material.h"
 #include "../ui/TraceUI.h"
@@ -49,6 +50,7 @@ Scene* Parser::parseScene()
       case CYLINDER:
       case CONE:
       case TRIMESH:
+      case MESH:
       case TRANSLATE:
       case ROTATE:
       case SCALE:
@@ -161,6 +163,7 @@ void Parser::parseTransformableElement( Scene* scene, TransformNode* transform,
       case CYLINDER:
       case CONE:
       case TRIMESH:
+      case MESH:
       case TRANSLATE:
       case ROTATE:
       case SCALE:
@@ -191,6 +194,7 @@ void Parser::parseGroup(Scene* scene, TransformNode* transform, const Material&
       case CYLINDER:
       case CONE:
       case TRIMESH:
+      case MESH:
       case TRANSLATE:
       case ROTATE:
       case SCALE:
@@ -236,6 +240,9 @@ void Parser::parseGeometry(Scene* scene, TransformNode* transform, const Materia
     case TRIMESH:
       parseTrimesh(scene, transform, mat);
       return;
+    case MESH:
+      parseMesh(scene, transform, mat);
+      return;
     case TRANSLATE:
       parseTranslate(scene, transform, mat);
       return;
@@ -551,14 +558,12 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
   _tokenizer.Read( LBRACE );
 
   bool generateNormals( false );
-  list<Vec3d> faces;
+  vector<int> faces;    // corners of the triangles, three by three
 
   char* error;
   for( ;; )
   {
-    const Token* t = _tokenizer.Peek();
-
-    switch( t->kind() )
+    switch( _tokenizer.PeekKind() )
     {
       case GENNORMALS:
         _tokenizer.Read( GENNORMALS );
@@ -574,84 +579,79 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
          parseIdentExpression();
          break;
 
+      // The arrays are sized from a quick count of their elements first,
+      // then read straight into the mesh without making Tokens.
       case MATERIALS:
-        _tokenizer.Read( MATERIALS );
-        _tokenizer.Read( EQUALS );
-        _tokenizer.Read( LPAREN );
-        if( RPAREN != _tokenizer.Peek()->kind() )
+        _tokenizer.Skip( MATERIALS );
+        _tokenizer.Skip( EQUALS );
+        _tokenizer.Skip( LPAREN );
+        tmesh->reserveMaterials( _tokenizer.CountListItems() );
+        if( RPAREN != _tokenizer.PeekKind() )
         {
           tmesh->addMaterial( parseMaterial( scene, tmesh->getMaterial() ) );
-          for( ;; )
+          while( RPAREN != _tokenizer.PeekKind() )
           {
-             const Token* nextToken = _tokenizer.Peek();
-             if( RPAREN == nextToken->kind() )
-               break;
-             _tokenizer.Read( COMMA );
+             _tokenizer.Skip( COMMA );
              tmesh->addMaterial( parseMaterial( scene, tmesh->getMaterial() ) );
           }
         }
-        _tokenizer.Read( RPAREN );
-        _tokenizer.Read( SEMICOLON );
+        _tokenizer.Skip( RPAREN );
+        _tokenizer.Skip( SEMICOLON );
         break;
 
       case NORMALS:
-        _tokenizer.Read( NORMALS );
-        _tokenizer.Read( EQUALS );
-        _tokenizer.Read( LPAREN );
-        if( RPAREN != _tokenizer.Peek()->kind() )
+        _tokenizer.Skip( NORMALS );
+        _tokenizer.Skip( EQUALS );
+        _tokenizer.Skip( LPAREN );
+        tmesh->reserveNormals( _tokenizer.CountListItems() );
+        if( RPAREN != _tokenizer.PeekKind() )
         {
           tmesh->addNormal( parseVec3d() );
-          for( ;; )
+          while( RPAREN != _tokenizer.PeekKind() )
           {
-             const Token* nextToken = _tokenizer.Peek();
-             if( RPAREN == nextToken->kind() )
-               break;
-             _tokenizer.Read( COMMA );
+             _tokenizer.Skip( COMMA );
              tmesh->addNormal( parseVec3d() );
           }
         }
-        _tokenizer.Read( RPAREN );
-        _tokenizer.Read( SEMICOLON );
+        _tokenizer.Skip( RPAREN );
+        _tokenizer.Skip( SEMICOLON );
         break;
 
       case FACES:
-        _tokenizer.Read( FACES );
-        _tokenizer.Read( EQUALS );
-        _tokenizer.Read( LPAREN );
-        if( RPAREN != _tokenizer.Peek()->kind() )
+        _tokenizer.Skip( FACES );
+        _tokenizer.Skip( EQUALS );
+        _tokenizer.Skip( LPAREN );
+        // one triangle per face, more for polygons
+        faces.reserve( faces.size() + 3 * _tokenizer.CountListItems() );
+        if( RPAREN != _tokenizer.PeekKind() )
         {
           parseFaces( faces );
-          for( ;; )
+          while( RPAREN != _tokenizer.PeekKind() )
           {
-             const Token* nextToken = _tokenizer.Peek();
-             if( RPAREN == nextToken->kind() )
-               break;
-             _tokenizer.Read( COMMA );
+             _tokenizer.Skip( COMMA );
              parseFaces( faces );
           }
         }
-        _tokenizer.Read( RPAREN );
-        _tokenizer.Read( SEMICOLON );
+        _tokenizer.Skip( RPAREN );
+        _tokenizer.Skip( SEMICOLON );
         break;
 
       case POLYPOINTS:
-        _tokenizer.Read( POLYPOINTS );
-        _tokenizer.Read( EQUALS );
-        _tokenizer.Read( LPAREN );
-        if( RPAREN != _tokenizer.Peek()->kind() )
+        _tokenizer.Skip( POLYPOINTS );
+        _tokenizer.Skip( EQUALS );
+        _tokenizer.Skip( LPAREN );
+        tmesh->reserveVertices( _tokenizer.CountListItems() );
+        if( RPAREN != _tokenizer.PeekKind() )
         {
           tmesh->addVertex( parseVec3d() );
-          for( ;; )
+          while( RPAREN != _tokenizer.PeekKind() )
           {
-             const Token* nextToken = _tokenizer.Peek();
-             if( RPAREN == nextToken->kind() )
-               break;
-             _tokenizer.Read( COMMA );
+             _tokenizer.Skip( COMMA );
              tmesh->addVertex( parseVec3d() );
           }
         }
-        _tokenizer.Read( RPAREN );
-        _tokenizer.Read( SEMICOLON );
+        _tokenizer.Skip( RPAREN );
+        _tokenizer.Skip( SEMICOLON );
         break;
 
 
@@ -661,13 +661,14 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
 
         // Now add all the faces into the trimesh, since hopefully
         // the vertices have been parsed out
-        for( list<Vec3d>::const_iterator vitr = faces.begin(); vitr != faces.end(); vitr++ )
+        tmesh->reserveFaces( faces.size() / 3 );
+        for( vector<int>::const_iterator vitr = faces.begin(); vitr != faces.end(); vitr += 3 )
         {
-          if( !tmesh->addFace( (*vitr)[0], (*vitr)[1], (*vitr)[2] ) )
+          if( !tmesh->addFace( vitr[0], vitr[1], vitr[2] ) )
           {
             ostringstream oss;
-            oss << "Bad face in trimesh: (" << (*vitr)[0] << ", " << (*vitr)[1] << 
-              ", " << (*vitr)[2] << ")";
+            oss << "Bad face in trimesh: (" << vitr[0] << ", " << vitr[1] << 
+              ", " << vitr[2] << ")";
             throw ParserException( oss.str() );
           }
         }
@@ -678,6 +679,8 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         if( error = tmesh->doubleCheck() )
           throw ParserException( error );
 
+        // placements of the same mesh share its faces and tree
+        tmesh->shareMesh();
         scene->add( tmesh );
         return;
       }
@@ -688,24 +691,101 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
   }
 }
 
-void Parser::parseFaces( list< Vec3d >& faces )
+// mesh { file = "dragon.ply"; } and the trimesh attributes that don't
+// list its parts: the vertices, normals and faces come from the file.
+void Parser::parseMesh(Scene* scene, TransformNode* transform, const Material& mat)
 {
-  list< double > points = parseScalarList();
+  // owned here until it is added, so a bad or missing file doesn't leak it
+  std::unique_ptr<Trimesh> tmesh( new Trimesh( scene, new Material(mat), transform) );
 
-  // triangulate here and now.  assume the poly is
-  // concave (convex?) and we can triangulate using an arbitrary fan
-  if( points.size() < 3 )
-     throw SyntaxErrorException( "Faces must have at least 3 vertices.", _tokenizer );
+  _tokenizer.Read( MESH );
+  _tokenizer.Read( LBRACE );
+
+  bool generateNormals( false );
+  string filename;
+
+  char* error;
+  for( ;; )
+  {
+    switch( _tokenizer.PeekKind() )
+    {
+      case FILENAME:
+        if( !filename.empty() )
+          throw SyntaxErrorException( "Repeated 'file' attribute", _tokenizer );
+        filename = parseIdentExpression();
+        if( filename.empty() )
+          throw SyntaxErrorException( "Expected: mesh file name", _tokenizer );
+        // relative to the scene, like texture maps
+        if( filename[0] != '/' )
+          filename = _basePath + "/" + filename;
+        break;
+
+      case GENNORMALS:
+        _tokenizer.Read( GENNORMALS );
+        _tokenizer.Read( SEMICOLON );
+        generateNormals = true;
+        break;
+
+      case MATERIAL:
+        tmesh->setMaterial( parseMaterialExpression( scene, mat ) );
+        break;
+
+      case NAME:
+         parseIdentExpression();
+         break;
+
+      case RBRACE:
+      {
+        if( filename.empty() )
+          throw SyntaxErrorException( "Expected: 'file' attribute", _tokenizer );
+        _tokenizer.Read( RBRACE );
 
-  list<double>::const_iterator i = points.begin();
-  double a = (*i++);
-  double b = (*i++);
-  while( i != points.end() )
+        MeshReader::read( filename, tmesh.get(), generateNormals );
+
+        if( (error = tmesh->doubleCheck()) )
+          throw ParserException( error );
+
+        tmesh->shareMesh();
+        scene->add( tmesh.release() );
+        return;
+      }
+
+      default:
+        throw SyntaxErrorException( "Expected: mesh attributes", _tokenizer );
+    }
+  }
+}
+
+void Parser::parseFaces( vector< int >& faces )
+{
+  // triangulate here and now, as the corners are read.  assume the poly
+  // is concave (convex?) and we can triangulate using an arbitrary fan
+  int points = 0;
+  int a = 0, b = 0;
+
+  _tokenizer.Skip( LPAREN );
+  while( RPAREN != _tokenizer.PeekKind() )
   {
-    double c = (*i++);
-    faces.push_back( Vec3d( a, b, c ) );
-    b = c;
+    if( points > 0 )
+      _tokenizer.Skip( COMMA );
+    int c = (int)parseScalar();
+    if( points == 0 )
+      a = c;
+    else if( points == 1 )
+      b = c;
+    else
+    {
+      faces.push_back( a );
+      faces.push_back( b );
+      faces.push_back( c );
+      b = c;
+    }
+    ++points;
   }
+  _tokenizer.Skip( RPAREN );
+
+  if( points < 3 )
+     throw SyntaxErrorException( "Faces must have at least 3 vertices.", _tokenizer );
 }
 
 // Ambient lights are a bit special in that we don't actually
@@ -890,9 +970,7 @@ string Parser::parseIdentExpression()
 
 double Parser::parseScalar()
 {
-  auto_ptr<Token> scalar( _tokenizer.Read( SCALAR ) );
-
-  return scalar->value();
+  return _tokenizer.ReadScalar();
 }
 
 string Parser::parseIdent()
@@ -903,24 +981,21 @@ string Parser::parseIdent()
 }
 
 
-list<double> Parser::parseScalarList()
+vector<double> Parser::parseScalarList()
 {
-  list<double> ret;
+  vector<double> ret;
 
-  _tokenizer.Read( LPAREN );
-  if( RPAREN != _tokenizer.Peek()->kind() )
+  _tokenizer.Skip( LPAREN );
+  if( RPAREN != _tokenizer.PeekKind() )
   {
     ret.push_back( parseScalar() );
-    for( ;; )
+    while( RPAREN != _tokenizer.PeekKind() )
     {
-      const Token* nextToken = _tokenizer.Peek();
-      if( RPAREN == nextToken->kind() )
-        break;
-      _tokenizer.Read( COMMA );
+      _tokenizer.Skip( COMMA );
       ret.push_back( parseScalar() );
     }
   }
-  _tokenizer.Read( RPAREN );
+  _tokenizer.Skip( RPAREN );
 
   return ret;
 
@@ -944,35 +1019,30 @@ bool Parser::parseBoolean()
 
 Vec3d Parser::parseVec3d()
 {
-  _tokenizer.Read( LPAREN );
-  auto_ptr<Token> value1( _tokenizer.Read( SCALAR ) );
-  _tokenizer.Read( COMMA );
-  auto_ptr<Token> value2( _tokenizer.Read( SCALAR ) );
-  _tokenizer.Read( COMMA );
-  auto_ptr<Token> value3( _tokenizer.Read( SCALAR ) );
-  _tokenizer.Read( RPAREN );
-
-  return Vec3d( value1->value(), 
-    value2->value(), 
-    value3->value() );
+  _tokenizer.Skip( LPAREN );
+  double value1 = _tokenizer.ReadScalar();
+  _tokenizer.Skip( COMMA );
+  double value2 = _tokenizer.ReadScalar();
+  _tokenizer.Skip( COMMA );
+  double value3 = _tokenizer.ReadScalar();
+  _tokenizer.Skip( RPAREN );
+
+  return Vec3d( value1, value2, value3 );
 }
 
 Vec4d Parser::parseVec4d()
 {
-  _tokenizer.Read( LPAREN );
-  auto_ptr<Token> value1( _tokenizer.Read( SCALAR ) );
-  _tokenizer.Read( COMMA );
-  auto_ptr<Token> value2( _tokenizer.Read( SCALAR ) );
-  _tokenizer.Read( COMMA );
-  auto_ptr<Token> value3( _tokenizer.Read( SCALAR ) );
-  _tokenizer.Read( COMMA );
-  auto_ptr<Token> value4( _tokenizer.Read( SCALAR ) );
-  _tokenizer.Read( RPAREN );
-
-  return Vec4d( value1->value(), 
-    value2->value(), 
-    value3->value(),
-    value4->value() );
+  _tokenizer.Skip( LPAREN );
+  double value1 = _tokenizer.ReadScalar();
+  _tokenizer.Skip( COMMA );
+  double value2 = _tokenizer.ReadScalar();
+  _tokenizer.Skip( COMMA );
+  double value3 = _tokenizer.ReadScalar();
+  _tokenizer.Skip( COMMA );
+  double value4 = _tokenizer.ReadScalar();
+  _tokenizer.Skip( RPAREN );
+
+  return Vec4d( value1, value2, value3, value4 );
 }
 
 Material* Parser::parseMaterial( Scene* scene, const Material& parent )
@@ -992,8 +1062,7 @@ Material* Parser::parseMaterial( Scene* scene, const Material& parent )
 
   for( ;; )
   {
-    const Token* token = _tokenizer.Peek();
-    switch( token->kind() )
+    switch( _tokenizer.PeekKind() )
     {
       case EMISSIVE:
         mat->setEmissive( parseVec3dMaterialParameter(scene) );
@@ -1063,8 +1132,9 @@ Material* Parser::parseMaterial( Scene* scene, const Material& parent )
 
 MaterialParameter Parser::parseVec3dMaterialParameter( Scene* scene )
 {
-  _tokenizer.Get();
-  _tokenizer.Read(EQUALS);
+  // the attribute's name, already switched on
+  _tokenizer.Skip( _tokenizer.PeekKind() );
+  _tokenizer.Skip(EQUALS);
   if( _tokenizer.CondRead( MAP ) )
   {
     _tokenizer.Read( LPAREN );
@@ -1085,8 +1155,9 @@ MaterialParameter Parser::parseVec3dMaterialParameter( Scene* scene )
 
 MaterialParameter Parser::parseScalarMaterialParameter( Scene* scene )
 {
-  _tokenizer.Get();
-  _tokenizer.Read(EQUALS);
+  // the attribute's name, already switched on
+  _tokenizer.Skip( _tokenizer.PeekKind() );
+  _tokenizer.Skip(EQUALS);
   if( _tokenizer.CondRead(MAP) )
   {
     _tokenizer.Read( LPAREN );
@@ -6,6 +6,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 #include "ParserException.h"
 #include "Tokenizer.h"
@@ -71,7 +72,8 @@ private:
     void      parseCylinder(Scene* scene, TransformNode* transform, const Material& mat);
     void      parseCone(Scene* scene, TransformNode* transform, const Material& mat);
     void      parseTrimesh(Scene* scene, TransformNode* transform, const Material& mat);
-    void      parseFaces( std::list< Vec3d >& faces );
+    void      parseMesh(Scene* scene, TransformNode* transform, const Material& mat);
+    void      parseFaces( std::vector< int >& faces );
 
     // Parse transforms
     void parseTranslate(Scene* scene, TransformNode* transform, const Material& mat);
@@ -95,7 +97,7 @@ private:
     // Helper functions for parsing things like vectors
     // and idents.
     double parseScalar();
-    std::list<double> parseScalarList();
+    std::vector<double> parseScalarList();
     Vec3d parseVec3d();
     Vec4d parseVec4d();
     bool parseBoolean();
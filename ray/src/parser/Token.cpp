@@ -56,6 +56,7 @@ string getNameForToken( const SYMBOL kind )
     tokenNames[ CYLINDER ]          = "cylinder";
     tokenNames[ CONE ]              = "cone";
     tokenNames[ TRIMESH ]           = "trimesh";
+    tokenNames[ MESH ]              = "mesh";
     tokenNames[ POSITION ]          = "position";
     tokenNames[ VIEWDIR ]           = "viewdir";
     tokenNames[ UPDIR ]             = "updir";
@@ -72,6 +73,7 @@ string getNameForToken( const SYMBOL kind )
     tokenNames[ NORMALS ]           = "normals";
     tokenNames[ MATERIALS ]         = "materials";
     tokenNames[ FACES ]             = "faces";
+    tokenNames[ FILENAME ]          = "file";
     tokenNames[ TRANSLATE ]         = "translate";
     tokenNames[ SCALE ]             = "scale";
     tokenNames[ ROTATE ]            = "rotate";
@@ -133,6 +135,7 @@ SYMBOL lookupReservedWord(const string& ident) {
     reservedWords["emissive"] = EMISSIVE;
     reservedWords["faces"] = FACES;
     reservedWords["false"] = SYMFALSE;
+    reservedWords["file"] = FILENAME;
     reservedWords["fov"] = FOV;
     reservedWords["gennormals"] = GENNORMALS;
     reservedWords["height"] = HEIGHT;
@@ -141,6 +144,7 @@ SYMBOL lookupReservedWord(const string& ident) {
     reservedWords["material"] = MATERIAL;
     reservedWords["materials"] = MATERIALS;
     reservedWords["map"] = MAP;
+    reservedWords["mesh"] = MESH;
     reservedWords["name"] = NAME;
     reservedWords["normals"] = NORMALS;
     reservedWords["point_light"] = POINT_LIGHT;
@@ -56,6 +56,7 @@ enum SYMBOL {
   CYLINDER,
   CONE,
   TRIMESH,  
+  MESH,						// a trimesh read from an OBJ or PLY file
 
   POSITION, VIEWDIR,		// keywords affecting primitives
   UPDIR, ASPECTRATIO,
@@ -71,6 +72,7 @@ enum SYMBOL {
   POLYPOINTS, NORMALS,			// keywords affecting polygons
   MATERIALS, FACES,
   GENNORMALS,
+  FILENAME,
 
   TRANSLATE, SCALE,			// Transforms
   ROTATE, TRANSFORM,
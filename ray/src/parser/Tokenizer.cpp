@@ -4,6 +4,7 @@
 #include <map>
 #include <sstream>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "../fileio/buffer.h"
 #include "Tokenizer.h"
@@ -37,12 +38,51 @@
 //
 
 Tokenizer::Tokenizer(istream& fp, bool printTokens) 
-  : buffer( fp, false, false )
+  : buffer( new Buffer( fp, false, false ) )
 { 
     TokenColumn = 0;
     CurrentCh = ' ';
     UnGetToken = NULL;
     _printTokens = printTokens;
+    Pos = End = LineStart = NULL;
+    LineNumber = 0;
+    HaveAhead = false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Tokenizer::Tokenizer(const char*, const char*) constructor
+//
+//   Scans [begin, end) in place.  The text must outlive the tokenizer.
+//
+
+Tokenizer::Tokenizer(const char* begin, const char* end, bool printTokens)
+  : buffer( NULL )
+{
+    TokenColumn = 0;
+    CurrentCh = ' ';
+    UnGetToken = NULL;
+    _printTokens = printTokens;
+    Pos = LineStart = begin;
+    End = end;
+    LineNumber = 1;
+    HaveAhead = false;
+}
+
+Tokenizer::~Tokenizer() {
+    delete UnGetToken;
+    delete buffer;
+}
+
+void Tokenizer::PrintLine( ostream& out ) const {
+  if (buffer) {
+    buffer->PrintLine(out);
+    return;
+  }
+  const char* e = LineStart;
+  while (e < End && '\n' != *e)
+    ++e;
+  out << "# " << string(LineStart, e) << std::endl;
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -77,20 +117,31 @@ Token* Tokenizer::GetNext() {
     return T;
   }
 
+  // In memory: take the peeked lexeme, or scan one
+  if (!buffer) {
+    Lexeme lx;
+    if (HaveAhead) {
+      lx = Ahead;
+      HaveAhead = false;
+    } else
+      ScanLexeme(lx);
+    return MakeToken(lx);
+  }
+
   // Otherwise, crank up the scanner and get a new token.
 
   // Get rid of any whitespace
   SkipWhiteSpace();
 
   // test for end of file
-  if (buffer.isEOF()) {
+  if (buffer->isEOF()) {
     T = new Token(EOFSYM);
 
   } else {
     
     // Save the starting position of the symbol in a variable,
     // so that nicer error messages can be produced.
-    TokenColumn = buffer.CurColumn();
+    TokenColumn = buffer->CurColumn();
     
     // Check kind of current character
     
@@ -155,7 +206,7 @@ void Tokenizer::SkipWhiteSpace() {
           GetCh();
           if( CondReadCh( '/' ) )
             break;
-          else if ( buffer.isEOF() )
+          else if ( buffer->isEOF() )
           {
             std::ostringstream ost;
             ost << "Unterminated comment in line ";
@@ -163,7 +214,7 @@ void Tokenizer::SkipWhiteSpace() {
             throw SyntaxErrorException( ost.str(), *this );
           }
         }
-        else if ( buffer.isEOF() )
+        else if ( buffer->isEOF() )
         {
           std::ostringstream ost;
           ost << "Unterminated comment in line ";
@@ -320,9 +371,8 @@ auto_ptr<Token> Tokenizer::Read(SYMBOL kind) {
 //
 
 bool Tokenizer::CondRead(SYMBOL kind) {
-  const Token* T = Peek();
-  if (T->kind() == kind) {
-    Get( );
+  if (PeekKind() == kind) {
+    Skip(kind);
     return true;
   } else {
     return false;
@@ -374,3 +424,286 @@ bool Tokenizer::CondReadCh(char c) {
     return false;
   }
 }
+
+//////////////////////////////////////////////////////////////////////////
+//
+// In-memory scanning
+//
+//   The same tokens as GetNext() and the routines above, scanned with a
+// pointer over text already in memory instead of character by character
+// through the Buffer.  Nothing is copied until a Token is made.
+//
+
+static bool isScalarCh(char c) {
+  return isdigit((unsigned char)c) || '-' == c || '.' == c || 'e' == c;
+}
+
+void Tokenizer::SkipMappedSpace() {
+  for (;;) {
+    while (Pos < End && isspace((unsigned char)*Pos)) {
+      if ('\n' == *Pos) {
+        ++LineNumber;
+        LineStart = Pos + 1;
+      }
+      ++Pos;
+    }
+    if (Pos == End || '/' != *Pos)
+      return;
+
+    TokenColumn = Pos - LineStart;
+    ++Pos;
+    if (Pos < End && '/' == *Pos) {
+      // Throw out everything until the end of the line
+      while (Pos < End && '\n' != *Pos)
+        ++Pos;
+    } else if (Pos < End && '*' == *Pos) {
+      int startLine = LineNumber;
+      for (++Pos; ; ++Pos) {
+        if (Pos + 1 >= End) {
+          std::ostringstream ost;
+          ost << "Unterminated comment in line ";
+          ost << startLine;
+          throw SyntaxErrorException( ost.str(), *this );
+        }
+        if ('\n' == *Pos) {
+          ++LineNumber;
+          LineStart = Pos + 1;
+        } else if ('*' == Pos[0] && '/' == Pos[1]) {
+          Pos += 2;
+          break;
+        }
+      }
+    } else {
+      std::ostringstream ost;
+      ost << "unexpected character: '" << (Pos < End ? *Pos : '\0') << "'";
+      throw SyntaxErrorException( ost.str(), *this );
+    }
+  }
+}
+
+// powers of ten that are exact in a double
+static const double exactPowersOfTen[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// The value of the scalar text [begin, end), as atof() would read it.
+// Plain decimals with at most 19 significant digits and a power of ten
+// up to 22 are converted directly: the digits and the power are both
+// exact in a double, so one multiply or divide rounds correctly.  The
+// rest, and text that isn't a plain decimal, go to atof().
+double Tokenizer::ScanNumber(const char* begin, const char* end) {
+  const char* p = begin;
+  bool negative = p < end && '-' == *p;
+  if (negative)
+    ++p;
+
+  uint64_t mantissa = 0;
+  int digits = 0, scale = 0, exponent = 0;
+  bool any = false, exact = true;
+  for (; p < end && isdigit((unsigned char)*p); ++p, any = true) {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (*p - '0');
+      digits += mantissa != 0;
+    } else {
+      exact = false;
+    }
+  }
+  if (p < end && '.' == *p) {
+    for (++p; p < end && isdigit((unsigned char)*p); ++p, any = true) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*p - '0');
+        digits += mantissa != 0;
+        --scale;
+      } else {
+        exact = false;
+      }
+    }
+  }
+  if (any && p < end && 'e' == *p) {
+    ++p;
+    bool negExp = p < end && '-' == *p;
+    if (negExp)
+      ++p;
+    if (p == end || !isdigit((unsigned char)*p))
+      any = false;
+    for (; p < end && isdigit((unsigned char)*p); ++p)
+      if (exponent < 10000)
+        exponent = exponent * 10 + (*p - '0');
+    if (negExp)
+      exponent = -exponent;
+  }
+
+  int power = scale + exponent;
+  if (any && exact && p == end && mantissa <= (1ULL << 53) && power >= -22 && power <= 22) {
+    double v = (double)mantissa;
+    v = power < 0 ? v / exactPowersOfTen[-power] : v * exactPowersOfTen[power];
+    return negative ? -v : v;
+  }
+  return atof( string(begin, end).c_str() );
+}
+
+void Tokenizer::ScanLexeme(Lexeme& lx) {
+  SkipMappedSpace();
+  lx.value = 0.0;
+  lx.text = NULL;
+  lx.length = 0;
+
+  if (Pos == End) {
+    lx.kind = EOFSYM;
+  } else {
+    TokenColumn = Pos - LineStart;
+    char c = *Pos;
+    if (isalpha((unsigned char)c) || '_' == c) {
+      // identifier or reserved word; only the words are looked up
+      const char* start = Pos;
+      while (Pos < End && (isalnum((unsigned char)*Pos) || '_' == *Pos || '-' == *Pos))
+        ++Pos;
+      lx.kind = lookupReservedWord( string(start, Pos) );
+      if (UNKNOWN == lx.kind) {
+        lx.kind = IDENT;
+        lx.text = start;
+        lx.length = Pos - start;
+      }
+    } else if ('"' == c) {
+      const char* start = ++Pos;
+      while (Pos < End && '"' != *Pos) {
+        if ('\n' == *Pos)
+          throw SyntaxErrorException( "Unterminated string constant", *this );
+        ++Pos;
+      }
+      if (Pos == End)
+        throw SyntaxErrorException( "Unterminated string constant", *this );
+      lx.kind = IDENT;
+      lx.text = start;
+      lx.length = Pos - start;
+      ++Pos;
+    } else if (isdigit((unsigned char)c) || '-' == c || '.' == c) {
+      const char* start = Pos;
+      while (Pos < End && isScalarCh(*Pos))
+        ++Pos;
+      lx.kind = SCALAR;
+      lx.value = ScanNumber(start, Pos);
+    } else {
+      switch (c) {
+      case '(':  lx.kind = LPAREN;     break;
+      case ')':  lx.kind = RPAREN;     break;
+      case '{':  lx.kind = LBRACE;     break;
+      case '}':  lx.kind = RBRACE;     break;
+      case ',':  lx.kind = COMMA;      break;
+      case '=':  lx.kind = EQUALS;     break;
+      case ';':  lx.kind = SEMICOLON;  break;
+
+      default:
+        std::ostringstream ost;
+        ost << "unexpected character: '" << c << "'";
+        throw SyntaxErrorException(ost.str(), *this);
+      }
+      ++Pos;
+    }
+  }
+
+  if (_printTokens) {
+    std::auto_ptr<Token> T( MakeToken(lx) );
+    std::cout << "Token read: ";
+    T->Print();
+    std::cout << std::endl;
+  }
+}
+
+Token* Tokenizer::MakeToken(const Lexeme& lx) const {
+  switch (lx.kind) {
+  case SCALAR:  return new ScalarToken( lx.value );
+  case IDENT:   return new IdentToken( string(lx.text, lx.length) );
+  default:      return new Token( lx.kind );
+  }
+}
+
+void Tokenizer::ThrowExpected(SYMBOL kind) {
+  string msg( getNameForToken( kind ) );
+  msg.append( " expected" );
+  throw SyntaxErrorException(msg, *this);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// SYMBOL Tokenizer::PeekKind(), void Skip(SYMBOL), double ReadScalar()
+//
+//   Peek()->kind(), Read() and Read(SCALAR)->value() without a Token in
+// between, when scanning in memory.  A token already pushed back as a
+// Token is used up first.
+//
+
+SYMBOL Tokenizer::PeekKind() {
+  if (buffer)
+    return Peek()->kind();
+  if (UnGetToken)
+    return UnGetToken->kind();
+  if (!HaveAhead) {
+    ScanLexeme(Ahead);
+    HaveAhead = true;
+  }
+  return Ahead.kind;
+}
+
+void Tokenizer::Skip(SYMBOL kind) {
+  if (buffer) {
+    Read(kind);
+    return;
+  }
+  if (PeekKind() != kind) {
+    // consumed, as Read() would have
+    delete GetNext();
+    ThrowExpected(kind);
+  }
+  if (UnGetToken) {
+    delete UnGetToken;
+    UnGetToken = NULL;
+  } else
+    HaveAhead = false;
+}
+
+double Tokenizer::ReadScalar() {
+  if (buffer)
+    return Read(SCALAR)->value();
+  if (PeekKind() != SCALAR) {
+    delete GetNext();
+    ThrowExpected(SCALAR);
+  }
+  double value;
+  if (UnGetToken) {
+    value = UnGetToken->value();
+    delete UnGetToken;
+    UnGetToken = NULL;
+  } else {
+    value = Ahead.value;
+    HaveAhead = false;
+  }
+  return value;
+}
+
+int Tokenizer::CountListItems() {
+  if (buffer || UnGetToken || HaveAhead)
+    return 0;
+  int items = 0, depth = 1;
+  for (const char* p = Pos; p < End; ++p) {
+    char c = *p;
+    if ('(' == c || '{' == c) {
+      if (1 == depth)
+        ++items;
+      ++depth;
+    } else if (')' == c || '}' == c) {
+      if (0 == --depth)
+        break;
+    } else if ('/' == c && p + 1 < End && '/' == p[1]) {
+      // brackets in comments don't count
+      while (p + 1 < End && '\n' != p[1])
+        ++p;
+    } else if ('/' == c && p + 1 < End && '*' == p[1]) {
+      for (p += 2; p + 1 < End && !('*' == p[0] && '/' == p[1]); ++p)
+        ;
+      ++p;
+    }
+  }
+  return items;
+}
@@ -33,6 +33,13 @@ class Tokenizer {
   public:
     Tokenizer(istream& fp, bool printTokens);
 
+    // Scan text already in memory, e.g. a MappedFile, in place.  Numbers
+    // are converted straight from the text, identifiers stay pointers
+    // into it until a Token is asked for, and the allocation-free calls
+    // below make no Token at all.
+    Tokenizer(const char* begin, const char* end, bool printTokens);
+    ~Tokenizer();
+
     // destructively read & return the next token, skipping over whitespace
     auto_ptr<Token> Get();
 
@@ -46,12 +53,26 @@ class Tokenizer {
     // Return whether it matches.
     bool CondRead(SYMBOL expected);
 
+    // Peek()->kind(), Read(expected) and Read(SCALAR)->value() without
+    // making Tokens, for the long lists of numbers in meshes
+    SYMBOL PeekKind();
+    void Skip(SYMBOL expected);
+    double ReadScalar();
+
+    // the number text in [begin, end) spells, also for MeshReader
+    static double ScanNumber(const char* begin, const char* end);
+
+    // Just after the '(' of a list: how many ( ) or { } groups it holds,
+    // found by a quick scan for brackets ahead of the tokens, to size the
+    // arrays it is read into.  Only a hint: 0 when not scanning in memory.
+    int CountListItems();
+
     // display the current source line onto the screen.
-    void PrintLine( ostream& out) const { buffer.PrintLine(out); }
+    void PrintLine( ostream& out) const;
 
     // return the column number/line number of the current token.
     int CurColumn() const { return TokenColumn; }
-    int CurLine() const { return buffer.CurLine(); }
+    int CurLine() const { return buffer ? buffer->CurLine() : LineNumber; }
 
     // Repeatedly scan tokens and throw them away.  Useful if this is the
     // last phase to be executed
@@ -67,7 +88,7 @@ protected:
 
     Token* SearchReserved(const string&) const; // Convert ident string into token
 
-    void GetCh() { CurrentCh = buffer.GetCh(); }
+    void GetCh() { CurrentCh = buffer->GetCh(); }
     bool CondReadCh(char expected);        // consume a character, if it matches
 
     void SkipWhiteSpace();        // skip spaces, tabs, newlines
@@ -77,10 +98,22 @@ protected:
     Token* GetIdent();            // scan identifier token
     Token* GetQuotedIdent();
 
+    // in-memory scanning
+    struct Lexeme {
+      SYMBOL kind;
+      double value;               // of a SCALAR
+      const char* text;           // of an IDENT, in the source
+      int length;
+    };
+    void ScanLexeme(Lexeme& lx);
+    void SkipMappedSpace();
+    Token* MakeToken(const Lexeme& lx) const;
+    void ThrowExpected(SYMBOL expected);
+
 
     // private data:
 
-    Buffer buffer;                // The file buffer
+    Buffer* buffer;               // The file buffer, NULL when in memory
     char CurrentCh;               // The current character in the current line
 
     Token* UnGetToken;            // The token that has been "ungot"
@@ -89,6 +122,13 @@ protected:
                                   // for generating error messages
 
     bool _printTokens;            // printing flag
+
+    const char* Pos;              // in memory: the next character,
+    const char* End;              // the end of the text,
+    const char* LineStart;        // the start of the current line
+    int LineNumber;
+    Lexeme Ahead;                 // a peeked token not made into a Token
+    bool HaveAhead;
 };
 
 #endif
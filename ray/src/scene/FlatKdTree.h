@@ -0,0 +1,464 @@
+#ifndef __FLATKDTREE_H__
+#define __FLATKDTREE_H__
+// Flattened KdTree for speeding up intersect
+// The recursive KdTree is only used to find the SAH partition. Its nodes
+// are then laid out depth-first in a single array, so traversal walks
+// contiguous memory instead of chasing child pointers.
+// To build the flat tree:
+//		kt = KdTree<T>(objs, 5);
+//		ft = FlatKdTree<T>(kt);
+// after which kt can be thrown away.  A tree laid out before, e.g. read
+// back from a compiled scene, is made from its nodes and primitives:
+//		ft = FlatKdTree<T>(nodes, nodeNum, depth, prims);
+
+#include <vector>
+#include <stdint.h>
+#include <cmath>
+#include <float.h>
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+
+#include "ray.h"
+#include "bbox.h"
+#include "KdTree.h"
+#include "RayPacket.h"
+
+#include "../vecmath/vec.h"
+
+using namespace std;
+
+// 32 bytes, so two nodes share one cache line.
+// The left child of an interior node is always the next node in the
+// array, so only the index of the right child is stored.
+struct FlatKdNode
+{
+	enum { LEAF = 1 };
+
+	float bmin[3];
+	float bmax[3];
+	uint32_t offset;	// interior: index of right child, leaf: first primitive
+	uint16_t count;		// number of primitives in a leaf
+	uint8_t axis;		// split axis of an interior node
+	uint8_t flags;
+
+	bool isLeaf() const { return (flags & LEAF) != 0; }
+};
+
+// traversal stack size; deeper trees fall back to a heap stack
+const int KD_STACK_SIZE = 64;
+
+// Traversal counters, summed over all render threads.  Each query counts
+// locally and adds to these once.  Every thread adds into a slot of its
+// own, padded so that no two slots share a cache line, and the slots are
+// only summed when the counts are read; beyond SLOT_NUM threads the slots
+// are shared, which the atomics keep correct.
+struct KdTraversalStats
+{
+	struct Counts {
+		long long rays;
+		long long nodes;		// nodes popped and not culled
+		long long boxTests;
+		long long primTests;
+	};
+
+	KdTraversalStats() { reset(); }
+
+	void reset() {
+		for (int i = 0; i < SLOT_NUM; ++i) {
+			slots[i].rays = 0;
+			slots[i].nodes = 0;
+			slots[i].boxTests = 0;
+			slots[i].primTests = 0;
+		}
+	}
+
+	// one query, by r rays at once if it was a packet
+	void add(long long n, long long b, long long p, long long r = 1) {
+		Slot& s = slots[slotIndex()];
+		s.rays.fetch_add(r, std::memory_order_relaxed);
+		s.nodes.fetch_add(n, std::memory_order_relaxed);
+		s.boxTests.fetch_add(b, std::memory_order_relaxed);
+		s.primTests.fetch_add(p, std::memory_order_relaxed);
+	}
+
+	void add(const KdTraversalStats& other) {
+		Counts c = other.sum();
+		add(c.nodes, c.boxTests, c.primTests, c.rays);
+	}
+
+	Counts sum() const {
+		Counts c = { 0, 0, 0, 0 };
+		for (int i = 0; i < SLOT_NUM; ++i) {
+			c.rays += slots[i].rays.load(std::memory_order_relaxed);
+			c.nodes += slots[i].nodes.load(std::memory_order_relaxed);
+			c.boxTests += slots[i].boxTests.load(std::memory_order_relaxed);
+			c.primTests += slots[i].primTests.load(std::memory_order_relaxed);
+		}
+		return c;
+	}
+
+	void print(const char* name) const {
+		Counts c = sum();
+		long long n = c.rays;
+		if (n == 0) return;
+		printf("%s: %lld rays, %.2f nodes/ray, %.2f box tests/ray, %.2f primitive tests/ray\n",
+			name, n, double(c.nodes)/n, double(c.boxTests)/n, double(c.primTests)/n);
+	}
+
+private:
+	enum { SLOT_NUM = 64 };
+
+	// 128 bytes apart, so two slots are never on one line however the
+	// stats happen to be aligned
+	struct Slot {
+		std::atomic<long long> rays;
+		std::atomic<long long> nodes;
+		std::atomic<long long> boxTests;
+		std::atomic<long long> primTests;
+		char pad[128 - 4 * sizeof(std::atomic<long long>)];
+	};
+
+	// the slot of the calling thread, handed out as threads first count
+	static int slotIndex() {
+		static std::atomic<int> next(0);
+		static thread_local int index = next.fetch_add(1, std::memory_order_relaxed) % SLOT_NUM;
+		return index;
+	}
+
+	Slot slots[SLOT_NUM];
+};
+
+
+// FlatKdTree
+//
+//
+
+template<class T>
+class FlatKdTree {
+
+	typedef std::vector<T*> ObjVec;
+
+public:
+	FlatKdTree(const KdTree<T>& tree);
+	// nodes as getNodes() gave them.  They are used in place if they are
+	// aligned, and must then outlive the tree; otherwise they are copied.
+	FlatKdTree(const FlatKdNode* nodes, int nodeNum, int maxDepth, const ObjVec& prims);
+
+	~FlatKdTree() {
+		delete [] nodeMemory;
+	}
+
+	bool intersect(ray& r, isect& i) const;
+	bool occluded(ray& r, double tMax) const;
+	// closest hits of the lanes of mask; returns the lanes that hit
+	int intersectPacket(RayPacket& pk, int mask, isect* hits) const;
+
+	int getDepth() const { return maxDepth; }
+	int getNodeNum() const { return nodeNum; }
+	int getPrimNum() const { return prims.size(); }
+	int getBytes() const { return nodeNum*sizeof(FlatKdNode) + prims.size()*sizeof(T*); }
+	const FlatKdNode* getNodes() const { return nodes; }
+	const ObjVec& getPrims() const { return prims; }
+
+	const KdTraversalStats& getStats() const { return stats; }
+	void resetStats() const { stats.reset(); }
+
+private:
+	FlatKdNode* nodes;			// cache-line aligned view into nodeMemory
+	unsigned char* nodeMemory;
+	int nodeNum;
+	int maxDepth;
+	ObjVec prims;				// leaf primitives, stored contiguously per leaf
+	mutable KdTraversalStats stats;
+
+	int countNodes(const KdTree<T>* tree) const;
+	int flatten(const KdTree<T>* tree, int& next, int depth);
+	bool intersectNode(const FlatKdNode& node, const ray& r,
+		double tLimit, double& tNear) const;
+};
+
+
+// round outwards so that the float box always contains the double one
+inline float roundDown(double v) {
+	float f = (float)v;
+	if (f > v) f = nextafterf(f, -FLT_MAX);
+	return f;
+}
+
+inline float roundUp(double v) {
+	float f = (float)v;
+	if (f < v) f = nextafterf(f, FLT_MAX);
+	return f;
+}
+
+
+template<class T>
+FlatKdTree<T>::FlatKdTree(const KdTree<T>& tree) {
+	nodeNum = countNodes(&tree);
+	// align the array to 64 bytes by hand, std::vector does not promise it
+	nodeMemory = new unsigned char[nodeNum*sizeof(FlatKdNode) + 63];
+	nodes = (FlatKdNode*)(((uintptr_t)nodeMemory + 63) & ~(uintptr_t)63);
+	maxDepth = 0;
+	int next = 0;
+	flatten(&tree, next, 1);
+}
+
+template<class T>
+FlatKdTree<T>::FlatKdTree(const FlatKdNode* from, int nodeNum, int maxDepth, const ObjVec& prims)
+	: nodeMemory(NULL), nodeNum(nodeNum), maxDepth(maxDepth), prims(prims) {
+	if (((uintptr_t)from & 63) == 0) {
+		// only read from here on
+		nodes = const_cast<FlatKdNode*>(from);
+	} else {
+		nodeMemory = new unsigned char[nodeNum*sizeof(FlatKdNode) + 63];
+		nodes = (FlatKdNode*)(((uintptr_t)nodeMemory + 63) & ~(uintptr_t)63);
+		memcpy(nodes, from, nodeNum*sizeof(FlatKdNode));
+	}
+}
+
+template<class T>
+int FlatKdTree<T>::countNodes(const KdTree<T>* tree) const {
+	if (!tree->leftChild)
+		return 1;
+	return 1 + countNodes(tree->leftChild) + countNodes(tree->rightChild);
+}
+
+// lay out the subtree rooted at tree depth-first, starting at nodes[next]
+template<class T>
+int FlatKdTree<T>::flatten(const KdTree<T>* tree, int& next, int depth) {
+	int index = next++;
+	FlatKdNode& node = nodes[index];
+	if (depth > maxDepth)
+		maxDepth = depth;
+
+	BoundingBox box = tree->treeBounds;
+	for (int axis=0;axis<3;++axis) {
+		if (box.isEmpty()) {
+			// nothing inside, make sure no ray can hit it
+			node.bmin[axis] = FLT_MAX;
+			node.bmax[axis] = -FLT_MAX;
+		} else {
+			node.bmin[axis] = roundDown(box.getMin()[axis]);
+			node.bmax[axis] = roundUp(box.getMax()[axis]);
+		}
+	}
+
+	if (!tree->leftChild) {
+		node.flags = FlatKdNode::LEAF;
+		node.axis = 0;
+		node.offset = prims.size();
+		node.count = tree->objects.size();
+		prims.insert(prims.end(), tree->objects.begin(), tree->objects.end());
+	} else {
+		node.flags = 0;
+		node.axis = tree->splitAxis;
+		node.count = 0;
+		flatten(tree->leftChild, next, depth+1);
+		node.offset = flatten(tree->rightChild, next, depth+1);
+	}
+	return index;
+}
+
+// same slab test as BoundingBox::intersect, on the float bounds of a node.
+// Boxes entered beyond tLimit are missed, and tNear is set to the entry t.
+template<class T>
+inline bool FlatKdTree<T>::intersectNode(const FlatKdNode& node, const ray& r,
+		double tLimit, double& tNear) const {
+	const float* corners[2] = { node.bmin, node.bmax };
+	double tMin = -1.0e308;
+	double tMax = 1.0e308;
+	for (int axis = 0; axis < 3; axis++) {
+		double t1 = (corners[r.sign[axis]][axis] - r.p[axis]) * r.invd[axis];
+		double t2 = (corners[1-r.sign[axis]][axis] - r.p[axis]) * r.invd[axis];
+		tMin = t1 > tMin ? t1 : tMin;
+		tMax = t2 < tMax ? t2 : tMax;
+	}
+	tNear = tMin;
+	// missed, behind the ray, or starting behind the closest hit
+	return tMin <= tMax && tMax >= RAY_EPSILON && tMin <= tLimit;
+}
+
+// Front-to-back traversal.  At an interior node both child boxes are
+// tested, the nearer child is visited first and the farther one is
+// pushed together with its entry t, so it can be dropped without another
+// box test once a closer hit has been found.
+template<class T>
+bool FlatKdTree<T>::intersect(ray& r, isect& i) const {
+	struct Entry { uint32_t node; double tNear; };
+	Entry localStack[KD_STACK_SIZE];
+	std::vector<Entry> bigStack;
+	Entry* stack = localStack;
+	if (maxDepth >= KD_STACK_SIZE) {
+		bigStack.resize(maxDepth+1);
+		stack = &bigStack[0];
+	}
+
+	bool have_one = false;
+	double tBest = 1.0e308;
+	long long nodeCount = 0, boxCount = 1, primCount = 0;
+
+	double tRoot;
+	int top = 0;
+	if (intersectNode(nodes[0], r, tBest, tRoot)) {
+		stack[top].node = 0;
+		stack[top].tNear = tRoot;
+		++top;
+	}
+	while (top > 0) {
+		--top;
+		if (stack[top].tNear > tBest)
+			continue;
+		uint32_t index = stack[top].node;
+
+		// descend towards the nearer child, pushing the farther one
+		while (true) {
+			const FlatKdNode& node = nodes[index];
+			++nodeCount;
+			if (node.isLeaf()) {
+				for (uint32_t j = node.offset; j < node.offset + node.count; ++j) {
+					isect cur;
+					++primCount;
+					if (prims[j]->intersect(r, cur)) {
+						if (!have_one || (cur.t < i.t)) {
+							i = cur;
+							tBest = cur.t;
+							have_one = true;
+						}
+					}
+				}
+				break;
+			}
+
+			// left child is next in the array
+			uint32_t left = index + 1;
+			uint32_t right = node.offset;
+			double tLeft, tRight;
+			bool hitLeft = intersectNode(nodes[left], r, tBest, tLeft);
+			bool hitRight = intersectNode(nodes[right], r, tBest, tRight);
+			boxCount += 2;
+			if (hitLeft && hitRight) {
+				if (tRight < tLeft) {
+					std::swap(left, right);
+					std::swap(tLeft, tRight);
+				}
+				stack[top].node = right;
+				stack[top].tNear = tRight;
+				++top;
+				index = left;
+			} else if (hitLeft) {
+				index = left;
+			} else if (hitRight) {
+				index = right;
+			} else {
+				break;
+			}
+		}
+	}
+
+	stats.add(nodeCount, boxCount, primCount);
+	if (!have_one) i.setT(1000.0);
+	return have_one;
+}
+
+// Any-hit traversal for shadow rays: no ordering, and done at the first
+// primitive hit before tMax.
+template<class T>
+bool FlatKdTree<T>::occluded(ray& r, double tMax) const {
+	uint32_t localStack[KD_STACK_SIZE];
+	std::vector<uint32_t> bigStack;
+	uint32_t* stack = localStack;
+	if (maxDepth >= KD_STACK_SIZE) {
+		bigStack.resize(maxDepth+1);
+		stack = &bigStack[0];
+	}
+
+	long long nodeCount = 0, boxCount = 1, primCount = 0;
+	bool hit = false;
+	double tNear;
+	int top = 0;
+	if (intersectNode(nodes[0], r, tMax, tNear))
+		stack[top++] = 0;
+	while (top > 0 && !hit) {
+		const FlatKdNode& node = nodes[stack[--top]];
+		++nodeCount;
+		if (node.isLeaf()) {
+			for (uint32_t j = node.offset; j < node.offset + node.count; ++j) {
+				++primCount;
+				if (prims[j]->occluded(r, tMax)) {
+					hit = true;
+					break;
+				}
+			}
+			continue;
+		}
+		uint32_t left = &node - nodes + 1;
+		boxCount += 2;
+		if (intersectNode(nodes[node.offset], r, tMax, tNear))
+			stack[top++] = node.offset;
+		if (intersectNode(nodes[left], r, tMax, tNear))
+			stack[top++] = left;
+	}
+
+	stats.add(nodeCount, boxCount, primCount);
+	return hit;
+}
+
+// Packet traversal: every stack entry carries the lanes still looking in
+// that subtree, and each node's box is tested for all of them at once
+// when it is popped, against their closest hits so far.  Lanes that miss
+// drop out of the subtree, so the packet splits as it goes down; the
+// whole subtree is skipped once no lane is left.  Children are visited
+// in the order the first active lane would want them.
+template<class T>
+int FlatKdTree<T>::intersectPacket(RayPacket& pk, int mask, isect* hits) const {
+	struct Entry { uint32_t node; int mask; };
+	Entry localStack[KD_STACK_SIZE];
+	std::vector<Entry> bigStack;
+	Entry* stack = localStack;
+	if (maxDepth >= KD_STACK_SIZE) {
+		bigStack.resize(maxDepth+1);
+		stack = &bigStack[0];
+	}
+
+	int found = 0;
+	long long nodeCount = 0, boxCount = 0, primCount = 0;
+	int top = 0;
+	stack[top].node = 0;
+	stack[top].mask = mask;
+	++top;
+	while (top > 0) {
+		--top;
+		const FlatKdNode& node = nodes[stack[top].node];
+		int active = packetTestBox(node, pk, stack[top].mask);
+		++boxCount;
+		if (!active)
+			continue;
+		++nodeCount;
+		if (node.isLeaf()) {
+			for (uint32_t j = node.offset; j < node.offset + node.count; ++j) {
+				++primCount;
+				found |= prims[j]->intersectPacket(pk, active, hits, found);
+			}
+			continue;
+		}
+
+		uint32_t left = &node - nodes + 1;
+		uint32_t right = node.offset;
+		int first = __builtin_ctz(active);
+		if (pk.fsign[node.axis][first])
+			std::swap(left, right);
+		stack[top].node = right;
+		stack[top].mask = active;
+		++top;
+		stack[top].node = left;
+		stack[top].mask = active;
+		++top;
+	}
+
+	stats.add(nodeCount, boxCount, primCount, __builtin_popcount(mask));
+	return found;
+}
+
+
+#endif // __FLATKDTREE_H__
@@ -0,0 +1,145 @@
+#ifndef __KDACCEL_H__
+#define __KDACCEL_H__
+// The traversal form of a KdTree: either the binary FlatKdTree or a 4 or
+// 8 wide WideKdTree, picked at run time.  8-wide trees need AVX and fall
+// back to 4-wide without it; 4-wide trees run the scalar node test on CPUs
+// without SSE.
+//		kt = KdTree<T>(objs, 5);
+//		acc = KdAccel<T>(kt, width);
+// A tree can also be saved as its width, depth, node array and primitives
+// and made again from them without building it:
+//		acc = KdAccel<T>(width, nodes, nodeNum, depth, prims);
+
+#include "KdTree.h"
+#include "FlatKdTree.h"
+#include "WideKdTree.h"
+
+template<class T>
+class KdAccel {
+
+public:
+	KdAccel(const KdTree<T>& tree, int width);
+	// nodes holds nodeNum nodes of the type getWidth() says, as getNodes()
+	// gave them; see FlatKdTree for when they must outlive the tree
+	KdAccel(int width, const void* nodes, int nodeNum, int maxDepth, const std::vector<T*>& prims);
+
+	~KdAccel() {
+		delete flat;
+		delete wide4;
+		delete wide8;
+	}
+
+	bool intersect(ray& r, isect& i) const {
+		if (wide8) return wide8->intersect(r, i);
+		if (wide4) return wide4->intersect(r, i);
+		return flat->intersect(r, i);
+	}
+
+	// packets run on the binary tree; wide trees trace the lanes one by one
+	int intersectPacket(RayPacket& pk, int mask, isect* hits) const {
+		if (flat) return flat->intersectPacket(pk, mask, hits);
+		int found = 0;
+		for (int k = 0; k < pk.size; ++k) {
+			if (!(mask & (1 << k))) continue;
+			ray r = pk.get(k);
+			if (intersect(r, hits[k]))
+				found |= 1 << k;
+		}
+		return found;
+	}
+
+	bool occluded(ray& r, double tMax) const {
+		if (wide8) return wide8->occluded(r, tMax);
+		if (wide4) return wide4->occluded(r, tMax);
+		return flat->occluded(r, tMax);
+	}
+
+	int getWidth() const { return wide8 ? 8 : wide4 ? 4 : 2; }
+	const char* getKernel() const {
+		if (wide8) return wide8->getKernel();
+		if (wide4) return wide4->getKernel();
+		return "scalar";
+	}
+
+	int getNodeNum() const {
+		if (wide8) return wide8->getNodeNum();
+		if (wide4) return wide4->getNodeNum();
+		return flat->getNodeNum();
+	}
+	int getDepth() const {
+		if (wide8) return wide8->getDepth();
+		if (wide4) return wide4->getDepth();
+		return flat->getDepth();
+	}
+	const void* getNodes() const {
+		if (wide8) return wide8->getNodes();
+		if (wide4) return wide4->getNodes();
+		return flat->getNodes();
+	}
+	static size_t getNodeSize(int width) {
+		if (width == 8) return sizeof(WideKdNode<8>);
+		if (width == 4) return sizeof(WideKdNode<4>);
+		return sizeof(FlatKdNode);
+	}
+	const std::vector<T*>& getPrims() const {
+		if (wide8) return wide8->getPrims();
+		if (wide4) return wide4->getPrims();
+		return flat->getPrims();
+	}
+	int getPrimNum() const {
+		if (wide8) return wide8->getPrimNum();
+		if (wide4) return wide4->getPrimNum();
+		return flat->getPrimNum();
+	}
+	int getBytes() const {
+		if (wide8) return wide8->getBytes();
+		if (wide4) return wide4->getBytes();
+		return flat->getBytes();
+	}
+
+	const KdTraversalStats& getStats() const {
+		if (wide8) return wide8->getStats();
+		if (wide4) return wide4->getStats();
+		return flat->getStats();
+	}
+	void resetStats() const {
+		if (wide8) wide8->resetStats();
+		if (wide4) wide4->resetStats();
+		if (flat) flat->resetStats();
+	}
+
+private:
+	FlatKdTree<T>* flat;
+	WideKdTree<T, 4>* wide4;
+	WideKdTree<T, 8>* wide8;
+};
+
+
+template<class T>
+KdAccel<T>::KdAccel(const KdTree<T>& tree, int width) {
+	flat = NULL;
+	wide4 = NULL;
+	wide8 = NULL;
+	if (width >= 8 && WideKernel<8>::hasSimd())
+		wide8 = new WideKdTree<T, 8>(tree);
+	else if (width >= 4)
+		wide4 = new WideKdTree<T, 4>(tree);
+	else
+		flat = new FlatKdTree<T>(tree);
+}
+
+template<class T>
+KdAccel<T>::KdAccel(int width, const void* nodes, int nodeNum, int maxDepth, const std::vector<T*>& prims) {
+	flat = NULL;
+	wide4 = NULL;
+	wide8 = NULL;
+	if (width == 8)
+		wide8 = new WideKdTree<T, 8>((const WideKdNode<8>*)nodes, nodeNum, maxDepth, prims);
+	else if (width == 4)
+		wide4 = new WideKdTree<T, 4>((const WideKdNode<4>*)nodes, nodeNum, maxDepth, prims);
+	else
+		flat = new FlatKdTree<T>((const FlatKdNode*)nodes, nodeNum, maxDepth, prims);
+}
+
+
+#endif // __KDACCEL_H__
@@ -2,20 +2,23 @@
 #define __KDTREE_H__
 // KdTree for speeding up intersect
 // To build kdtree:
-//		kt = KdTree(); 
-//		kt.add(obj);
-// 		kt.split();
+//		kt = KdTree(objs, maxObjNum, method);
+// where method picks the partitioning:
+//		KD_BUILD_SORTED: sort along every axis and sweep all split positions
+//		KD_BUILD_BINNED: bucket centroids into KD_NUM_BINS bins per axis
 
 #include <vector>
 #include <algorithm>
 #include <map>
 #include <string>
 #include <memory>
+#include <stdio.h>
 
 #include "ray.h"
 #include "material.h"
 #include "camera.h"
 #include "bbox.h"
+#include "../TaskPool.h"
 
 // #include "../SceneObjects/trimesh.h"
 
@@ -25,6 +28,56 @@
 using namespace std;
 
 
+enum KdBuildMethod {
+	KD_BUILD_SORTED = 0,
+	KD_BUILD_BINNED = 1
+};
+
+// number of centroid buckets per axis in the binned builder
+const int KD_NUM_BINS = 32;
+
+// With a TaskPool, nodes with at least KD_PARALLEL_MIN objects build their
+// children as separate tasks, and the per-object loops of a node are cut
+// into chunks of KD_CHUNK_SIZE objects that run in parallel.  Chunks only
+// depend on the object count, and their results are combined in chunk
+// order, so the tree is the same for any number of threads.
+const int KD_PARALLEL_MIN = 1024;
+const int KD_CHUNK_SIZE = 4096;
+
+// relative cost of a node traversal and an object intersection,
+// used when reporting the SAH cost of a built tree
+const double KD_COST_TRAVERSAL = 1.0;
+const double KD_COST_INTERSECT = 1.0;
+
+// leaf sizes 0..KD_HIST_SIZE-2 have their own bucket, the last one
+// collects everything larger
+const int KD_HIST_SIZE = 10;
+
+// SAH cost, depth and leaf-size histogram of a built tree
+struct KdTreeQuality
+{
+	double sahCost;
+	int depth;
+	int interiorNum;
+	int leafNum;
+	int leafHist[KD_HIST_SIZE];
+
+	KdTreeQuality() : sahCost(0.0), depth(0), interiorNum(0), leafNum(0) {
+		for (int i=0;i<KD_HIST_SIZE;++i) leafHist[i] = 0;
+	}
+
+	void print() const {
+		printf("sah cost: %f, depth: %d, %d interior nodes, %d leaves\n",
+			sahCost, depth, interiorNum, leafNum);
+		printf("leaf sizes:");
+		for (int i=0;i<KD_HIST_SIZE;++i) {
+			if (i < KD_HIST_SIZE-1) printf(" [%d]=%d", i, leafHist[i]);
+			else printf(" [%d+]=%d", i, leafHist[i]);
+		}
+		printf("\n");
+	}
+};
+
 
 struct Interface
 {
@@ -43,6 +96,15 @@ struct BBoxComparator
     }
 };
 
+// an object with its bounding box, got once per node by the sorted
+// build, since getBoundingBox() of a trimesh face builds the box anew
+template <typename T>
+struct BoxedObject
+{
+	T* obj;
+	BoundingBox box;
+};
+
 template <typename T> 
 struct TComparator 
 { 
@@ -52,11 +114,11 @@ struct TComparator
 		axis_ = index;
 		by_ = by;
 	}
-	bool operator()( const T* lx, const T* rx) const {
-    	Vec3d minPoint1 = lx->getBoundingBox().getMin();
-    	Vec3d minPoint2 = rx->getBoundingBox().getMin();
-    	Vec3d maxPoint1 = lx->getBoundingBox().getMax();
-    	Vec3d maxPoint2 = rx->getBoundingBox().getMax();
+	bool operator()( const BoxedObject<T>& lx, const BoxedObject<T>& rx) const {
+    	const Vec3d& minPoint1 = lx.box.getMin();
+    	const Vec3d& minPoint2 = rx.box.getMin();
+    	const Vec3d& maxPoint1 = lx.box.getMax();
+    	const Vec3d& maxPoint2 = rx.box.getMax();
     	if (by_ == 0) {
     		return minPoint1[axis_] < minPoint2[axis_];
     	} else if (by_ == 1) {
@@ -76,12 +138,13 @@ template<class T>
 class KdTree {
 
 	typedef std::vector<T*> ObjVec;
+	typedef std::vector<BoxedObject<T> > BoxedVec;
 	typedef std::vector<BoundingBox> BBoxVec;
 	typedef typename std::vector<T*>::const_iterator giter;
 	typedef typename std::vector<BoundingBox>::const_iterator biter;
 
 public:
-	KdTree(ObjVec objs, int maxObjNum);
+	KdTree(const ObjVec& objs, int maxObjNum, int buildMethod = KD_BUILD_BINNED, TaskPool* pool = NULL);
 
 	~KdTree() {
 		if (leftChild)
@@ -96,8 +159,12 @@ public:
   	int getDepth() const;
   	void printObjects(ObjVec objs, int axis);
   	const BoundingBox& bounds() const { return treeBounds; }
+  	KdTreeQuality getQuality() const;
 
 private:
+	template<class U> friend class FlatKdTree;
+	template<class U, int V> friend class WideKdTree;
+
 	KdTree<T>* leftChild;
 	KdTree<T>* rightChild;
   	ObjVec objects;
@@ -105,13 +172,23 @@ private:
   	int splitAxis;
 
   	int maxObjNum;
+  	int buildMethod;
+  	TaskPool* pool;
+
+  	// children reuse the bounding boxes computed at the root
+  	KdTree(const ObjVec& objs, int maxObjNum, int buildMethod, TaskPool* pool, bool computeBounds);
+  	void build(const ObjVec& objs, bool computeBounds);
+  	void buildChildren(const ObjVec& leftObjs, const ObjVec& rightObjs);
+  	void forEachChunk(int n, const std::function<void(int)>& fn);
 
   	void add( T* obj );
 
   	void splitByAF();
-  	void getMinAF(const ObjVec sorted_objs, double& minAF, int& minI);
+  	void getMinAF(const BoxedVec& sorted_objs, double& minAF, int& minI);
 
-  	void splitIfTrimesh();
+  	void splitBinned();
+
+  	void getQuality(KdTreeQuality& q, double rootArea, int depth) const;
 };
 
 
@@ -119,11 +196,36 @@ private:
 
 
 template<class T>
-KdTree<T>::KdTree(ObjVec objs, int maxObjNum) {
+KdTree<T>::KdTree(const ObjVec& objs, int maxObjNum, int buildMethod, TaskPool* pool) {
+	this->maxObjNum = maxObjNum;
+	this->buildMethod = buildMethod;
+	this->pool = pool;
+	build(objs, true);
+}
+
+template<class T>
+KdTree<T>::KdTree(const ObjVec& objs, int maxObjNum, int buildMethod, TaskPool* pool, bool computeBounds) {
+	this->maxObjNum = maxObjNum;
+	this->buildMethod = buildMethod;
+	this->pool = pool;
+	build(objs, computeBounds);
+}
+
+template<class T>
+void KdTree<T>::build(const ObjVec& objs, bool computeBounds) {
 	// property initilization
 	leftChild = NULL;
 	rightChild = NULL;
-	this->maxObjNum = maxObjNum;
+	splitAxis = 0;
+	if (computeBounds) {
+		int n = objs.size();
+		forEachChunk(n, [&](int c) {
+			int end = std::min(n, (c+1)*KD_CHUNK_SIZE);
+			for (int j=c*KD_CHUNK_SIZE;j<end;++j)
+				objs[j]->ComputeBoundingBox();
+		});
+	}
+	objects.reserve(objs.size());
 	for(giter j=objs.begin(); j!=objs.end(); ++j) {
 		add(*j);
 	}
@@ -134,11 +236,42 @@ KdTree<T>::KdTree(ObjVec objs, int maxObjNum) {
 
 	// check whether to split
 	if (objs.size()>=maxObjNum) {
-		splitByAF();
+		if (buildMethod == KD_BUILD_BINNED)
+			splitBinned();
+		else
+			splitByAF();
 	} 
-	// if not split, check if there is any trimesh
-	else {
-		splitIfTrimesh();
+
+	// only leaves keep their objects
+	if (leftChild)
+		ObjVec().swap(objects);
+}
+
+// build both subtrees, the right one as a task if the node is big enough
+template<class T>
+void KdTree<T>::buildChildren(const ObjVec& leftObjs, const ObjVec& rightObjs) {
+	if (pool && leftObjs.size() + rightObjs.size() >= KD_PARALLEL_MIN) {
+		TaskGroup group;
+		pool->spawn(group, [&]() {
+			rightChild = new KdTree(rightObjs, maxObjNum, buildMethod, pool, false);
+		});
+		leftChild = new KdTree(leftObjs, maxObjNum, buildMethod, pool, false);
+		pool->wait(group);
+	} else {
+		leftChild = new KdTree(leftObjs, maxObjNum, buildMethod, pool, false);
+		rightChild = new KdTree(rightObjs, maxObjNum, buildMethod, pool, false);
+	}
+}
+
+// run fn on each KD_CHUNK_SIZE slice of n objects, in parallel if possible
+template<class T>
+void KdTree<T>::forEachChunk(int n, const std::function<void(int)>& fn) {
+	int chunkNum = (n + KD_CHUNK_SIZE - 1) / KD_CHUNK_SIZE;
+	if (pool && chunkNum > 1) {
+		pool->parallelFor(chunkNum, fn);
+	} else {
+		for (int c=0;c<chunkNum;++c)
+			fn(c);
 	}
 }
 
@@ -213,7 +346,6 @@ void KdTree<T>::printObjects(ObjVec objs, int axis) {
 
 template<class T>
 void KdTree<T>::add( T* obj ) {
-	obj->ComputeBoundingBox();
 	treeBounds.merge(obj->getBoundingBox());
 	objects.push_back(obj);
 }
@@ -230,15 +362,36 @@ void KdTree<T>::splitByAF() {
 	int minAxis = 0;
 	int minBy = 0;
 	// evaluate minI, minAxis and minF over all axises.
+	// Each of the six sorts works on its own copy, so they can run as tasks;
+	// the results are still compared in the same order.
+	double cAF[6];
+	int cI[6];
+	int n = objects.size();
+	BoxedVec boxed(n);
+	forEachChunk(n, [&](int c) {
+		int end = std::min(n, (c+1)*KD_CHUNK_SIZE);
+		for (int i=c*KD_CHUNK_SIZE;i<end;++i) {
+			boxed[i].obj = objects[i];
+			boxed[i].box = objects[i]->getBoundingBox();
+		}
+	});
+	std::function<void(int)> sweep = [&](int k) {
+		BoxedVec sorted(boxed);
+		std::sort(sorted.begin(), sorted.end(),TComparator<T>(k%3, k/3));
+		getMinAF(sorted, cAF[k], cI[k]);
+	};
+	if (pool && objects.size() >= KD_PARALLEL_MIN) {
+		pool->parallelFor(6, sweep);
+	} else {
+		for (int k=0;k<6;++k)
+			sweep(k);
+	}
 	for (int by=0; by<2;++by) {
 		for (int axis=0;axis<3;++axis) {
-			double cAF;
-			int cI;
-			std::sort(objects.begin(), objects.end(),TComparator<T>(axis, by));
-			getMinAF(objects, cAF, cI);
-			if (cAF < minAF) {
-				minAF = cAF;
-				minI = cI;
+			int k = by*3 + axis;
+			if (cAF[k] < minAF) {
+				minAF = cAF[k];
+				minI = cI[k];
 				minAxis = axis;
 				minBy = by;
 			}
@@ -249,9 +402,9 @@ void KdTree<T>::splitByAF() {
 	// pass objects to leftObj and rightObj by minI and minAxis
 	ObjVec leftObjs;
 	ObjVec rightObjs;
-	std::sort(objects.begin(), objects.end(),TComparator<T>(minAxis, minBy));
-	for (int i=0;i<objects.size();++i) {
-		T* obj = objects.at(i);
+	std::sort(boxed.begin(), boxed.end(),TComparator<T>(minAxis, minBy));
+	for (int i=0;i<n;++i) {
+		T* obj = boxed[i].obj;
 		if (i<=minI)
 			leftObjs.push_back(obj);
 		else
@@ -265,24 +418,21 @@ void KdTree<T>::splitByAF() {
 	// cout << "	right " ;
 	// cout << rightObjs.size() <<endl;
 	// printObjects(rightObjs, minAxis);
-	leftChild = new KdTree(leftObjs, maxObjNum);
-	rightChild = new KdTree(rightObjs, maxObjNum);
+	buildChildren(leftObjs, rightObjs);
 }
 
 template<class T>
-void KdTree<T>::getMinAF(const ObjVec sorted_objs, double& minAF, int& minI) {
+void KdTree<T>::getMinAF(const BoxedVec& sorted_objs, double& minAF, int& minI) {
 	// calculate sA & sB
 	int n = sorted_objs.size();
-	double* sA_list = new double[n];
-	double* sB_list = new double[n];
+	std::vector<double> sA_list(n);
+	std::vector<double> sB_list(n);
 	BoundingBox leftBounds, rightBounds;		// start merging from left and right, respectively
 	for(int i=0;i<n;++i) {
-		BoundingBox box1 = sorted_objs.at(i)->getBoundingBox();
-		leftBounds.merge(box1);
+		leftBounds.merge(sorted_objs[i].box);
 		sA_list[i] = leftBounds.area();
 
-		BoundingBox box2 = sorted_objs.at(n-1-i)->getBoundingBox();
-		rightBounds.merge(box2);
+		rightBounds.merge(sorted_objs[n-1-i].box);
 		sB_list[i] = rightBounds.area();
 	} 
 
@@ -303,34 +453,172 @@ void KdTree<T>::getMinAF(const ObjVec sorted_objs, double& minAF, int& minI) {
 }
 
 
-// when maximal number is not reached, 
-//	check if there is a trimesh before stop
+// method 3: binned area function
+//	bucket the object centroids into KD_NUM_BINS bins along each axis and
+//	only evaluate splits between bins, O(n) per node instead of sorting
 //
+
 template<class T>
-void KdTree<T>::splitIfTrimesh() {
-	// check if there is a trimesh
+void KdTree<T>::splitBinned() {
+	int n = objects.size();
+	int chunkNum = (n + KD_CHUNK_SIZE - 1) / KD_CHUNK_SIZE;
+
+	// bounds of the object centroids, per chunk and then combined
+	std::vector<Vec3d> centroids(n);
+	std::vector<Vec3d> chunkMin(chunkNum), chunkMax(chunkNum);
+	forEachChunk(n, [&](int c) {
+		int begin = c*KD_CHUNK_SIZE;
+		int end = std::min(n, begin + KD_CHUNK_SIZE);
+		for (int i=begin;i<end;++i) {
+			const BoundingBox& box = objects[i]->getBoundingBox();
+			centroids[i] = (box.getMin() + box.getMax()) * 0.5;
+			if (i == begin) {
+				chunkMin[c] = centroids[i];
+				chunkMax[c] = centroids[i];
+			} else {
+				chunkMin[c] = minimum(chunkMin[c], centroids[i]);
+				chunkMax[c] = maximum(chunkMax[c], centroids[i]);
+			}
+		}
+	});
+	Vec3d cmin = chunkMin[0], cmax = chunkMax[0];
+	for (int c=1;c<chunkNum;++c) {
+		cmin = minimum(cmin, chunkMin[c]);
+		cmax = maximum(cmax, chunkMax[c]);
+	}
+
+	// bin all three axes in one pass over the objects
+	struct Bins {
+		int counts[3][KD_NUM_BINS];
+		BoundingBox bounds[3][KD_NUM_BINS];
+	};
+	std::vector<Bins> chunkBins(chunkNum);
+	double scale[3];
+	for (int axis=0;axis<3;++axis) {
+		double extent = cmax[axis] - cmin[axis];
+		scale[axis] = extent > 0.0 ? KD_NUM_BINS / extent : 0.0;
+	}
+	forEachChunk(n, [&](int c) {
+		Bins& bins = chunkBins[c];
+		for (int axis=0;axis<3;++axis)
+			for (int b=0;b<KD_NUM_BINS;++b)
+				bins.counts[axis][b] = 0;
+		int end = std::min(n, (c+1)*KD_CHUNK_SIZE);
+		for (int i=c*KD_CHUNK_SIZE;i<end;++i) {
+			const BoundingBox& box = objects[i]->getBoundingBox();
+			for (int axis=0;axis<3;++axis) {
+				if (scale[axis] == 0.0) continue;
+				int b = (int)((centroids[i][axis] - cmin[axis]) * scale[axis]);
+				if (b >= KD_NUM_BINS) b = KD_NUM_BINS-1;
+				bins.counts[axis][b]++;
+				bins.bounds[axis][b].merge(box);
+			}
+		}
+	});
+
+	double minAF = 1.0e308;
+	int minAxis = -1;
+	int minBin = 0;
+	for (int axis=0;axis<3;++axis) {
+		if (scale[axis] == 0.0) continue;
+
+		int counts[KD_NUM_BINS] = {0};
+		BoundingBox bins[KD_NUM_BINS];
+		for (int c=0;c<chunkNum;++c) {
+			for (int b=0;b<KD_NUM_BINS;++b) {
+				counts[b] += chunkBins[c].counts[axis][b];
+				bins[b].merge(chunkBins[c].bounds[axis][b]);
+			}
+		}
+
+		// sweep from the right, then evaluate f = sA*nA+sB*nB from the left
+		double sB_list[KD_NUM_BINS];
+		int nB_list[KD_NUM_BINS];
+		BoundingBox rightBounds;
+		int nB = 0;
+		for (int b=KD_NUM_BINS-1;b>0;--b) {
+			rightBounds.merge(bins[b]);
+			nB += counts[b];
+			sB_list[b] = rightBounds.area();
+			nB_list[b] = nB;
+		}
+		BoundingBox leftBounds;
+		int nA = 0;
+		for (int b=1;b<KD_NUM_BINS;++b) {
+			leftBounds.merge(bins[b-1]);
+			nA += counts[b-1];
+			if (nA == 0 || nB_list[b] == 0) continue;
+			double f = leftBounds.area()*nA + sB_list[b]*nB_list[b];
+			if (f < minAF) {
+				minAF = f;
+				minAxis = axis;
+				minBin = b;
+			}
+		}
+	}
+
 	ObjVec leftObjs;
 	ObjVec rightObjs;
-	T* trimesh = NULL;
-	for (int i=0;i<objects.size();++i) {
-		T* obj = objects.at(i);
-		if (obj->ifTrimesh() && !trimesh) 
-			trimesh = obj;
-		else 
-			leftObjs.push_back(obj);
-	}
-	// split the tree if there is a trimesh
-	if (trimesh) {
-		// construct child tree
-		// cout << "split because of trimesh\n";
-		// cout << "trimesh size: " << trimesh->getFaces().size() <<endl;
-		leftChild = new KdTree(leftObjs, maxObjNum);
-		// rightObjs.push_back(trimesh->getFaces());
-		// rightObjs.insert(rightObjs.end(), trimesh->getFaces().begin(), trimesh->getFaces().end());
-		// // rightObjs.push_back(trimesh->faces.at(0));
-		rightChild = new KdTree(trimesh->getFaces(), maxObjNum);
+	if (minAxis < 0) {
+		// all centroids coincide, just halve the list
+		for (int i=0;i<n;++i) {
+			if (i < n/2)
+				leftObjs.push_back(objects[i]);
+			else
+				rightObjs.push_back(objects[i]);
+		}
+	} else {
+		// partition each chunk, then append the chunks in order
+		splitAxis = minAxis;
+		std::vector<ObjVec> chunkLeft(chunkNum), chunkRight(chunkNum);
+		forEachChunk(n, [&](int c) {
+			int end = std::min(n, (c+1)*KD_CHUNK_SIZE);
+			for (int i=c*KD_CHUNK_SIZE;i<end;++i) {
+				int b = (int)((centroids[i][minAxis] - cmin[minAxis]) * scale[minAxis]);
+				if (b >= KD_NUM_BINS) b = KD_NUM_BINS-1;
+				if (b < minBin)
+					chunkLeft[c].push_back(objects[i]);
+				else
+					chunkRight[c].push_back(objects[i]);
+			}
+		});
+		for (int c=0;c<chunkNum;++c) {
+			leftObjs.insert(leftObjs.end(), chunkLeft[c].begin(), chunkLeft[c].end());
+			rightObjs.insert(rightObjs.end(), chunkRight[c].begin(), chunkRight[c].end());
+		}
 	}
+	buildChildren(leftObjs, rightObjs);
+}
 
+
+// SAH cost of the whole tree relative to its root box, plus its shape
+//
+template<class T>
+KdTreeQuality KdTree<T>::getQuality() const {
+	KdTreeQuality q;
+	BoundingBox box = treeBounds;
+	double rootArea = box.area();
+	getQuality(q, rootArea > 0.0 ? rootArea : 1.0, 1);
+	return q;
+}
+
+template<class T>
+void KdTree<T>::getQuality(KdTreeQuality& q, double rootArea, int depth) const {
+	BoundingBox box = treeBounds;
+	double p = box.area() / rootArea;
+	if (depth > q.depth)
+		q.depth = depth;
+	if (leftChild) {
+		q.interiorNum++;
+		q.sahCost += p * KD_COST_TRAVERSAL;
+		leftChild->getQuality(q, rootArea, depth+1);
+		rightChild->getQuality(q, rootArea, depth+1);
+	} else {
+		int n = objects.size();
+		q.leafNum++;
+		q.leafHist[min(n, KD_HIST_SIZE-1)]++;
+		q.sahCost += p * n * KD_COST_INTERSECT;
+	}
 }
 
 
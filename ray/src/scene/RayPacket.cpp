@@ -0,0 +1,340 @@
+// Packet kernels: the box test of FlatKdTree nodes and the triangle test
+// of TrimeshFace, for up to 8 rays at once.
+//
+// Box tests run on floats, 8 lanes with AVX or 4 with SSE.  Triangle tests
+// run on doubles, 4 lanes with AVX or 2 with SSE2, and copy the scalar
+// code operation by operation: multiplying by the sign of the determinant
+// becomes flipping the sign bit, and every "return false" becomes a mask
+// test that is also true for NaN, as the scalar comparisons are.  As in
+// WideKdTree.cpp the AVX kernels are only called after asking the CPU.
+
+#include "RayPacket.h"
+#include "WideKdTree.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PACKET_X86 1
+#include <immintrin.h>
+#endif
+
+void RayPacket::set(int k, const ray& r)
+{
+	for (int axis = 0; axis < 3; ++axis) {
+		p[axis][k] = r.p[axis];
+		d[axis][k] = r.d[axis];
+		fp[axis][k] = (float)r.p[axis];
+		finvd[axis][k] = (float)r.invd[axis];
+		double err = fabs(r.p[axis] - (double)fp[axis][k]);
+		fpad[axis][k] = err == 0.0 ? 0.0f : roundUp(2.0 * err * fabs(r.invd[axis]));
+		fsign[axis][k] = r.sign[axis] ? 0xffffffff : 0;
+	}
+	tLimit[k] = FLT_MAX;
+}
+
+void RayPacket::setBest(int k, double t)
+{
+	tLimit[k] = roundUp(t);
+}
+
+
+// scalar kernels, the reference for the SIMD ones
+//
+
+static int testBoxScalar(const FlatKdNode& node, const RayPacket& pk, int mask)
+{
+	int hit = 0;
+	for (int k = 0; k < pk.size; ++k) {
+		if (!(mask & (1 << k))) continue;
+		float tMin = -FLT_MAX;
+		float tMax = FLT_MAX;
+		for (int axis = 0; axis < 3; ++axis) {
+			float lo = pk.fsign[axis][k] ? node.bmax[axis] : node.bmin[axis];
+			float hi = pk.fsign[axis][k] ? node.bmin[axis] : node.bmax[axis];
+			float t1 = (lo - pk.fp[axis][k]) * pk.finvd[axis][k] - pk.fpad[axis][k];
+			float t2 = (hi - pk.fp[axis][k]) * pk.finvd[axis][k] + pk.fpad[axis][k];
+			// NaN from a parallel axis leaves the range alone
+			tMin = t1 > tMin ? t1 : tMin;
+			tMax = t2 < tMax ? t2 : tMax;
+		}
+		tMin -= fabsf(tMin)*WIDE_ULPS;
+		tMax += fabsf(tMax)*WIDE_ULPS;
+		if (tMin <= tMax && tMax >= (float)RAY_EPSILON && tMin <= pk.tLimit[k])
+			hit |= 1 << k;
+	}
+	return hit;
+}
+
+static int hitTriangleScalar(const Vec3d& A, const Vec3d& edge1, const Vec3d& edge2,
+	const RayPacket& pk, int mask, double* t, double* beta, double* gamma)
+{
+	int hit = 0;
+	for (int k = 0; k < pk.size; ++k) {
+		if (!(mask & (1 << k))) continue;
+		Vec3d dir(pk.d[0][k], pk.d[1][k], pk.d[2][k]);
+		Vec3d org(pk.p[0][k], pk.p[1][k], pk.p[2][k]);
+
+		Vec3d pvec = dir ^ edge2;
+		double det = edge1 * pvec;
+		if (det == 0.0)
+			continue;
+		double sign = det > 0.0 ? 1.0 : -1.0;
+		det *= sign;
+
+		Vec3d tvec = org - A;
+		double u = sign * (tvec * pvec);
+		if (u < 0.0 || u > det)
+			continue;
+
+		Vec3d qvec = tvec ^ edge1;
+		double v = sign * (dir * qvec);
+		if (v < 0.0 || u + v > det)
+			continue;
+
+		double tt = sign * (edge2 * qvec);
+		if (tt < RAY_EPSILON * det)
+			continue;
+
+		double invDet = 1.0 / det;
+		t[k] = tt * invDet;
+		beta[k] = u * invDet;
+		gamma[k] = v * invDet;
+		hit |= 1 << k;
+	}
+	return hit;
+}
+
+#ifdef PACKET_X86
+
+__attribute__((target("sse2")))
+static int testBoxSSE(const FlatKdNode& node, const RayPacket& pk, int mask)
+{
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	const __m128 ulps = _mm_set1_ps(WIDE_ULPS);
+	int hit = 0;
+	for (int o = 0; o < pk.size; o += 4) {
+		if (!((mask >> o) & 0xf)) continue;
+		__m128 tMin = _mm_set1_ps(-FLT_MAX);
+		__m128 tMax = _mm_set1_ps(FLT_MAX);
+		for (int axis = 0; axis < 3; ++axis) {
+			__m128 bmin = _mm_set1_ps(node.bmin[axis]);
+			__m128 bmax = _mm_set1_ps(node.bmax[axis]);
+			__m128 s = _mm_castsi128_ps(_mm_load_si128((const __m128i*)&pk.fsign[axis][o]));
+			__m128 lo = _mm_or_ps(_mm_and_ps(s, bmax), _mm_andnot_ps(s, bmin));
+			__m128 hi = _mm_or_ps(_mm_and_ps(s, bmin), _mm_andnot_ps(s, bmax));
+			__m128 p = _mm_load_ps(&pk.fp[axis][o]);
+			__m128 invd = _mm_load_ps(&pk.finvd[axis][o]);
+			__m128 pad = _mm_load_ps(&pk.fpad[axis][o]);
+			__m128 t1 = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(lo, p), invd), pad);
+			__m128 t2 = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(hi, p), invd), pad);
+			tMin = _mm_max_ps(t1, tMin);
+			tMax = _mm_min_ps(t2, tMax);
+		}
+		tMin = _mm_sub_ps(tMin, _mm_mul_ps(_mm_andnot_ps(signMask, tMin), ulps));
+		tMax = _mm_add_ps(tMax, _mm_mul_ps(_mm_andnot_ps(signMask, tMax), ulps));
+		__m128 h = _mm_and_ps(_mm_cmple_ps(tMin, tMax),
+			_mm_and_ps(_mm_cmpge_ps(tMax, _mm_set1_ps((float)RAY_EPSILON)),
+				_mm_cmple_ps(tMin, _mm_load_ps(&pk.tLimit[o]))));
+		hit |= _mm_movemask_ps(h) << o;
+	}
+	return hit & mask;
+}
+
+__attribute__((target("avx")))
+static int testBoxAVX(const FlatKdNode& node, const RayPacket& pk, int mask)
+{
+	if (pk.size < 8)
+		return testBoxSSE(node, pk, mask);
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+	const __m256 ulps = _mm256_set1_ps(WIDE_ULPS);
+	__m256 tMin = _mm256_set1_ps(-FLT_MAX);
+	__m256 tMax = _mm256_set1_ps(FLT_MAX);
+	for (int axis = 0; axis < 3; ++axis) {
+		__m256 bmin = _mm256_set1_ps(node.bmin[axis]);
+		__m256 bmax = _mm256_set1_ps(node.bmax[axis]);
+		__m256 s = _mm256_castsi256_ps(_mm256_load_si256((const __m256i*)pk.fsign[axis]));
+		__m256 lo = _mm256_blendv_ps(bmin, bmax, s);
+		__m256 hi = _mm256_blendv_ps(bmax, bmin, s);
+		__m256 p = _mm256_load_ps(pk.fp[axis]);
+		__m256 invd = _mm256_load_ps(pk.finvd[axis]);
+		__m256 pad = _mm256_load_ps(pk.fpad[axis]);
+		__m256 t1 = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(lo, p), invd), pad);
+		__m256 t2 = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(hi, p), invd), pad);
+		tMin = _mm256_max_ps(t1, tMin);
+		tMax = _mm256_min_ps(t2, tMax);
+	}
+	tMin = _mm256_sub_ps(tMin, _mm256_mul_ps(_mm256_andnot_ps(signMask, tMin), ulps));
+	tMax = _mm256_add_ps(tMax, _mm256_mul_ps(_mm256_andnot_ps(signMask, tMax), ulps));
+	__m256 h = _mm256_and_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ),
+		_mm256_and_ps(_mm256_cmp_ps(tMax, _mm256_set1_ps((float)RAY_EPSILON), _CMP_GE_OQ),
+			_mm256_cmp_ps(tMin, _mm256_load_ps(pk.tLimit), _CMP_LE_OQ)));
+	return _mm256_movemask_ps(h) & mask;
+}
+
+__attribute__((target("sse2")))
+static int hitTriangleSSE(const Vec3d& A, const Vec3d& edge1, const Vec3d& edge2,
+	const RayPacket& pk, int mask, double* t, double* beta, double* gamma)
+{
+	const __m128d signBit = _mm_set1_pd(-0.0);
+	const __m128d zero = _mm_setzero_pd();
+	const __m128d e1x = _mm_set1_pd(edge1[0]), e1y = _mm_set1_pd(edge1[1]), e1z = _mm_set1_pd(edge1[2]);
+	const __m128d e2x = _mm_set1_pd(edge2[0]), e2y = _mm_set1_pd(edge2[1]), e2z = _mm_set1_pd(edge2[2]);
+	int hit = 0;
+	for (int o = 0; o < pk.size; o += 2) {
+		int m = (mask >> o) & 0x3;
+		if (!m) continue;
+		__m128d dx = _mm_load_pd(&pk.d[0][o]), dy = _mm_load_pd(&pk.d[1][o]), dz = _mm_load_pd(&pk.d[2][o]);
+
+		// pvec = d ^ edge2, det = edge1 * pvec
+		__m128d pvx = _mm_sub_pd(_mm_mul_pd(dy, e2z), _mm_mul_pd(dz, e2y));
+		__m128d pvy = _mm_sub_pd(_mm_mul_pd(dz, e2x), _mm_mul_pd(dx, e2z));
+		__m128d pvz = _mm_sub_pd(_mm_mul_pd(dx, e2y), _mm_mul_pd(dy, e2x));
+		__m128d det = _mm_add_pd(_mm_add_pd(_mm_mul_pd(e1x, pvx), _mm_mul_pd(e1y, pvy)), _mm_mul_pd(e1z, pvz));
+		__m128d ok = _mm_cmpneq_pd(det, zero);
+		__m128d sign = _mm_andnot_pd(_mm_cmpgt_pd(det, zero), signBit);
+		det = _mm_xor_pd(det, sign);
+
+		// tvec = p - A, u = sign * (tvec * pvec)
+		__m128d tx = _mm_sub_pd(_mm_load_pd(&pk.p[0][o]), _mm_set1_pd(A[0]));
+		__m128d ty = _mm_sub_pd(_mm_load_pd(&pk.p[1][o]), _mm_set1_pd(A[1]));
+		__m128d tz = _mm_sub_pd(_mm_load_pd(&pk.p[2][o]), _mm_set1_pd(A[2]));
+		__m128d u = _mm_add_pd(_mm_add_pd(_mm_mul_pd(tx, pvx), _mm_mul_pd(ty, pvy)), _mm_mul_pd(tz, pvz));
+		u = _mm_xor_pd(u, sign);
+		ok = _mm_and_pd(ok, _mm_and_pd(_mm_cmpnlt_pd(u, zero), _mm_cmpngt_pd(u, det)));
+
+		// qvec = tvec ^ edge1, v = sign * (d * qvec)
+		__m128d qx = _mm_sub_pd(_mm_mul_pd(ty, e1z), _mm_mul_pd(tz, e1y));
+		__m128d qy = _mm_sub_pd(_mm_mul_pd(tz, e1x), _mm_mul_pd(tx, e1z));
+		__m128d qz = _mm_sub_pd(_mm_mul_pd(tx, e1y), _mm_mul_pd(ty, e1x));
+		__m128d v = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, qx), _mm_mul_pd(dy, qy)), _mm_mul_pd(dz, qz));
+		v = _mm_xor_pd(v, sign);
+		ok = _mm_and_pd(ok, _mm_and_pd(_mm_cmpnlt_pd(v, zero), _mm_cmpngt_pd(_mm_add_pd(u, v), det)));
+
+		// tt = sign * (edge2 * qvec)
+		__m128d tt = _mm_add_pd(_mm_add_pd(_mm_mul_pd(e2x, qx), _mm_mul_pd(e2y, qy)), _mm_mul_pd(e2z, qz));
+		tt = _mm_xor_pd(tt, sign);
+		ok = _mm_and_pd(ok, _mm_cmpnlt_pd(tt, _mm_mul_pd(_mm_set1_pd(RAY_EPSILON), det)));
+
+		int h = _mm_movemask_pd(ok) & m;
+		if (!h) continue;
+		__m128d invDet = _mm_div_pd(_mm_set1_pd(1.0), det);
+		alignas(16) double lt[2], lb[2], lg[2];
+		_mm_store_pd(lt, _mm_mul_pd(tt, invDet));
+		_mm_store_pd(lb, _mm_mul_pd(u, invDet));
+		_mm_store_pd(lg, _mm_mul_pd(v, invDet));
+		for (int j = 0; j < 2; ++j) {
+			if (!(h & (1 << j))) continue;
+			t[o+j] = lt[j];
+			beta[o+j] = lb[j];
+			gamma[o+j] = lg[j];
+		}
+		hit |= h << o;
+	}
+	return hit;
+}
+
+__attribute__((target("avx")))
+static int hitTriangleAVX(const Vec3d& A, const Vec3d& edge1, const Vec3d& edge2,
+	const RayPacket& pk, int mask, double* t, double* beta, double* gamma)
+{
+	const __m256d signBit = _mm256_set1_pd(-0.0);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d e1x = _mm256_set1_pd(edge1[0]), e1y = _mm256_set1_pd(edge1[1]), e1z = _mm256_set1_pd(edge1[2]);
+	const __m256d e2x = _mm256_set1_pd(edge2[0]), e2y = _mm256_set1_pd(edge2[1]), e2z = _mm256_set1_pd(edge2[2]);
+	int hit = 0;
+	for (int o = 0; o < pk.size; o += 4) {
+		int m = (mask >> o) & 0xf;
+		if (!m) continue;
+		__m256d dx = _mm256_load_pd(&pk.d[0][o]), dy = _mm256_load_pd(&pk.d[1][o]), dz = _mm256_load_pd(&pk.d[2][o]);
+
+		__m256d pvx = _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+		__m256d pvy = _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+		__m256d pvz = _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+		__m256d det = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e1x, pvx), _mm256_mul_pd(e1y, pvy)), _mm256_mul_pd(e1z, pvz));
+		__m256d ok = _mm256_cmp_pd(det, zero, _CMP_NEQ_UQ);
+		__m256d sign = _mm256_andnot_pd(_mm256_cmp_pd(det, zero, _CMP_GT_OQ), signBit);
+		det = _mm256_xor_pd(det, sign);
+
+		__m256d tx = _mm256_sub_pd(_mm256_load_pd(&pk.p[0][o]), _mm256_set1_pd(A[0]));
+		__m256d ty = _mm256_sub_pd(_mm256_load_pd(&pk.p[1][o]), _mm256_set1_pd(A[1]));
+		__m256d tz = _mm256_sub_pd(_mm256_load_pd(&pk.p[2][o]), _mm256_set1_pd(A[2]));
+		__m256d u = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(tx, pvx), _mm256_mul_pd(ty, pvy)), _mm256_mul_pd(tz, pvz));
+		u = _mm256_xor_pd(u, sign);
+		ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(u, zero, _CMP_NLT_UQ), _mm256_cmp_pd(u, det, _CMP_NGT_UQ)));
+
+		__m256d qx = _mm256_sub_pd(_mm256_mul_pd(ty, e1z), _mm256_mul_pd(tz, e1y));
+		__m256d qy = _mm256_sub_pd(_mm256_mul_pd(tz, e1x), _mm256_mul_pd(tx, e1z));
+		__m256d qz = _mm256_sub_pd(_mm256_mul_pd(tx, e1y), _mm256_mul_pd(ty, e1x));
+		__m256d v = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)), _mm256_mul_pd(dz, qz));
+		v = _mm256_xor_pd(v, sign);
+		ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(v, zero, _CMP_NLT_UQ),
+			_mm256_cmp_pd(_mm256_add_pd(u, v), det, _CMP_NGT_UQ)));
+
+		__m256d tt = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e2x, qx), _mm256_mul_pd(e2y, qy)), _mm256_mul_pd(e2z, qz));
+		tt = _mm256_xor_pd(tt, sign);
+		ok = _mm256_and_pd(ok, _mm256_cmp_pd(tt, _mm256_mul_pd(_mm256_set1_pd(RAY_EPSILON), det), _CMP_NLT_UQ));
+
+		int h = _mm256_movemask_pd(ok) & m;
+		if (!h) continue;
+		__m256d invDet = _mm256_div_pd(_mm256_set1_pd(1.0), det);
+		alignas(32) double lt[4], lb[4], lg[4];
+		_mm256_store_pd(lt, _mm256_mul_pd(tt, invDet));
+		_mm256_store_pd(lb, _mm256_mul_pd(u, invDet));
+		_mm256_store_pd(lg, _mm256_mul_pd(v, invDet));
+		for (int j = 0; j < 4; ++j) {
+			if (!(h & (1 << j))) continue;
+			t[o+j] = lt[j];
+			beta[o+j] = lb[j];
+			gamma[o+j] = lg[j];
+		}
+		hit |= h << o;
+	}
+	return hit;
+}
+
+#endif // PACKET_X86
+
+
+typedef int (*BoxTest)(const FlatKdNode& node, const RayPacket& pk, int mask);
+typedef int (*TriangleTest)(const Vec3d& A, const Vec3d& e1, const Vec3d& e2,
+	const RayPacket& pk, int mask, double* t, double* beta, double* gamma);
+
+struct PacketKernels
+{
+	BoxTest box;
+	TriangleTest triangle;
+	const char* name;
+
+	PacketKernels() {
+		box = testBoxScalar;
+		triangle = hitTriangleScalar;
+		name = "scalar";
+#ifdef PACKET_X86
+		if (__builtin_cpu_supports("avx")) {
+			box = testBoxAVX;
+			triangle = hitTriangleAVX;
+			name = "avx";
+		} else if (__builtin_cpu_supports("sse2")) {
+			box = testBoxSSE;
+			triangle = hitTriangleSSE;
+			name = "sse";
+		}
+#endif
+	}
+};
+
+static const PacketKernels kernels;
+
+int packetTestBox(const FlatKdNode& node, const RayPacket& pk, int mask)
+{
+	return kernels.box(node, pk, mask);
+}
+
+int packetHitTriangle(const Vec3d& A, const Vec3d& e1, const Vec3d& e2,
+	const RayPacket& pk, int mask, double* t, double* beta, double* gamma)
+{
+	return kernels.triangle(A, e1, e2, pk, mask, t, beta, gamma);
+}
+
+const char* packetKernelName()
+{
+	return kernels.name;
+}
@@ -0,0 +1,67 @@
+#ifndef __RAYPACKET_H__
+#define __RAYPACKET_H__
+// A packet of 4 or 8 coherent rays, e.g. the camera rays of a 2x2 or 4x2
+// block of pixels, traced through the kd trees together.
+//
+// The rays are stored lane by lane, axis by axis (structure of arrays),
+// twice: in double for the primitive tests, which give exactly the hits
+// the rays would get one at a time, and rounded to float with the same
+// padding as WideRay for the box tests, which only decide which nodes
+// are visited.  Every kernel takes a lane mask; lanes outside it are
+// left alone, so a packet splits into smaller groups as its rays go
+// their own ways down the tree.
+//
+//		RayPacket pk(4);
+//		pk.set(k, r);	// for each lane
+//		int hit = scene->intersectPacket(pk, 0xf, hits);
+
+#include <stdint.h>
+#include <float.h>
+
+#include "ray.h"
+
+const int PACKET_MAX = 8;
+
+struct FlatKdNode;
+
+struct RayPacket
+{
+	int size;							// lanes in use, 4 or 8
+
+	alignas(32) double p[3][PACKET_MAX];
+	alignas(32) double d[3][PACKET_MAX];
+
+	alignas(32) float fp[3][PACKET_MAX];
+	alignas(32) float finvd[3][PACKET_MAX];
+	alignas(32) float fpad[3][PACKET_MAX];
+	alignas(32) uint32_t fsign[3][PACKET_MAX];	// all ones where d is negative
+	alignas(32) float tLimit[PACKET_MAX];		// boxes entered beyond it are culled
+
+	explicit RayPacket(int size) : size(size) {}
+
+	void set(int k, const ray& r);
+	ray get(int k) const {
+		return ray(Vec3d(p[0][k], p[1][k], p[2][k]), Vec3d(d[0][k], d[1][k], d[2][k]));
+	}
+
+	// the closest hit of lane k is now at t
+	void setBest(int k, double t);
+
+	int allLanes() const { return (1 << size) - 1; }
+};
+
+// Lanes of mask that enter node's box before their tLimit.  Each lane
+// follows wideTestScalar().
+int packetTestBox(const FlatKdNode& node, const RayPacket& pk, int mask);
+
+// Lanes of mask that hit the triangle with corner A and edges e1, e2,
+// with their t and barycentrics.  Each lane does exactly the arithmetic
+// of TrimeshFace::hit(), in the same order, so the results are the same
+// to the bit.
+int packetHitTriangle(const Vec3d& A, const Vec3d& e1, const Vec3d& e2,
+	const RayPacket& pk, int mask, double* t, double* beta, double* gamma);
+
+// "avx", "sse" or "scalar", whichever the kernels above run on this CPU
+const char* packetKernelName();
+
+#endif // __RAYPACKET_H__
@@ -0,0 +1,114 @@
+// SIMD versions of the WideKdTree node test.
+//
+// Each kernel follows wideTestScalar() step by step.  max/min take the
+// slab value as their first operand, so a NaN slab (origin on the side of
+// a box the ray is parallel to) leaves the range alone, as in the scalar
+// loop.  The AVX kernel is compiled for AVX on its own and only called
+// after the CPU has been asked, so the rest of the program still runs on
+// machines without it.
+
+#include "WideKdTree.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WIDE_X86 1
+#include <immintrin.h>
+#endif
+
+#ifdef WIDE_X86
+
+__attribute__((target("sse2")))
+static int wideTestSSE(const WideKdNode<4>& node, const WideRay& r, float tLimit, float* tNear) {
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	const __m128 ulps = _mm_set1_ps(WIDE_ULPS);
+	__m128 tMin = _mm_set1_ps(-FLT_MAX);
+	__m128 tMax = _mm_set1_ps(FLT_MAX);
+	for (int axis = 0; axis < 3; ++axis) {
+		__m128 p = _mm_set1_ps(r.p[axis]);
+		__m128 invd = _mm_set1_ps(r.invd[axis]);
+		__m128 pad = _mm_set1_ps(r.pad[axis]);
+		__m128 lo = _mm_load_ps(node.bounds[r.sign[axis]][axis]);
+		__m128 hi = _mm_load_ps(node.bounds[1-r.sign[axis]][axis]);
+		__m128 t1 = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(lo, p), invd), pad);
+		__m128 t2 = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(hi, p), invd), pad);
+		tMin = _mm_max_ps(t1, tMin);
+		tMax = _mm_min_ps(t2, tMax);
+	}
+	tMin = _mm_sub_ps(tMin, _mm_mul_ps(_mm_andnot_ps(signMask, tMin), ulps));
+	tMax = _mm_add_ps(tMax, _mm_mul_ps(_mm_andnot_ps(signMask, tMax), ulps));
+	_mm_storeu_ps(tNear, tMin);
+	__m128 hit = _mm_and_ps(_mm_cmple_ps(tMin, tMax),
+		_mm_and_ps(_mm_cmpge_ps(tMax, _mm_set1_ps((float)RAY_EPSILON)),
+			_mm_cmple_ps(tMin, _mm_set1_ps(tLimit))));
+	return _mm_movemask_ps(hit);
+}
+
+__attribute__((target("avx")))
+static int wideTestAVX(const WideKdNode<8>& node, const WideRay& r, float tLimit, float* tNear) {
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+	const __m256 ulps = _mm256_set1_ps(WIDE_ULPS);
+	__m256 tMin = _mm256_set1_ps(-FLT_MAX);
+	__m256 tMax = _mm256_set1_ps(FLT_MAX);
+	for (int axis = 0; axis < 3; ++axis) {
+		__m256 p = _mm256_set1_ps(r.p[axis]);
+		__m256 invd = _mm256_set1_ps(r.invd[axis]);
+		__m256 pad = _mm256_set1_ps(r.pad[axis]);
+		__m256 lo = _mm256_loadu_ps(node.bounds[r.sign[axis]][axis]);
+		__m256 hi = _mm256_loadu_ps(node.bounds[1-r.sign[axis]][axis]);
+		__m256 t1 = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(lo, p), invd), pad);
+		__m256 t2 = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(hi, p), invd), pad);
+		tMin = _mm256_max_ps(t1, tMin);
+		tMax = _mm256_min_ps(t2, tMax);
+	}
+	tMin = _mm256_sub_ps(tMin, _mm256_mul_ps(_mm256_andnot_ps(signMask, tMin), ulps));
+	tMax = _mm256_add_ps(tMax, _mm256_mul_ps(_mm256_andnot_ps(signMask, tMax), ulps));
+	_mm256_storeu_ps(tNear, tMin);
+	__m256 hit = _mm256_and_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ),
+		_mm256_and_ps(_mm256_cmp_ps(tMax, _mm256_set1_ps((float)RAY_EPSILON), _CMP_GE_OQ),
+			_mm256_cmp_ps(tMin, _mm256_set1_ps(tLimit), _CMP_LE_OQ)));
+	return _mm256_movemask_ps(hit);
+}
+
+#endif // WIDE_X86
+
+
+template<>
+bool WideKernel<4>::hasSimd() {
+#ifdef WIDE_X86
+	return __builtin_cpu_supports("sse2");
+#else
+	return false;
+#endif
+}
+
+template<>
+WideKernel<4>::Test WideKernel<4>::select(const char*& name) {
+#ifdef WIDE_X86
+	if (hasSimd()) {
+		name = "sse";
+		return wideTestSSE;
+	}
+#endif
+	name = "scalar";
+	return wideTestScalar<4>;
+}
+
+template<>
+bool WideKernel<8>::hasSimd() {
+#ifdef WIDE_X86
+	return __builtin_cpu_supports("avx");
+#else
+	return false;
+#endif
+}
+
+template<>
+WideKernel<8>::Test WideKernel<8>::select(const char*& name) {
+#ifdef WIDE_X86
+	if (hasSimd()) {
+		name = "avx";
+		return wideTestAVX;
+	}
+#endif
+	name = "scalar";
+	return wideTestScalar<8>;
+}
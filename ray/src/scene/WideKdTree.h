@@ -0,0 +1,380 @@
+#ifndef __WIDEKDTREE_H__
+#define __WIDEKDTREE_H__
+// W-wide KdTree for speeding up intersect
+// The binary tree found by KdTree is collapsed so that every node holds up
+// to W children, whose boxes are stored axis by axis (structure of arrays)
+// in floats.  One ray is then tested against all W boxes at once: with SSE
+// for W = 4 and AVX for W = 8, or with a plain loop on CPUs without them.
+// To build the wide tree:
+//		kt = KdTree<T>(objs, 5);
+//		wt = WideKdTree<T, 4>(kt);
+// or, from the nodes and primitives of one laid out before:
+//		wt = WideKdTree<T, 4>(nodes, nodeNum, depth, prims);
+
+#include <vector>
+#include <stdint.h>
+#include <float.h>
+#include <string.h>
+
+#include "ray.h"
+#include "bbox.h"
+#include "KdTree.h"
+#include "FlatKdTree.h"
+
+using namespace std;
+
+const uint32_t WIDE_EMPTY = 0xffffffff;
+
+// relative rounding error of the two float operations per slab; the box
+// ranges are widened by it so that float never misses what double hits
+const float WIDE_ULPS = 2.0f*FLT_EPSILON;
+
+template<int W>
+struct WideKdNode
+{
+	float bounds[2][3][W];	// [min, max][axis][child]
+	uint32_t child[W];		// interior child: node index, leaf child: first primitive
+	uint32_t count[W];		// primitives of a leaf child, 0 otherwise
+};
+
+// a ray prepared for the float box tests.  Rounding the origin to float
+// moves the ray by up to pad/invd along each axis, so the slabs are widened
+// by pad to keep the test conservative.
+struct WideRay
+{
+	float p[3];
+	float invd[3];
+	float pad[3];
+	int sign[3];
+
+	WideRay(const ray& r) {
+		for (int axis = 0; axis < 3; ++axis) {
+			p[axis] = (float)r.p[axis];
+			invd[axis] = (float)r.invd[axis];
+			double err = fabs(r.p[axis] - (double)p[axis]);
+			pad[axis] = err == 0.0 ? 0.0f : roundUp(2.0 * err * fabs(r.invd[axis]));
+			sign[axis] = r.sign[axis];
+		}
+	}
+};
+
+// Tests a ray against the W child boxes of a node.  Returns a bit mask of
+// the children it enters before tLimit, and their entry t in tNear.
+template<int W>
+struct WideKernel
+{
+	typedef int (*Test)(const WideKdNode<W>& node, const WideRay& r, float tLimit, float* tNear);
+
+	// the SIMD kernel if this CPU has it, else the scalar loop
+	static Test select(const char*& name);
+	static bool hasSimd();
+};
+
+template<int W>
+int wideTestScalar(const WideKdNode<W>& node, const WideRay& r, float tLimit, float* tNear);
+
+
+// WideKdTree
+//
+//
+
+template<class T, int W>
+class WideKdTree {
+
+	typedef std::vector<T*> ObjVec;
+	typedef WideKdNode<W> Node;
+
+public:
+	WideKdTree(const KdTree<T>& tree);
+	// as FlatKdTree: aligned nodes are used in place, others copied
+	WideKdTree(const Node* nodes, int nodeNum, int maxDepth, const ObjVec& prims);
+
+	~WideKdTree() {
+		delete [] nodeMemory;
+	}
+
+	bool intersect(ray& r, isect& i) const;
+	bool occluded(ray& r, double tMax) const;
+
+	int getDepth() const { return maxDepth; }
+	int getNodeNum() const { return nodeNum; }
+	int getPrimNum() const { return prims.size(); }
+	int getBytes() const { return nodeNum*sizeof(Node) + prims.size()*sizeof(T*); }
+	const char* getKernel() const { return kernelName; }
+	const Node* getNodes() const { return nodes; }
+	const ObjVec& getPrims() const { return prims; }
+
+	const KdTraversalStats& getStats() const { return stats; }
+	void resetStats() const { stats.reset(); }
+
+private:
+	Node* nodes;			// cache-line aligned view into nodeMemory
+	unsigned char* nodeMemory;
+	int nodeNum;
+	int maxDepth;
+	ObjVec prims;
+	typename WideKernel<W>::Test testNode;
+	const char* kernelName;
+	mutable KdTraversalStats stats;
+
+	int collapse(const KdTree<T>* tree, std::vector<Node>& out, int depth);
+	void setChild(Node& node, int k, const BoundingBox& box, uint32_t child, uint32_t count);
+};
+
+
+template<class T, int W>
+WideKdTree<T, W>::WideKdTree(const KdTree<T>& tree) {
+	testNode = WideKernel<W>::select(kernelName);
+	maxDepth = 0;
+	std::vector<Node> out;
+	if (tree.leftChild) {
+		collapse(&tree, out, 1);
+	} else {
+		// a single leaf still gets a node, with one child
+		out.push_back(Node());
+		for (int k = 0; k < W; ++k)
+			setChild(out[0], k, BoundingBox(), WIDE_EMPTY, 0);
+		if (!tree.objects.empty()) {
+			setChild(out[0], 0, tree.treeBounds, 0, tree.objects.size());
+			prims = tree.objects;
+		}
+		maxDepth = 1;
+	}
+
+	// align the array to 64 bytes by hand, std::vector does not promise it
+	nodeNum = out.size();
+	nodeMemory = new unsigned char[nodeNum*sizeof(Node) + 63];
+	nodes = (Node*)(((uintptr_t)nodeMemory + 63) & ~(uintptr_t)63);
+	memcpy(nodes, &out[0], nodeNum*sizeof(Node));
+}
+
+template<class T, int W>
+WideKdTree<T, W>::WideKdTree(const Node* from, int nodeNum, int maxDepth, const ObjVec& prims)
+	: nodeMemory(NULL), nodeNum(nodeNum), maxDepth(maxDepth), prims(prims) {
+	testNode = WideKernel<W>::select(kernelName);
+	if (((uintptr_t)from & 63) == 0) {
+		// only read from here on
+		nodes = const_cast<Node*>(from);
+	} else {
+		nodeMemory = new unsigned char[nodeNum*sizeof(Node) + 63];
+		nodes = (Node*)(((uintptr_t)nodeMemory + 63) & ~(uintptr_t)63);
+		memcpy(nodes, from, nodeNum*sizeof(Node));
+	}
+}
+
+template<class T, int W>
+void WideKdTree<T, W>::setChild(Node& node, int k, const BoundingBox& box, uint32_t child, uint32_t count) {
+	for (int axis = 0; axis < 3; ++axis) {
+		if (box.isEmpty()) {
+			node.bounds[0][axis][k] = FLT_MAX;
+			node.bounds[1][axis][k] = -FLT_MAX;
+		} else {
+			node.bounds[0][axis][k] = roundDown(box.getMin()[axis]);
+			node.bounds[1][axis][k] = roundUp(box.getMax()[axis]);
+		}
+	}
+	node.child[k] = child;
+	node.count[k] = count;
+}
+
+// Pull the W nodes nearest to tree into one wide node, always opening the
+// interior child with the largest surface area, then recurse into the
+// interior ones.  Returns the index of the new node.
+template<class T, int W>
+int WideKdTree<T, W>::collapse(const KdTree<T>* tree, std::vector<Node>& out, int depth) {
+	if (depth > maxDepth)
+		maxDepth = depth;
+
+	const KdTree<T>* kids[W];
+	int n = 2;
+	kids[0] = tree->leftChild;
+	kids[1] = tree->rightChild;
+	while (n < W) {
+		int best = -1;
+		double bestArea = -1.0;
+		for (int k = 0; k < n; ++k) {
+			if (!kids[k]->leftChild) continue;
+			BoundingBox b = kids[k]->treeBounds;
+			if (b.area() > bestArea) {
+				bestArea = b.area();
+				best = k;
+			}
+		}
+		if (best < 0) break;
+		const KdTree<T>* open = kids[best];
+		kids[best] = open->leftChild;
+		kids[n++] = open->rightChild;
+	}
+
+	int index = out.size();
+	out.push_back(Node());
+	for (int k = 0; k < W; ++k) {
+		// out may grow below, so write through the index every time
+		if (k >= n || (!kids[k]->leftChild && kids[k]->objects.empty())) {
+			setChild(out[index], k, BoundingBox(), WIDE_EMPTY, 0);
+		} else if (!kids[k]->leftChild) {
+			setChild(out[index], k, kids[k]->treeBounds, prims.size(), kids[k]->objects.size());
+			prims.insert(prims.end(), kids[k]->objects.begin(), kids[k]->objects.end());
+		} else {
+			int child = collapse(kids[k], out, depth+1);
+			setChild(out[index], k, kids[k]->treeBounds, child, 0);
+		}
+	}
+	return index;
+}
+
+// Front-to-back traversal, like FlatKdTree: the children a ray enters are
+// pushed farthest first, so the nearest is visited next, and entries that
+// start beyond the closest hit found since are dropped when popped.
+template<class T, int W>
+bool WideKdTree<T, W>::intersect(ray& r, isect& i) const {
+	struct Entry { uint32_t child; uint32_t count; float tNear; };
+	const int localSize = KD_STACK_SIZE*(W-1) + 1;
+	Entry localStack[localSize];
+	std::vector<Entry> bigStack;
+	Entry* stack = localStack;
+	if (maxDepth*(W-1) + 1 > localSize) {
+		bigStack.resize(maxDepth*(W-1) + 1);
+		stack = &bigStack[0];
+	}
+
+	WideRay wr(r);
+	bool have_one = false;
+	double tBest = 1.0e308;
+	float tLimit = FLT_MAX;
+	long long nodeCount = 0, boxCount = 0, primCount = 0;
+
+	int top = 0;
+	stack[top].child = 0;
+	stack[top].count = 0;
+	stack[top].tNear = -FLT_MAX;
+	++top;
+	while (top > 0) {
+		--top;
+		const Entry e = stack[top];
+		if (e.tNear > tLimit)
+			continue;
+		++nodeCount;
+
+		if (e.count > 0) {
+			for (uint32_t j = e.child; j < e.child + e.count; ++j) {
+				isect cur;
+				++primCount;
+				if (prims[j]->intersect(r, cur)) {
+					if (!have_one || (cur.t < i.t)) {
+						i = cur;
+						tBest = cur.t;
+						tLimit = roundUp(tBest);
+						have_one = true;
+					}
+				}
+			}
+			continue;
+		}
+
+		const Node& node = nodes[e.child];
+		float tNear[W];
+		int mask = testNode(node, wr, tLimit, tNear);
+		boxCount += W;
+
+		// insert the hit children sorted by decreasing tNear
+		int first = top;
+		for (int k = 0; k < W; ++k) {
+			if (!(mask & (1 << k))) continue;
+			int j = top++;
+			while (j > first && stack[j-1].tNear < tNear[k]) {
+				stack[j] = stack[j-1];
+				--j;
+			}
+			stack[j].child = node.child[k];
+			stack[j].count = node.count[k];
+			stack[j].tNear = tNear[k];
+		}
+	}
+
+	stats.add(nodeCount, boxCount, primCount);
+	if (!have_one) i.setT(1000.0);
+	return have_one;
+}
+
+
+// Any-hit traversal for shadow rays: children are pushed unsorted, and
+// the first primitive hit before tMax ends it.
+template<class T, int W>
+bool WideKdTree<T, W>::occluded(ray& r, double tMax) const {
+	struct Entry { uint32_t child; uint32_t count; };
+	const int localSize = KD_STACK_SIZE*(W-1) + 1;
+	Entry localStack[localSize];
+	std::vector<Entry> bigStack;
+	Entry* stack = localStack;
+	if (maxDepth*(W-1) + 1 > localSize) {
+		bigStack.resize(maxDepth*(W-1) + 1);
+		stack = &bigStack[0];
+	}
+
+	WideRay wr(r);
+	float tLimit = roundUp(tMax);
+	long long nodeCount = 0, boxCount = 0, primCount = 0;
+	bool hit = false;
+
+	int top = 0;
+	stack[top].child = 0;
+	stack[top].count = 0;
+	++top;
+	while (top > 0 && !hit) {
+		const Entry e = stack[--top];
+		++nodeCount;
+
+		if (e.count > 0) {
+			for (uint32_t j = e.child; j < e.child + e.count; ++j) {
+				++primCount;
+				if (prims[j]->occluded(r, tMax)) {
+					hit = true;
+					break;
+				}
+			}
+			continue;
+		}
+
+		const Node& node = nodes[e.child];
+		float tNear[W];
+		int mask = testNode(node, wr, tLimit, tNear);
+		boxCount += W;
+		for (int k = 0; k < W; ++k) {
+			if (!(mask & (1 << k))) continue;
+			stack[top].child = node.child[k];
+			stack[top].count = node.count[k];
+			++top;
+		}
+	}
+
+	stats.add(nodeCount, boxCount, primCount);
+	return hit;
+}
+
+
+// scalar version of the node test, the reference for the SIMD kernels
+template<int W>
+int wideTestScalar(const WideKdNode<W>& node, const WideRay& r, float tLimit, float* tNear) {
+	int mask = 0;
+	for (int k = 0; k < W; ++k) {
+		float tMin = -FLT_MAX;
+		float tMax = FLT_MAX;
+		for (int axis = 0; axis < 3; ++axis) {
+			float t1 = (node.bounds[r.sign[axis]][axis][k] - r.p[axis]) * r.invd[axis] - r.pad[axis];
+			float t2 = (node.bounds[1-r.sign[axis]][axis][k] - r.p[axis]) * r.invd[axis] + r.pad[axis];
+			// NaN from a parallel axis leaves the range alone
+			tMin = t1 > tMin ? t1 : tMin;
+			tMax = t2 < tMax ? t2 : tMax;
+		}
+		tMin -= fabsf(tMin)*WIDE_ULPS;
+		tMax += fabsf(tMax)*WIDE_ULPS;
+		tNear[k] = tMin;
+		if (tMin <= tMax && tMax >= (float)RAY_EPSILON && tMin <= tLimit)
+			mask |= 1 << k;
+	}
+	return mask;
+}
+
+
+#endif // __WIDEKDTREE_H__
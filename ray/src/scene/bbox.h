@@ -11,12 +11,12 @@ class BoundingBox {
 
 public:
 
-	BoundingBox() : bEmpty(true) {}
+	BoundingBox() : bEmpty(true), dirty(true) {}
 	BoundingBox(Vec3d bMin, Vec3d bMax) : bmin(bMin), bmax(bMax), bEmpty(false), dirty(true) {}
 
 	Vec3d getMin() const { return bmin; }
 	Vec3d getMax() const { return bmax; }
-	bool isEmpty() { return bEmpty; }
+	bool isEmpty() const { return bEmpty; }
 
 	void setMin(Vec3d bMin) {
 		bmin = bMin;
@@ -58,34 +58,24 @@ public:
 	// if the ray hits the box, put the "t" value of the intersection
 	// closest to the origin in tMin and the "t" value of the far intersection
 	// in tMax and return true, else return false.
-	// Using Kay/Kajiya algorithm.
+	// Using Kay/Kajiya algorithm, with the ray's reciprocal direction and
+	// sign bits picking the near and far side of each slab without branches.
+	// On an axis the ray is parallel to, the slab gives -inf/inf if the
+	// origin is inside it (no constraint) and an empty range if outside;
+	// an origin exactly on a side gives NaN, which the comparisons ignore.
 	bool intersect(const ray& r, double& tMin, double& tMax) const {
-		Vec3d R0 = r.getPosition();
-		Vec3d Rd = r.getDirection();
+		const Vec3d* corners[2] = { &bmin, &bmax };
 		tMin = -1.0e308; // 1.0e308 is close to infinity... close enough for us!
 		tMax = 1.0e308;
-		double ttemp;
 	
-		for (int currentaxis = 0; currentaxis < 3; currentaxis++) {
-			double vd = Rd[currentaxis];
-			// if the ray is parallel to the face's plane (=0.0)
-			if( vd == 0.0 ) continue;
-			double v1 = bmin[currentaxis] - R0[currentaxis];
-			double v2 = bmax[currentaxis] - R0[currentaxis];
-			// two slab intersections
-			double t1 = v1/vd;
-			double t2 = v2/vd;
-			if ( t1 > t2 ) { // swap t1 & t2
-				ttemp = t1;
-				t1 = t2;
-				t2 = ttemp;
-			}
-			if (t1 > tMin) tMin = t1;
-			if (t2 < tMax) tMax = t2;
-			if (tMin > tMax) return false; // box is missed
-			if (tMax < RAY_EPSILON) return false; // box is behind ray
+		for (int axis = 0; axis < 3; axis++) {
+			double t1 = ((*corners[r.sign[axis]])[axis] - r.p[axis]) * r.invd[axis];
+			double t2 = ((*corners[1-r.sign[axis]])[axis] - r.p[axis]) * r.invd[axis];
+			tMin = t1 > tMin ? t1 : tMin;
+			tMax = t2 < tMax ? t2 : tMax;
 		}
-		 return true; // it made it past all 3 axes.
+		// box is missed, or behind the ray
+		return tMin <= tMax && tMax >= RAY_EPSILON;
 	}
 
 	void operator=(const BoundingBox& target) {
@@ -27,7 +27,7 @@ Camera::rayThrough(double x, double y, ray &r)
     Vec3d dir = look + x * u + y * v;
 	dir.normalize();
 	r.p = eye;
-	r.d = dir;
+	r.setDirection(dir);
 }
 
 void
@@ -1,9 +1,7 @@
 #include "cubeMap.h"
 #include "ray.h"
-#include "../ui/TraceUI.h"
-extern TraceUI* traceUI;
 
-Vec3d CubeMap::getColor(ray r) const {
+Vec3d CubeMap::getColor(ray r, int filterwidth) const {
 
 	int axis, front, left, right, top, bottom;
 	double u,v;
@@ -91,7 +89,6 @@ Vec3d CubeMap::getColor(ray r) const {
 	u = (u + 1.0)/2.0;
 	v = (v + 1.0)/2.0;
 
-	int filterwidth = traceUI->getFilterWidth();
 	// if (r.type() != ray::VISIBILITY || filterwidth == 1) return tMap[front]->getMappedValue(Vec2d(u, v));
 	if (filterwidth == 1) return tMap[front]->getMappedValue(Vec2d(u, v));
 	int fw = (filterwidth + 1)/2 - 1;
@@ -37,7 +37,8 @@ public:
 		if (tMap[5] != m) tMap[5] = m;
 	}
 
-	Vec3d getColor(ray r) const;
+	// the colour seen along r, averaged over filterwidth x filterwidth texels
+	Vec3d getColor(ray r, int filterwidth) const;
 
 	~CubeMap() {
 		for (int i = 0; i < 6; i++) if (tMap[i]) { delete tMap[i]; tMap[i] = 0; }
@@ -15,10 +15,18 @@ Vec3d DirectionalLight::shadowAttenuation(const ray& r, const Vec3d& p) const
 {
   // YOUR CODE HERE:
   // You should implement shadow-handling code here.
+  ray r_2nd(p, getDirection(p), ray::SHADOW);
+  // unblocked, or blocked by something opaque: any hit tells
+  if(!scene->occluded(r_2nd, 1.0e308))
+      return Vec3d(1,1,1);
+  if(!scene->hasTransmissive())
+      return Vec3d(0,0,0);
+
+  // the closest blocker decides how much gets through
   isect i;
-  ray r_2nd(p, getDirection(p), ray::REFLECTION);
   if(scene->intersect(r_2nd, i)) {
-      Vec3d kt = i.material->kt(i);
+      Material m;
+      Vec3d kt = i.resolveMaterial(m).kt(i);
       return kt;
   }
 
@@ -67,8 +75,16 @@ Vec3d PointLight::shadowAttenuation(const ray& r, const Vec3d& p) const
 {
   // YOUR CODE HERE:
   // You should implement shadow-handling code here.
+  ray r_2nd(p, getDirection(p), ray::SHADOW);
+  // unblocked, or blocked by something opaque: any hit tells
+  double distance = (position-p).length();
+  if(!scene->occluded(r_2nd, distance))
+      return Vec3d(1,1,1);
+  if(!scene->hasTransmissive())
+      return Vec3d(0,0,0);
+
+  // the closest blocker decides how much gets through
   isect i;
-  ray r_2nd(p, getDirection(p), ray::REFLECTION);
   if(scene->intersect(r_2nd, i)) {
       // check the intersection if before or after the light
       Vec3d q = r_2nd.at(i.t);
@@ -81,7 +97,8 @@ Vec3d PointLight::shadowAttenuation(const ray& r, const Vec3d& p) const
         //   return factor*Vec3d(1,1,1);
         // }
         // standard shadows
-        Vec3d kt = i.material->kt(i);
+        Material m;
+        Vec3d kt = i.resolveMaterial(m).kt(i);
         return kt;
       }
   }
@@ -43,6 +43,8 @@ public:
 protected:
 	Vec3d 		orientation;
 
+	friend class SceneFile;
+
 public:
 	void glDraw(GLenum lightID) const;
 	void glDraw() const;
@@ -84,6 +86,8 @@ protected:
 	float linearTerm;		// b
 	float quadraticTerm;	// c
 
+	friend class SceneFile;
+
 public:
 	void glDraw(GLenum lightID) const;
 	void glDraw() const;
@@ -42,31 +42,42 @@ Vec3d Material::shade(Scene *scene, const ray& r, const isect& i) const
   // shadowAttenuation() methods for each light source in order to
   // compute shadows and light falloff.
 
-  Vec3d I_a = scene->ambient();
-  Vec3d I = ke(i) + prod(ka(i),I_a);
+  Vec3d I = shadeAmbient(scene, i);
   Vec3d Q = r.at(i.t);
   for ( vector<Light*>::const_iterator litr = scene->beginLights(); 
      litr != scene->endLights(); 
      ++litr )
   {
      Light* pLight = *litr;
-
-     Vec3d atten = pLight->distanceAttenuation(Q)*pLight->shadowAttenuation(r,Q);   // tbd
-     Vec3d I_l = pLight->getColor();
-     Vec3d N = i.N;
-     Vec3d L = pLight->getDirection(Q);
-     Vec3d R = 2*N*(N*L)-L;
-     Vec3d V = -r.d;
-     double n_s = shininess(i);     
-     
-     I += prod(prod(atten,I_l), 
-              kd(i)*max(0.0,N*L) + ks(i)*pow(max(0.0,R*V),n_s)
-              );
+     I += shadeLight(pLight, r, i, pLight->shadowAttenuation(r,Q));
   }
 
   return I;
 }
 
+Vec3d Material::shadeAmbient(Scene *scene, const isect& i) const
+{
+  Vec3d I_a = scene->ambient();
+  return ke(i) + prod(ka(i),I_a);
+}
+
+// diffuse and specular light from pLight, of which shadow gets through
+Vec3d Material::shadeLight(const Light* pLight, const ray& r, const isect& i, const Vec3d& shadow) const
+{
+  Vec3d Q = r.at(i.t);
+  Vec3d atten = pLight->distanceAttenuation(Q)*shadow;
+  Vec3d I_l = pLight->getColor();
+  Vec3d N = i.N;
+  Vec3d L = pLight->getDirection(Q);
+  Vec3d R = 2*N*(N*L)-L;
+  Vec3d V = -r.d;
+  double n_s = shininess(i);
+
+  return prod(prod(atten,I_l), 
+              kd(i)*max(0.0,N*L) + ks(i)*pow(max(0.0,R*V),n_s)
+              );
+}
+
 TextureMap::TextureMap( string filename ) {
 
 	int start = (int) filename.find_last_of('.');
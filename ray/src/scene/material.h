@@ -14,6 +14,7 @@
 class Scene;
 class ray;
 class isect;
+class Light;
 
 using std::string;
 
@@ -45,6 +46,8 @@ class TextureMap {
 	  ~TextureMap() { if (data) delete[] data; }
 
 protected:
+       friend class SceneFile;
+
        string filename;
        int width;
        int height;
@@ -137,6 +140,17 @@ public:
 
 	bool isZero() { return _value.iszero(); }
 
+    // an ordering for finding equal parameters; maps compare by identity
+    bool operator<( const MaterialParameter& rhs ) const
+    {
+      if( _textureMap != rhs._textureMap )
+        return _textureMap < rhs._textureMap;
+      for( int k = 0; k < 3; ++k )
+        if( _value[k] != rhs._value[k] )
+          return _value[k] < rhs._value[k];
+      return false;
+    }
+
     Vec3d& operator+=( const Vec3d& rhs )
     {
       _value += rhs;
@@ -151,6 +165,8 @@ public:
 	bool mapped() const { return _textureMap != 0; }
 
 private:
+    friend class SceneFile;
+
     Vec3d _value;
     TextureMap* _textureMap;
 };
@@ -178,6 +194,12 @@ public:
 
 	virtual Vec3d shade( Scene *scene, const ray& r, const isect& i ) const;
 
+	// The two terms shade() adds up: emission plus ambient, and what one
+	// light adds given its shadow attenuation.  The wavefront tracer
+	// calls them separately and traces the shadow rays in between.
+	Vec3d shadeAmbient( Scene *scene, const isect& i ) const;
+	Vec3d shadeLight( const Light* light, const ray& r, const isect& i, const Vec3d& shadow ) const;
+
 
     
     Material &
@@ -191,11 +213,24 @@ public:
         _kt += m._kt;
         _index += m._index;
         _shininess += m._shininess;
+        setBools();
         return *this;
     }
 
     friend Material operator*( double d, Material m );
 
+    // an ordering for sharing equal materials
+    bool operator<( const Material& m ) const
+    {
+        const MaterialParameter* a[8] = { &_ke, &_ka, &_ks, &_kd, &_kr, &_kt, &_shininess, &_index };
+        const MaterialParameter* b[8] = { &m._ke, &m._ka, &m._ks, &m._kd, &m._kr, &m._kt, &m._shininess, &m._index };
+        for( int k = 0; k < 8; ++k ) {
+            if( *a[k] < *b[k] ) return true;
+            if( *b[k] < *a[k] ) return false;
+        }
+        return false;
+    }
+
     // Accessor functions; we pass in an isect& for cases where
     // the parameter is dependent on, for example, world-space
     // coordinates (i.e., solid textures) or parametrized coordinates
@@ -245,8 +280,12 @@ public:
 	bool Recur() const { return _recur; }
 	bool Spec() const { return _spec; }
 	bool Both() const { return _both; }
+	// no transmission anywhere, not even through a texture
+	bool Opaque() const { return !_trans && !_kt.mapped(); }
 
 private:
+    friend class SceneFile;
+
     MaterialParameter _ke;                    // emissive
     MaterialParameter _ka;                    // ambient
     MaterialParameter _ks;                    // specular
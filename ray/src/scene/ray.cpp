@@ -7,3 +7,11 @@ isect::getMaterial() const
 {
     return material ? *material : obj->getMaterial();
 }
+
+const Material &
+isect::resolveMaterial( Material& scratch )
+{
+    if( !material )
+        material = &obj->getMaterialAt( *this, scratch );
+    return *material;
+}
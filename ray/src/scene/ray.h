@@ -31,12 +31,26 @@ public:
 	};
 
         ray(const Vec3d &pp, const Vec3d &dd, RayType tt = VISIBILITY)
-	  : p(pp), d(dd), t(tt) {}
-        ray(const ray& other) : p(other.p), d(other.d), t(other.t) {}
+	  : p(pp), t(tt) { setDirection(dd); }
+        ray(const ray& other) : p(other.p), d(other.d), invd(other.invd), t(other.t)
+	{ sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2]; }
 	~ray() {}
 
 	ray& operator =( const ray& other ) 
-	{ p = other.p; d = other.d; t = other.t; return *this; }
+	{ p = other.p; d = other.d; invd = other.invd; t = other.t;
+	  sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2];
+	  return *this; }
+
+	// d must only be changed through here, so invd and sign stay in step.
+	// A zero component gives an infinite invd, which the slab tests rely on.
+	void setDirection( const Vec3d& dd )
+	{
+		d = dd;
+		for( int k = 0; k < 3; ++k ) {
+			invd[k] = 1.0 / d[k];
+			sign[k] = invd[k] < 0.0;
+		}
+	}
 
 	Vec3d at( double t ) const
 	{ return p + (t*d); }
@@ -48,66 +62,48 @@ public:
 public:
 	Vec3d p;
 	Vec3d d;
+	Vec3d invd;		// 1/d per axis, for box tests
+	int sign[3];	// 1 where invd is negative: the box side the ray enters by
 	RayType t;
 };
 
 // The description of an intersection point.
 
+// isects are copied for every candidate hit during traversal, so they own
+// nothing: the default copy is a handful of doubles and pointers.
+
 class isect
 {
 public:
-    isect() : obj( NULL ), t( 0.0 ), N(), material(0) {}
-	isect(const isect& other)
-	{
-		obj = other.obj;
-		t = other.t;
-		N = other.N;
-		bary = other.bary;
-		uvCoordinates = other.uvCoordinates;
-		if (other.material) material = new Material(*other.material);
-		else material = 0;
-	}
-
-	~isect() { delete material; }
-    
-    isect& operator = (const isect& other) {
-        if( this != &other ) {
-            obj = other.obj;
-            t = other.t;
-            N = other.N;
-			bary = other.bary;
-            uvCoordinates = other.uvCoordinates;
-			if( other.material ) {
-                if( material ) *material = *other.material;
-                else material = new Material(*other.material );
-            }
-            else {
-                delete material;
-                material = 0;
-            }
-        }
-        return *this;
-    }
+    isect() : obj( NULL ), part( -1 ), t( 0.0 ), N(), material(0) {}
 
     void setObject(const SceneObject *o) { obj = o; }
+    void setPart(int p) { part = p; }
     void setT(double tt) { t = tt; }
     void setN(const Vec3d& n) { N = n; }
-    void setMaterial(const Material& m)  { if(material) *material = m; else material = new Material(m); }
+    void setMaterial(const Material& m)  { material = &m; }
     void setUVCoordinates( const Vec2d& coords ) { uvCoordinates = coords; }
     void setBary(const Vec3d& weights) { bary = weights; }
     void setBary(const double alpha, const double beta, const double gamma)
 		{ bary[0] = alpha; bary[1] = beta; bary[2] = gamma; }
     const Material &getMaterial() const;
 
+    // Find the material at the hit once it is final, blending it into
+    // scratch if the object's material varies over its surface.  scratch
+    // must outlive every later use of this isect.
+    const Material &resolveMaterial( Material& scratch );
+
 public:
     const SceneObject *obj;
+    int part;                   // the piece of obj that was hit, e.g. a mesh face
     double t;
     Vec3d N;
     Vec2d uvCoordinates;
     Vec3d bary;
-    Material *material;         // if this intersection has its own material
+    const Material *material;   // if this intersection has its own material
                                 // (as opposed to one in its associated object)
-                                // as in the case where the material was interpolated
+                                // as in the case where the material was interpolated.
+                                // Not owned.
 };
 
 const double RAY_EPSILON = 0.00000001;
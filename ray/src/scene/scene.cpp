@@ -1,11 +1,12 @@
 #include <cmath>
-#include <time.h>
+#include <chrono>
 
 #include "scene.h"
 #include "light.h"
-#include "../ui/TraceUI.h"
-
-extern TraceUI* traceUI;
+#include "../SceneObjects/trimesh.h"
+#include "../fileio/mappedfile.h"
+#include "../fileio/scenefile.h"
+#include "../fileio/treecache.h"
 
 using namespace std;
 
@@ -17,10 +18,9 @@ bool Geometry::intersect(ray& r, isect& i) const {
 	Vec3d dir = transform->globalToLocalCoords(r.p + r.d) - pos;
 	double length = dir.length();
 	dir /= length;
-	Vec3d Wpos = r.p;
-	Vec3d Wdir = r.d;
+	ray Wray(r);
 	r.p = pos;
-	r.d = dir;
+	r.setDirection(dir);
 	bool rtrn = false;
 	if (intersectLocal(r, i))
 	{
@@ -29,11 +29,46 @@ bool Geometry::intersect(ray& r, isect& i) const {
 		i.t /= length;
 		rtrn = true;
 	}
-	r.p = Wpos;
-	r.d = Wdir;
+	r = Wray;
 	return rtrn;
 }
 
+bool Geometry::occluded(ray& r, double tMax) const {
+	double tmin, tmax;
+	if (hasBoundingBoxCapability() && !(bounds.intersect(r, tmin, tmax))) return false;
+	// same transform as intersect(); local t is world t times length
+	Vec3d pos = transform->globalToLocalCoords(r.p);
+	Vec3d dir = transform->globalToLocalCoords(r.p + r.d) - pos;
+	double length = dir.length();
+	dir /= length;
+	ray Wray(r);
+	r.p = pos;
+	r.setDirection(dir);
+	bool rtrn = occludedLocal(r, tMax * length);
+	r = Wray;
+	return rtrn;
+}
+
+int Geometry::intersectPacket(RayPacket& pk, int mask, isect* hits, int found) const {
+	int closer = 0;
+	for (int k = 0; k < pk.size; ++k) {
+		if (!(mask & (1 << k))) continue;
+		ray r = pk.get(k);
+		isect cur;
+		if (intersect(r, cur) && (!(found & (1 << k)) || cur.t < hits[k].t)) {
+			hits[k] = cur;
+			pk.setBest(k, cur.t);
+			closer |= 1 << k;
+		}
+	}
+	return closer;
+}
+
+bool Geometry::occludedLocal(ray& r, double tMax) const {
+	isect i;
+	return intersectLocal(r, i) && i.t < tMax;
+}
+
 bool Geometry::hasBoundingBoxCapability() const {
 	// by default, primitives do not have to specify a bounding box.
 	// If this method returns true for a primitive, then either the ComputeBoundingBox() or
@@ -53,39 +88,165 @@ Scene::~Scene() {
     for( g = objects.begin(); g != objects.end(); ++g ) delete (*g);
     for( l = lights.begin(); l != lights.end(); ++l ) delete (*l);
     for( t = textureCache.begin(); t != textureCache.end(); t++ ) delete (*t).second;
+    for( mmap::iterator m = meshCache.begin(); m != meshCache.end(); ++m ) delete m->second;
     if (kdtree)
     	delete kdtree;
+    delete source;
+    delete treeSource;
 }
 
 void Scene::buildKdTree() {
-	clock_t t = clock();
+	// wall clock, clock() would add up the time of all build threads
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point t0 = Clock::now();
+	// shadow rays only need any hit if nothing lets light through
+	transmissive = false;
+	for (cgiter j = objects.begin(); j != objects.end(); ++j) {
+		const SceneObject* obj = dynamic_cast<const SceneObject*>(*j);
+		if (!obj || !obj->getMaterial().Opaque())
+			transmissive = true;
+	}
+
+	int method = settings.kdBuilder;
+	int width = settings.kdWidth;
+	int threads = settings.threadNum;
+
+	// trees read with a compiled scene are kept if they were built this way
+	if (kdtree && treeMethod == method && treeWidth == width) {
+		printf("kd trees loaded with the scene (%s, %d-wide): %d nodes, %d meshes\n",
+			method == KD_BUILD_BINNED ? "binned" : "sorted", kdtree->getWidth(),
+			kdtree->getNodeNum(), (int)meshCache.size());
+		return;
+	}
+	treeMethod = method;
+	treeWidth = width;
+
+	// the tree cache may have the trees of this geometry, built this way
+	std::unique_ptr<TreeCache> cache;
+	uint64_t key = 0;
+	if (!settings.treeCache.empty()) {
+		cache.reset(new TreeCache(settings.treeCache, (size_t)settings.treeCacheMB << 20));
+		key = treeKey(method, width);
+		if (MappedFile* file = cache->open(key)) {
+			try {
+				SceneFile::readTrees(this, file, key);
+				double seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+				printf("kd tree cache hit (%s, %d-wide): %016llx in %fs, %d nodes, %d meshes\n",
+					method == KD_BUILD_BINNED ? "binned" : "sorted", width, (unsigned long long)key,
+					seconds, kdtree->getNodeNum(), (int)meshCache.size());
+				return;
+			}
+			catch (SceneFileException& e) {
+				printf("kd tree cache: dropped %016llx, %s\n", (unsigned long long)key, e.message().c_str());
+				cache->remove(key);
+			}
+		}
+	}
+
 	if (kdtree) 
 		delete kdtree;
-	// std::vector<Geometry*> newObjects;
-	// typedef vector<Geometry*>::const_iterator iter;
-	// for(iter j = objects.begin(); j != objects.end(); ++j) {
-	// 	Geometry* t = (*j);
-	// 	if (t->ifTrimesh())	
-	// 		newObjects.insert(newObjects.end(), t->getFaces().begin(), t->getFaces().end());
-	// 	else
-	// 		newObjects.push_back(t);
-	// }
-	kdtree = new KdTree<Geometry>(objects, 5);
-
-	t = clock() - t;
-	printf ("build tree: %f\n",t,((float)t)/CLOCKS_PER_SEC);
-	printf("with %d objects and depth: %d\n", objects.size(), kdtree->getDepth());
+
+	// parallel phase: one bottom-level tree per unique mesh, each a task,
+	// then the top-level tree over the scene objects
+	TaskPool pool(threads);
+	TaskGroup meshes;
+	int faceNum = 0;
+	for (mmap::iterator m = meshCache.begin(); m != meshCache.end(); ++m) {
+		TrimeshMesh* mesh = m->second;
+		faceNum += mesh->faces.size();
+		pool.spawn(meshes, [mesh, method, width, &pool]() { mesh->buildTree(method, width, &pool); });
+	}
+	pool.wait(meshes);
+	KdTree<Geometry> tree(objects, 5, method, &pool);
+	Clock::time_point t1 = Clock::now();
+
+	// serial phase: lay the tree out in one array for traversal
+	kdtree = new KdAccel<Geometry>(tree, width);
+	Clock::time_point t2 = Clock::now();
+	// nothing is read from a cache entry any more
+	delete treeSource;
+	treeSource = NULL;
+
+	double parallel = std::chrono::duration<double>(t1 - t0).count();
+	double serial = std::chrono::duration<double>(t2 - t1).count();
+	printf ("build tree (%s, %d threads): %f (parallel %f, serial %f)\n",
+		method == KD_BUILD_BINNED ? "binned" : "sorted", threads,
+		parallel + serial, parallel, serial);
+	printf("with %d objects, %d trimeshes sharing %d meshes of %d faces in total\n",
+		(int)objects.size(), meshInstanceNum, (int)meshCache.size(), faceNum);
+	tree.getQuality().print();
+	printf("%d-wide nodes (%s): %d nodes, %d primitives, %d bytes\n", kdtree->getWidth(), kdtree->getKernel(),
+		kdtree->getNodeNum(), kdtree->getPrimNum(), kdtree->getBytes());
+	int meshNodes = 0, meshBytes = 0;
+	for (mmap::iterator m = meshCache.begin(); m != meshCache.end(); ++m) {
+		meshNodes += m->second->getTree()->getNodeNum();
+		meshBytes += m->second->getTree()->getBytes();
+	}
+	printf("mesh trees: %d nodes, %d bytes\n", meshNodes, meshBytes);
+	int meshId = 0;
+	for (mmap::iterator m = meshCache.begin(); m != meshCache.end(); ++m, ++meshId) {
+		const TrimeshMesh* mesh = m->second;
+		int faces = mesh->faces.size();
+		int bytes = mesh->getBytes();
+		printf("mesh %d: %d faces, %d vertices, %d bytes, %.1f bytes/triangle (%.1f in the tree)\n",
+			meshId, faces, (int)mesh->vertices.size(), bytes,
+			faces ? double(bytes)/faces : 0.0,
+			faces ? double(mesh->getTree()->getBytes())/faces : 0.0);
+	}
+
+	if (cache) {
+		bool stored = false;
+		try {
+			stored = cache->store(key, [this, key](const char* path) { SceneFile::writeTrees(*this, path, key); });
+		}
+		catch (SceneFileException& e) {
+			printf("kd tree cache: %s\n", e.message().c_str());
+		}
+		printf("kd tree cache miss: %016llx %s; %d entries, %.1f of %d MB, %d evicted\n",
+			(unsigned long long)key, stored ? "stored" : "not stored", cache->getEntryNum(),
+			cache->getBytes() / (1024.0 * 1024.0), settings.treeCacheMB, cache->getEvictedNum());
+	}
+}
+
+// Bump this when the builders change what they build for the same input,
+// so that cached trees of the old builders are not used.
+static const uint64_t TREE_BUILDER_VERSION = 1;
+
+// FNV-1a, as the meshes hash their contents
+static void hashBytes(uint64_t& h, const void* data, size_t n) {
+	const unsigned char* p = (const unsigned char*)data;
+	for (size_t k = 0; k < n; ++k) {
+		h ^= p[k];
+		h *= 1099511628211ULL;
+	}
+}
+
+// The mesh trees depend on the faces and vertices, which the meshes'
+// content hashes cover, and the top-level tree on the objects' bounds.
+uint64_t Scene::treeKey(int method, int width) const {
+	uint64_t h = 14695981039346656037ULL;
+	int64_t params[5] = { (int64_t)TREE_BUILDER_VERSION, method, width,
+		(int64_t)meshCache.size(), (int64_t)objects.size() };
+	hashBytes(h, params, sizeof(params));
+	for (mmap::const_iterator m = meshCache.begin(); m != meshCache.end(); ++m) {
+		uint64_t mesh[2] = { (uint64_t)m->first, m->second->faces.size() };
+		hashBytes(h, mesh, sizeof(mesh));
+	}
+	for (cgiter j = objects.begin(); j != objects.end(); ++j) {
+		BoundingBox b = (*j)->getBoundingBox();
+		unsigned char empty = b.isEmpty();
+		Vec3d corners[2] = { b.getMin(), b.getMax() };
+		hashBytes(h, &empty, 1);
+		hashBytes(h, corners, sizeof(corners));
+	}
+	return h;
 }
 
 // Get any intersection with an object.  Return information about the 
 // intersection through the reference parameter.
 bool Scene::intersect(ray& r, isect& i) const {
-	clock_t t = clock();
-
-	double tmin = 0.0;
-	double tmax = 0.0;
 	bool have_one = false;
-	if (traceUI->isUsingKdTree()) {
+	if (settings.useKdTree) {
 		have_one = kdtree->intersect(r,i);
 	} else {
 		typedef vector<Geometry*>::const_iterator iter;
@@ -100,15 +261,82 @@ bool Scene::intersect(ray& r, isect& i) const {
 		}
 	}
 
-	t = clock() - t;
-	// printf ("intersect: %f",t,((float)t)/CLOCKS_PER_SEC);
-	
 	if(!have_one) i.setT(1000.0);
 	// if debugging,
-	if (TraceUI::m_debug) intersectCache.push_back(std::make_pair(new ray(r), new isect(i)));
+	if (settings.debug) intersectCache.push_back(std::make_pair(new ray(r), new isect(i)));
 	return have_one;
 }
 
+int Scene::intersectPacket(RayPacket& pk, int mask, isect* hits) const {
+	int found = 0;
+	if (settings.useKdTree && !settings.debug) {
+		found = kdtree->intersectPacket(pk, mask, hits);
+	} else {
+		for (int k = 0; k < pk.size; ++k) {
+			if (!(mask & (1 << k))) continue;
+			ray r = pk.get(k);
+			if (intersect(r, hits[k]))
+				found |= 1 << k;
+		}
+	}
+	for (int k = 0; k < pk.size; ++k)
+		if ((mask & ~found) & (1 << k)) {
+			hits[k] = isect();
+			hits[k].setT(1000.0);
+		}
+	return found;
+}
+
+bool Scene::occluded(ray& r, double tMax) const {
+	// the debugging view wants to see where shadow rays stop
+	if (settings.debug) {
+		isect i;
+		return intersect(r, i) && i.t < tMax;
+	}
+	if (settings.useKdTree)
+		return kdtree->occluded(r, tMax);
+	for (cgiter j = objects.begin(); j != objects.end(); ++j)
+		if ((*j)->occluded(r, tMax))
+			return true;
+	return false;
+}
+
+TrimeshMesh* Scene::shareMesh(TrimeshMesh* mesh) {
+	size_t key = mesh->hash();
+	meshInstanceNum++;
+	std::pair<mmap::iterator, mmap::iterator> range = meshCache.equal_range(key);
+	for (mmap::iterator m = range.first; m != range.second; ++m) {
+		if (m->second->sameAs(*mesh)) {
+			delete mesh;
+			return m->second;
+		}
+	}
+	meshCache.insert(std::make_pair(key, mesh));
+	return mesh;
+}
+
+void Scene::resetStats() const {
+	if (kdtree)
+		kdtree->resetStats();
+	for (mmap::const_iterator m = meshCache.begin(); m != meshCache.end(); ++m)
+		if (m->second->getTree())
+			m->second->getTree()->resetStats();
+}
+
+long long Scene::getRayNum() const {
+	return kdtree ? kdtree->getStats().sum().rays : 0;
+}
+
+void Scene::printStats() const {
+	if (kdtree)
+		kdtree->getStats().print("kdtree");
+	KdTraversalStats meshStats;
+	for (mmap::const_iterator m = meshCache.begin(); m != meshCache.end(); ++m)
+		if (m->second->getTree())
+			meshStats.add(m->second->getTree()->getStats());
+	meshStats.print("mesh trees");
+}
+
 TextureMap* Scene::getTexture(string name) {
 	tmap::const_iterator itr = textureCache.find(name);
 	if(itr == textureCache.end()) {
@@ -21,15 +21,24 @@
 #include "camera.h"
 #include "bbox.h"
 #include "KdTree.h"
+#include "FlatKdTree.h"
+#include "KdAccel.h"
+#include "../RenderSettings.h"
 
 #include "../vecmath/vec.h"
 #include "../vecmath/mat.h"
 
 class Light;
 class Scene;
+class TrimeshMesh;
+class MappedFile;
 
 template <typename Obj>
 class KdTree;
+template <typename Obj>
+class FlatKdTree;
+template <typename Obj>
+class KdAccel;
 
 class SceneElement {
 
@@ -117,13 +126,20 @@ protected:
   // intersections performed in the object's local coordinate space
   // do not call directly - this should only be called by intersect()
   virtual bool intersectLocal(ray& r, isect& i ) const = 0;
+  // any hit before tMax, in local space; the default finds the closest one
+  virtual bool occludedLocal(ray& r, double tMax) const;
 
 public:
   // intersections performed in the global coordinate space.
   bool intersect(ray& r, isect& i) const;
+  // whether the ray hits the object before tMax, for shadow rays
+  bool occluded(ray& r, double tMax) const;
+  // intersect() for the lanes of mask of a packet, keeping each lane's
+  // hit only if it has none yet (its bit in found is clear) or this one
+  // is closer.  Returns the lanes whose hit was replaced.  The default
+  // traces the lanes one at a time.
+  virtual int intersectPacket(RayPacket& pk, int mask, isect* hits, int found) const;
 
-  virtual bool ifTrimesh() { return false; }  // used by KdTree, added by lihang liu
-  virtual std::vector<Geometry*> getFaces() { return std::vector<Geometry*>(); }
 
   virtual bool hasBoundingBoxCapability() const;
   const BoundingBox& getBoundingBox() const { return bounds; }
@@ -187,6 +203,8 @@ public:
  protected:
   BoundingBox bounds;
   TransformNode *transform;
+
+  friend class SceneFile;
 };
 
 // A SceneObject is a real actual thing that we want to model in the 
@@ -199,6 +217,11 @@ class SceneObject : public Geometry {
   virtual const Material& getMaterial() const = 0;
   virtual void setMaterial(Material *m) = 0;
 
+  // the material at hit i.  Objects with per-vertex materials blend them
+  // into scratch and return it; the rest just return their material.
+  virtual const Material& getMaterialAt(const isect&, Material&) const
+  { return getMaterial(); }
+
   void glDraw(int quality, bool actualMaterials, bool actualTextures) const;
 
  protected:
@@ -231,6 +254,9 @@ public:
   typedef std::vector<Geometry*>::iterator giter;
   typedef std::vector<Geometry*>::const_iterator cgiter;
 
+  // compiled scenes (.rayb) are written and read back member by member
+  friend class SceneFile;
+
   TransformRoot transformRoot;
 
   Scene() : transformRoot(), objects(), lights() {}
@@ -244,6 +270,15 @@ public:
   void add(Light* light) { lights.push_back(light); }
 
   bool intersect(ray& r, isect& i) const;
+  // Any-hit query: whether anything lies on the ray before tMax.  Stops at
+  // the first hit and computes no isect, for shadow rays.
+  bool occluded(ray& r, double tMax) const;
+  // closest hits of the lanes of mask of a packet; returns the lanes that
+  // hit.  Each lane gets the hit intersect() would give it.
+  int intersectPacket(RayPacket& pk, int mask, isect* hits) const;
+  // whether some object lets light through, so that a shadow ray needs
+  // the closest hit rather than any hit
+  bool hasTransmissive() const { return transmissive; }
 
   std::vector<Light*>::const_iterator beginLights() const { return lights.begin(); }
   std::vector<Light*>::const_iterator endLights() const { return lights.end(); }
@@ -259,6 +294,11 @@ public:
   // is destroyed.
   TextureMap* getTexture( string name );
 
+  // Trimeshes with identical vertices, normals and faces share one mesh,
+  // kept here like the textures.  Returns the cached copy of mesh and
+  // deletes mesh if there already was one.
+  TrimeshMesh* shareMesh( TrimeshMesh* mesh );
+
   // These two functions are for handling ambient light; in the Phong model,
   // the "ambient" light is considered a property of the _scene_ as a whole
   // and hence should be set here.
@@ -269,8 +309,18 @@ public:
 
   const BoundingBox& bounds() const { return sceneBounds; }
 
+  // the options of the render, set by the tracer before it loads or
+  // traces the scene; intersect() and the objects read them from here
+  void setSettings(const RenderSettings& s) { settings = s; }
+  const RenderSettings& getSettings() const { return settings; }
+
   void buildKdTree();
 
+  // traversal statistics of the kd trees, summed over all threads
+  void resetStats() const;
+  long long getRayNum() const;
+  void printStats() const;
+
  private:
   std::vector<Geometry*> objects;
   std::vector<Geometry*> nonboundedobjects;
@@ -284,13 +334,36 @@ public:
 
   typedef std::map< std::string, TextureMap* > tmap;
   tmap textureCache;
+
+  // unique meshes by content hash, and the number of trimeshes using them
+  typedef std::multimap< size_t, TrimeshMesh* > mmap;
+  mmap meshCache;
+  int meshInstanceNum = 0;
+
+  bool transmissive = false;
+
+  RenderSettings settings;
 	
   // Each object in the scene, provided that it has hasBoundingBoxCapability(),
   // must fall within this bounding box.  Objects that don't have hasBoundingBoxCapability()
   // are exempt from this requirement.
   BoundingBox sceneBounds;
   
-  KdTree<Geometry>* kdtree = NULL;
+  // top-level tree over the scene objects; every trimesh is a single
+  // object in it and traverses the bottom-level tree of its mesh
+  KdAccel<Geometry>* kdtree = NULL;
+  // how kdtree and the mesh trees were built, -1 if they weren't yet
+  int treeMethod = -1;
+  int treeWidth = -1;
+
+  // the compiled scene the trees and meshes were read from, if any; the
+  // tree nodes are used in place, so it is kept until the scene goes
+  MappedFile* source = NULL;
+  // the tree cache entry the trees were read from, if any, kept likewise
+  MappedFile* treeSource = NULL;
+
+  // names the trees the builder makes of the geometry as it is now
+  uint64_t treeKey(int method, int width) const;
 
  public:
   // This is used for debugging purposes only.
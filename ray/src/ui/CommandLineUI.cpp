@@ -2,14 +2,18 @@
 #include <time.h>
 #include <stdarg.h>
 #include <chrono>
+#include <algorithm>
 
 #include <assert.h>
-#include <thread>
+#include <string.h>
 
 #include "CommandLineUI.h"
 #include "../fileio/bitmap.h"
 
 #include "../RayTracer.h"
+#include "../RenderScheduler.h"
+#include "../RenderPool.h"
+#include "../Benchmark.h"
 
 using namespace std;
 
@@ -21,8 +25,13 @@ CommandLineUI::CommandLineUI( int argc, char* const* argv )
 	int i;
 
 	progName=argv[0];
+	benchName=NULL;
+	rayName=NULL;
+	imgName=NULL;
+	countName=NULL;
+	compile=false;
 
-	while( (i = getopt( argc, argv, "tr:w:h:" )) != EOF )
+	while( (i = getopt( argc, argv, "tr:w:h:b:k:m:n:ps:a:u:c:gfv:d:l:" )) != EOF )
 	{
 		switch( i )
 		{
@@ -33,6 +42,73 @@ CommandLineUI::CommandLineUI( int argc, char* const* argv )
 			case 'w':
 				m_nSize = atoi( optarg );
 				break;
+
+			case 'b':
+				m_nKdBuilder = atoi( optarg );
+				break;
+
+			case 'k':
+				m_nKdWidth = atoi( optarg );
+				break;
+
+			case 'm':
+				benchName = optarg;
+				break;
+
+			case 'n':
+				m_nThreadNum = atoi( optarg );
+				break;
+
+			case 'p':
+				m_bPinThreads = true;
+				break;
+
+			case 's':
+				m_nSuperSamplingNum = atoi( optarg );
+				break;
+
+			case 'a':
+				m_bAdaptive = true;
+				m_nAdaptiveThres = atoi( optarg );
+				break;
+
+			case 'u':
+				m_nSampleBudget = atoi( optarg );
+				break;
+
+			case 'c':
+				countName = optarg;
+				break;
+
+			case 'g':
+				m_bProgressive = true;
+				break;
+
+			case 'f':
+				m_bWavefront = true;
+				break;
+
+			case 'v':
+				m_nPacketSize = atoi( optarg ) >= 8 ? 8 : 4;
+				break;
+
+			case 'd':
+				m_treeCache = optarg;
+				break;
+
+			case 'l':
+				m_nTreeCacheMB = atoi( optarg );
+				break;
+
+			case '-':
+				if( strcmp( optarg, "--compile" ) == 0 )
+				{
+					compile = true;
+					break;
+				}
+				std::cerr << "Invalid argument: '" << optarg << "'." << std::endl;
+				usage();
+				exit(1);
 			default:
 			// Oops; unknown argument
 			std::cerr << "Invalid argument: '" << i << "'." << std::endl;
@@ -41,6 +117,14 @@ CommandLineUI::CommandLineUI( int argc, char* const* argv )
 		}
 	}
 
+	// benchmarks only need a scene, and some not even that
+	if( benchName )
+	{
+		if( optind < argc )
+			rayName = argv[optind];
+		return;
+	}
+
 	if( optind >= argc-1 )
 	{
 		std::cerr << "no input and/or output name." << std::endl;
@@ -51,31 +135,26 @@ CommandLineUI::CommandLineUI( int argc, char* const* argv )
 	imgName = argv[optind+1];
 }
 
-int CommandLineUI::thread_tracePixel(int numThread, int t) {
-	int width = m_nSize;
-	int height = (int)(width / raytracer->aspectRatio() + 0.5);
-
-	// for( int j = 0; j < height; ++j ) {
-	// 	if (j%numThread == t) {
-	// 		for( int i = 0; i < width; ++i )
-	// 			raytracer->tracePixel(i,j);
-	// 	}
-	// }
-	while (true) {
-		int t_coord = (cur_coordinate++);
-
-		int t_width = t_coord % width;
-		int t_height = t_coord/width;
-		if (t_height >= height) 
-			break;
-		raytracer->tracePixel(t_width,t_height);
-	}
-
-}
-
 int CommandLineUI::run()
 {
 	assert( raytracer != 0 );
+	raytracer->setSettings( getSettings() );
+	if( benchName )
+	{
+		if( rayName && !raytracer->loadScene( rayName ) )
+			return 1;
+		if( !runBenchmark( benchName, raytracer ) )
+		{
+			std::cerr << "unknown benchmark '" << benchName << "'" << std::endl;
+			usage();
+			return 1;
+		}
+		return 0;
+	}
+
+	if( compile )
+		return raytracer->compileScene( rayName, imgName ) ? 0 : 1;
+
 	raytracer->loadScene( rayName );
 
 	if( raytracer->sceneLoaded() )
@@ -89,20 +168,19 @@ int CommandLineUI::run()
     	c_start = chrono::system_clock::now();
 
     	// start multi thread
-		int numThread = thread::hardware_concurrency();
+		int numThread = m_nThreadNum;
 		printf("num thread: %d\n", numThread);
-		thread myThreads[numThread];
-
-		// init cur_coordinate
-		cur_coordinate = 0;
-
-		// thread running
-		for (int t=0;t<numThread;++t) {
-			myThreads[t] = thread(&CommandLineUI::thread_tracePixel, this, numThread, t);
-		}
-		for (int t=0;t<numThread;++t) {
-			myThreads[t].join();
+		RenderPool::instance().setPinned( m_bPinThreads );
+		RenderScheduler scheduler(raytracer, width, height, numThread);
+		if( m_bProgressive )
+		{
+			int passes = std::max(1, m_nSuperSamplingNum);
+			for( int pass = 0; pass < passes; ++pass )
+				scheduler.start(pass);
 		}
+		else
+			scheduler.start();
+		scheduler.wait();
 
 		// for( int j = 0; j < height; ++j )
 		// 	for( int i = 0; i < width; ++i )
@@ -111,6 +189,8 @@ int CommandLineUI::run()
 		c_end = chrono::system_clock::now();
 		chrono::duration<double> t = c_end-c_start;
 		std::cout << "total time = " << t.count() << " seconds, rays traced = " << width*height << std::endl;
+		raytracer->printStats();
+		scheduler.printStats();
 
 		// save image
 		unsigned char* buf;
@@ -119,6 +199,8 @@ int CommandLineUI::run()
 
 		if (buf)
 			writeBMP(imgName, width, height, buf);
+		if (countName)
+			raytracer->writeSampleCounts(countName);
 
         return 0;
 	}
@@ -137,7 +219,24 @@ void CommandLineUI::alert( const string& msg )
 void CommandLineUI::usage()
 {
 	std::cerr << "usage: " << progName << " [options] [input.ray output.bmp]" << std::endl;
+	std::cerr << "       " << progName << " --compile input.ray output.rayb" << std::endl;
 	std::cerr << "  -r <#>      set recursion level (default " << m_nDepth << ")" << std::endl; 
 	std::cerr << "  -w <#>      set output image width (default " << m_nSize << ")" << std::endl;
+	std::cerr << "  -s <#>      samples per pixel (default " << m_nSuperSamplingNum << ")" << std::endl;
+	std::cerr << "  -a <#>      adaptive sampling, up to -s samples per pixel while the error is above #*0.001" << std::endl;
+	std::cerr << "  -u <#>      average samples per pixel adaptive sampling may spend, below 4 all pixels get only # (default no limit)" << std::endl;
+	std::cerr << "  -c <file>   write the samples taken per pixel as a bmp" << std::endl;
+	std::cerr << "  -g          progressive, -s passes of one sample per pixel" << std::endl;
+	std::cerr << "  -f          wavefront, trace each tile as sorted streams of rays" << std::endl;
+	std::cerr << "  -v <#>      trace camera rays in packets of 4 (SSE) or 8 (AVX)" << std::endl;
+	std::cerr << "  -b <#>      kd tree builder, 0: sorted SAH, 1: binned SAH (default " << m_nKdBuilder << ")" << std::endl;
+	std::cerr << "  -k <#>      kd tree node width, 2, 4 (SSE) or 8 (AVX) (default " << m_nKdWidth << ")" << std::endl;
+	std::cerr << "  -d <dir>    keep built kd trees in dir and reuse them for the same geometry" << std::endl;
+	std::cerr << "  -l <#>      size limit of the -d directory in MB, least recently used go first (default " << m_nTreeCacheMB << ")" << std::endl;
+	std::cerr << "  -n <#>      number of threads (default " << m_nThreadNum << ")" << std::endl;
+	std::cerr << "  -p          pin the render threads to cores" << std::endl;
+	std::cerr << "  -m <name>   run a microbenchmark instead of rendering: " << benchmarkNames() << std::endl;
+	std::cerr << "  --compile   write input.ray, with its kd trees, as a compiled scene instead of rendering;" << std::endl;
+	std::cerr << "              a .rayb loads in place of a .ray, built with the same -b and -k" << std::endl;
 }
 
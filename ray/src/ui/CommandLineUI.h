@@ -30,18 +30,17 @@ public:
 	CommandLineUI( int argc, char* const* argv );
 	int		run();
 
-	int thread_tracePixel(int numThread, int t);
-
 	void		alert( const string& msg );
 
 private:
 	void		usage();
 
-	int 	cur_coordinate;
-
 	char*	rayName;
 	char*	imgName;
 	char*	progName;
+	char*	benchName;	// -m, run this benchmark instead of rendering
+	char*	countName;	// -c, write the sample counts here
+	bool	compile;	// --compile, write the scene as a .rayb instead of rendering
 };
 
 #endif
@@ -9,6 +9,7 @@
 #include <stdarg.h>
 #include <thread>
 #include <chrono>
+#include <algorithm>
 
 #ifndef COMMAND_LINE_ONLY
 
@@ -17,6 +18,7 @@
 
 #include "GraphicalUI.h"
 #include "../RayTracer.h"
+#include "../RenderScheduler.h"
 
 #define MAX_INTERVAL 500
 
@@ -57,6 +59,7 @@ void GraphicalUI::cb_load_scene(Fl_Menu_* o, void* v)
 
 	if (newfile != NULL) {
 		char buf[256];		
+		pUI->raytracer->setSettings(pUI->getSettings());
 		if (pUI->raytracer->loadScene(newfile)) {			
 			print(buf, "Ray <%s>", newfile);
 			stopTracing();	// terminate the previous rendering
@@ -149,6 +152,11 @@ void GraphicalUI::cb_kdTreeCheckButton(Fl_Widget* o, void* v)
 	((GraphicalUI*)(o->user_data()))->m_usingKdTree=int( ((Fl_Check_Button *)o)->value() ) ;
 }
 
+void GraphicalUI::cb_kdBinnedCheckButton(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_nKdBuilder=int( ((Fl_Check_Button *)o)->value() ) ;
+}
+
 void GraphicalUI::cb_threadNumSlides(Fl_Widget* o, void* v)
 {
 	((GraphicalUI*)(o->user_data()))->m_nThreadNum=int( ((Fl_Slider *)o)->value() ) ;
@@ -164,6 +172,36 @@ void GraphicalUI::cb_termThresSlides(Fl_Widget* o, void* v)
 	((GraphicalUI*)(o->user_data()))->m_ntermThres=int( ((Fl_Slider *)o)->value() ) ;
 }
 
+void GraphicalUI::cb_aaCheckButton(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_bAdaptive=( ((Fl_Check_Button *)o)->value() == 1 ) ;
+}
+
+void GraphicalUI::cb_aaThreshSlides(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_nAdaptiveThres=int( ((Fl_Slider *)o)->value() ) ;
+}
+
+void GraphicalUI::cb_aaSamplesSlides(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_nSampleBudget=int( ((Fl_Slider *)o)->value() ) ;
+}
+
+void GraphicalUI::cb_progressiveCheckButton(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_bProgressive=( ((Fl_Check_Button *)o)->value() == 1 ) ;
+}
+
+void GraphicalUI::cb_wavefrontCheckButton(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_bWavefront=( ((Fl_Check_Button *)o)->value() == 1 ) ;
+}
+
+void GraphicalUI::cb_packetSizeSlides(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_nPacketSize=int( ((Fl_Slider *)o)->value() ) ;
+}
+
 void GraphicalUI::cb_debuggingDisplayCheckButton(Fl_Widget* o, void* v)
 {
 	pUI=(GraphicalUI*)(o->user_data());
@@ -180,9 +218,6 @@ void GraphicalUI::cb_debuggingDisplayCheckButton(Fl_Widget* o, void* v)
 	  }
 }
 
-static int numRunningThread = 0;	// used for updating UI
-static int cur_coordinate = 0;
-
 void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 	char buffer[256];
 
@@ -195,6 +230,7 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 		int origPixels = width * height;
 		pUI->m_traceGlWindow->resizeWindow(width, height);
 		pUI->m_traceGlWindow->show();
+		pUI->raytracer->setSettings(pUI->getSettings());
 		pUI->raytracer->traceSetup(width, height);
 
 		// Save the window label
@@ -205,34 +241,40 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 
         // start multi thread
         int numThread = pUI->m_nThreadNum;
-        numRunningThread = numThread;
 		printf("num thread: %d\n", numThread);
-		thread myThreads[numThread];
-
-		// init cur_coordinate
-		cur_coordinate = 0;
+		RenderScheduler scheduler(pUI->raytracer, width, height, numThread);
+		// progressive: one pass per sample, each a whole (noisier) frame
+		bool progressive = pUI->m_bProgressive;
+		int passes = progressive ? std::max(1, pUI->m_nSuperSamplingNum) : 1;
+		int pass = 0;
+		scheduler.start(progressive ? pass : -1);
 
-		for (int t=0;t<numThread;++t) {
-			myThreads[t] = thread(&GraphicalUI::thread_tracePixel, pUI, numThread, t);
-		}
 		// update UI here
 		while (true) {
-			if (stopTrace || numRunningThread==0)
+			if (stopTrace)
 				break;
+			if (scheduler.done()) {
+				if (++pass >= passes)
+					break;
+				scheduler.start(pass);
+			}
 			// sleep
 			std::this_thread::sleep_for (std::chrono::milliseconds(pUI->refreshInterval*100));
 			// refresh UI
 			c_end = chrono::system_clock::now();
 			chrono::duration<double> t = c_end-c_start;
-			sprintf(buffer, "(%.2f seconds) %s", t.count(), old_label);
+			if (progressive)
+				sprintf(buffer, "(%.2f seconds, pass %d/%d) %s", t.count(), pass+1, passes, old_label);
+			else
+				sprintf(buffer, "(%.2f seconds) %s", t.count(), old_label);
 			pUI->m_traceGlWindow->label(buffer);
 			pUI->m_traceGlWindow->refresh();
 			Fl::check();
 			if (Fl::damage()) { Fl::flush(); }
 		}
-		for (int t=0;t<numThread;++t) {
-			myThreads[t].join();
-		}
+		if (stopTrace)
+			scheduler.stop();
+		scheduler.wait();
 		
 		doneTrace = true;
 		stopTrace = false;
@@ -240,6 +282,8 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 		c_end = chrono::system_clock::now();
 		chrono::duration<double> t = c_end-c_start;
 		std::cout << "total time = " << t.count() << " seconds, rays traced = " << width*height << std::endl;
+		pUI->raytracer->printStats();
+		scheduler.printStats();
 
 		// Restore the window label
 		pUI->m_traceGlWindow->label(old_label);
@@ -248,36 +292,6 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 	}
 }
 
-int GraphicalUI::thread_tracePixel(GraphicalUI* pUI, int numThread, int t) {
-	int width = pUI->getSize();
-	int height = (int)(width / pUI->raytracer->aspectRatio() + 0.5);
-
-	for (int y = 0; y < height; y++)
-	{
-		if (y%numThread != t)
-			continue;
-	    for (int x = 0; x < width; x++)
-	    {
-	    	if (stopTrace) { return 0; }
-			pUI->raytracer->tracePixel(x, y);
-			// pUI->m_debuggingWindow->m_debuggingView->setDirty();
-	    }
-	    if (stopTrace) { return 0; }
-	}
-
-	// while (true) {
-	// 	int t_coord = (cur_coordinate++);
-
-	// 	int t_width = t_coord % width;
-	// 	int t_height = t_coord/width;
-	// 	if (t_height >= height) 
-	// 		break;
-	// 	pUI->raytracer->tracePixel(t_width,t_height);
-	// }
-
-	numRunningThread --;
-}
-
 void GraphicalUI::cb_stop(Fl_Widget* o, void* v)
 {
 	pUI = (GraphicalUI*)(o->user_data());
@@ -410,6 +424,12 @@ GraphicalUI::GraphicalUI() : refreshInterval(10) {
 	m_kdTreeCheckButton->callback(cb_kdTreeCheckButton);
 	m_kdTreeCheckButton->value(m_usingKdTree);
 
+	// set up binned builder checkbox, used the next time a scene is loaded
+	m_kdBinnedCheckButton = new Fl_Check_Button(100, 140, 100, 20, "Binned SAH");
+	m_kdBinnedCheckButton->user_data((void*)(this));
+	m_kdBinnedCheckButton->callback(cb_kdBinnedCheckButton);
+	m_kdBinnedCheckButton->value(m_nKdBuilder);
+
 	// set up thread number slider
 	m_threadNumSlider = new Fl_Value_Slider(10, 165, 180, 20, "Thread Number");
 	m_threadNumSlider->user_data((void*)(this));	// record self to be used by static callback functions
@@ -450,6 +470,63 @@ GraphicalUI::GraphicalUI() : refreshInterval(10) {
 	m_termThresSlider->align(FL_ALIGN_RIGHT);
 	m_termThresSlider->callback(cb_termThresSlides);
 
+	// set up adaptive supersampling, up to the super sampling number per pixel
+	m_aaCheckButton = new Fl_Check_Button(10, 240, 140, 20, "Adaptive sampling");
+	m_aaCheckButton->user_data((void*)(this));
+	m_aaCheckButton->callback(cb_aaCheckButton);
+	m_aaCheckButton->value(m_bAdaptive);
+
+	m_aaThreshSlider = new Fl_Value_Slider(10, 265, 180, 20, "Adaptive error (*0.001)");
+	m_aaThreshSlider->user_data((void*)(this));	// record self to be used by static callback functions
+	m_aaThreshSlider->type(FL_HOR_NICE_SLIDER);
+	m_aaThreshSlider->labelfont(FL_COURIER);
+	m_aaThreshSlider->labelsize(12);
+	m_aaThreshSlider->minimum(1);
+	m_aaThreshSlider->maximum(100);
+	m_aaThreshSlider->step(1);
+	m_aaThreshSlider->value(m_nAdaptiveThres);
+	m_aaThreshSlider->align(FL_ALIGN_RIGHT);
+	m_aaThreshSlider->callback(cb_aaThreshSlides);
+
+	// average samples per pixel, 0 for no limit
+	m_aaSamplesSlider = new Fl_Value_Slider(10, 290, 180, 20, "Sample budget");
+	m_aaSamplesSlider->user_data((void*)(this));	// record self to be used by static callback functions
+	m_aaSamplesSlider->type(FL_HOR_NICE_SLIDER);
+	m_aaSamplesSlider->labelfont(FL_COURIER);
+	m_aaSamplesSlider->labelsize(12);
+	m_aaSamplesSlider->minimum(0);
+	m_aaSamplesSlider->maximum(16);
+	m_aaSamplesSlider->step(1);
+	m_aaSamplesSlider->value(m_nSampleBudget);
+	m_aaSamplesSlider->align(FL_ALIGN_RIGHT);
+	m_aaSamplesSlider->callback(cb_aaSamplesSlides);
+
+	// set up progressive checkbox: refine the whole image one sample per
+	// pixel at a time, up to the super sampling number
+	m_progressiveCheckButton = new Fl_Check_Button(10, 315, 140, 20, "Progressive");
+	m_progressiveCheckButton->user_data((void*)(this));
+	m_progressiveCheckButton->callback(cb_progressiveCheckButton);
+	m_progressiveCheckButton->value(m_bProgressive);
+
+	// set up wavefront checkbox: trace tiles as sorted ray streams
+	m_wavefrontCheckButton = new Fl_Check_Button(160, 315, 140, 20, "Wavefront");
+	m_wavefrontCheckButton->user_data((void*)(this));
+	m_wavefrontCheckButton->callback(cb_wavefrontCheckButton);
+	m_wavefrontCheckButton->value(m_bWavefront);
+
+	// camera rays traced together through the kd tree, 0 for one at a time
+	m_packetSizeSlider = new Fl_Value_Slider(10, 340, 180, 20, "Packet size");
+	m_packetSizeSlider->user_data((void*)(this));	// record self to be used by static callback functions
+	m_packetSizeSlider->type(FL_HOR_NICE_SLIDER);
+	m_packetSizeSlider->labelfont(FL_COURIER);
+	m_packetSizeSlider->labelsize(12);
+	m_packetSizeSlider->minimum(0);
+	m_packetSizeSlider->maximum(8);
+	m_packetSizeSlider->step(4);
+	m_packetSizeSlider->value(m_nPacketSize);
+	m_packetSizeSlider->align(FL_ALIGN_RIGHT);
+	m_packetSizeSlider->callback(cb_packetSizeSlides);
+
 
 	// set up debugging display checkbox
 	m_debuggingDisplayCheckButton = new Fl_Check_Button(10, 429, 140, 20, "Debugging display");
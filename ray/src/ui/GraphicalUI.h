@@ -28,8 +28,6 @@ public:
 
 	int run();
 
-	static int thread_tracePixel(GraphicalUI* pUI, int numThread, int t);
-
 	void alert( const string& msg );
 
 	// The FLTK widgets
@@ -49,12 +47,16 @@ public:
 	Fl_Slider*			m_threadNumSlider;
 	Fl_Slider*			m_superSamplingNumSlider;
 	Fl_Slider*			m_termThresSlider;
+	Fl_Slider*			m_packetSizeSlider;
 
 	Fl_Check_Button*	m_debuggingDisplayCheckButton;
 	Fl_Check_Button*	m_aaCheckButton;
+	Fl_Check_Button*	m_progressiveCheckButton;
+	Fl_Check_Button*	m_wavefrontCheckButton;
 	Fl_Check_Button*	m_kdCheckButton;
 	Fl_Check_Button*	m_cubeMapCheckButton;
 	Fl_Check_Button*	m_kdTreeCheckButton;
+	Fl_Check_Button*	m_kdBinnedCheckButton;
 	Fl_Check_Button*	m_ssCheckButton;
 	Fl_Check_Button*	m_shCheckButton;
 	Fl_Check_Button*	m_bfCheckButton;
@@ -108,7 +110,15 @@ private:
 
 	static void cb_termThresSlides(Fl_Widget* o, void* v);	
 
+	static void cb_aaCheckButton(Fl_Widget* o, void* v);
+	static void cb_aaThreshSlides(Fl_Widget* o, void* v);
+	static void cb_aaSamplesSlides(Fl_Widget* o, void* v);
+	static void cb_progressiveCheckButton(Fl_Widget* o, void* v);
+	static void cb_wavefrontCheckButton(Fl_Widget* o, void* v);
+	static void cb_packetSizeSlides(Fl_Widget* o, void* v);
+
 	static void cb_kdTreeCheckButton(Fl_Widget* o, void* v);
+	static void cb_kdBinnedCheckButton(Fl_Widget* o, void* v);
 
 	static void cb_render(Fl_Widget* o, void* v);
 	static void cb_stop(Fl_Widget* o, void* v);
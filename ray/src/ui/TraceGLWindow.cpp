@@ -40,6 +40,8 @@ int TraceGLWindow::handle(int event)
 		if(raytracer) 
 		{
 			std::cout << "Tracing ray at " << x << ", " << y << std::endl;
+			// the debugging view may have been switched on since the render
+			raytracer->setSettings(traceUI->getSettings());
 			// Have we re-sized since drawing?
 			if(!raytracer->isReady()) 
 				raytracer->traceSetup(m_nWindowWidth, m_nWindowHeight);
@@ -13,6 +13,8 @@
 #include <string>
 #include <thread>
 
+#include "../RenderSettings.h"
+
 using std::string;
 
 class RayTracer;
@@ -23,7 +25,11 @@ public:
                     m_shadows(true), m_smoothshade(true), raytracer(0),
                     m_nFilterWidth(1), m_usingCubeMap(0), m_usingKdTree(1),
                     m_nThreadNum(std::thread::hardware_concurrency()),
-                    m_nSuperSamplingNum(1), m_ntermThres(0)
+                    m_nSuperSamplingNum(1), m_ntermThres(0),
+                    m_nKdBuilder(1), m_nKdWidth(2), m_bPinThreads(false),
+                    m_bAdaptive(false), m_nAdaptiveThres(10), m_nSampleBudget(0),
+                    m_bProgressive(false), m_bWavefront(false), m_nPacketSize(0),
+                    m_nTreeCacheMB(1024)
                     {}
 
 	virtual int	run() = 0;
@@ -44,6 +50,40 @@ public:
 	int	getFilterWidth() const { return m_nFilterWidth; }
 	int getSuperSamplingNum() const { return m_nSuperSamplingNum; }
 	int getTermThres() const { return m_ntermThres; }
+	int getKdBuilder() const { return m_nKdBuilder; }
+	int getKdWidth() const { return m_nKdWidth; }
+	int getThreadNum() const { return m_nThreadNum; }
+	bool getPinThreads() const { return m_bPinThreads; }
+	bool isAdaptive() const { return m_bAdaptive; }
+	double getAdaptiveThres() const { return m_nAdaptiveThres*0.001; }
+	int getSampleBudget() const { return m_nSampleBudget; }
+	bool isProgressive() const { return m_bProgressive; }
+	bool isWavefront() const { return m_bWavefront; }
+	int getPacketSize() const { return m_nPacketSize; }
+
+	// everything a render needs, as it is set now
+	RenderSettings getSettings() const {
+		RenderSettings s;
+		s.depth = m_nDepth;
+		s.superSamplingNum = m_nSuperSamplingNum;
+		s.termThres = m_ntermThres*0.001;
+		s.adaptive = m_bAdaptive;
+		s.adaptiveThres = getAdaptiveThres();
+		s.sampleBudget = m_nSampleBudget;
+		s.progressive = m_bProgressive;
+		s.wavefront = m_bWavefront;
+		s.packetSize = m_nPacketSize;
+		s.useKdTree = m_usingKdTree;
+		s.useCubeMap = m_usingCubeMap;
+		s.filterWidth = m_nFilterWidth;
+		s.kdBuilder = m_nKdBuilder;
+		s.kdWidth = m_nKdWidth;
+		s.threadNum = m_nThreadNum;
+		s.debug = m_debug;
+		s.treeCache = m_treeCache;
+		s.treeCacheMB = m_nTreeCacheMB;
+		return s;
+	}
 
 	bool	shadowSw() const { return m_shadows; }
 	bool	smShadSw() const { return m_smoothshade; }
@@ -69,6 +109,17 @@ protected:
 	int m_nThreadNum;	// thread number
 	int m_nSuperSamplingNum;	// the number of samples per pixel
 	int m_ntermThres;	// termination threshold *0.001
+	int m_nKdBuilder;	// kd tree builder, 0: sorted SAH, 1: binned SAH
+	int m_nKdWidth;		// children per kd tree node: 2, 4 (SSE) or 8 (AVX)
+	bool m_bPinThreads;	// bind render threads to cores
+	bool m_bAdaptive;	// adaptive supersampling, up to m_nSuperSamplingNum per pixel
+	int m_nAdaptiveThres;	// error threshold of adaptive sampling *0.001
+	int m_nSampleBudget;	// average samples per pixel allowed, 0 for no limit
+	bool m_bProgressive;	// render m_nSuperSamplingNum passes of one sample per pixel
+	bool m_bWavefront;	// trace tiles as sorted ray streams, bounce by bounce
+	int m_nPacketSize;	// camera rays traced together, 4 or 8; 0 for one at a time
+	string m_treeCache;	// directory of built kd trees kept between runs, "" for none
+	int m_nTreeCacheMB;	// size limit of m_treeCache
 };
 
 #endif
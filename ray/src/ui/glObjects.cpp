@@ -341,6 +341,10 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 	// would involve changing the data storage method just for debugging purposes
 	// which is probably wrong.
 
+	const Faces& faces = mesh->faces;
+	const Vertices& vertices = mesh->vertices;
+	const Normals& normals = mesh->normals;
+
 	int* d;
 	if( actualMaterials )
 		d = &displayListWithMaterials;
@@ -357,9 +361,9 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 		glBegin( GL_TRIANGLES );
 		for( Faces::const_iterator itr = faces.begin(); itr != faces.end(); ++itr )
 		{
-			const int vert1 = (*(*itr))[0];
-			const int vert2 = (*(*itr))[1];
-			const int vert3 = (*(*itr))[2];
+			const int vert1 = (*itr)[0];
+			const int vert2 = (*itr)[1];
+			const int vert3 = (*itr)[2];
 
 			if( normals.empty() )
 			{
@@ -378,19 +382,19 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 			if( ! normals.empty() )
 				glNormal3dv( normals[vert1].getPointer() );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert1], *itr );
+				setGLMaterial( getVertexMaterial( vert1 ), this );
 			glVertex3dv( vertices[vert1].getPointer() );
 
 			if( ! normals.empty() )
 				glNormal3dv( normals[vert2].getPointer() );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert2], *itr );
+				setGLMaterial( getVertexMaterial( vert2 ), this );
 			glVertex3dv( vertices[vert2].getPointer() );
 
 			if( ! normals.empty() )
 				glNormal3dv( normals[vert3].getPointer() );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert3], *itr );
+				setGLMaterial( getVertexMaterial( vert3 ), this );
 			glVertex3dv( vertices[vert3].getPointer() );
 		}
 		glEnd();